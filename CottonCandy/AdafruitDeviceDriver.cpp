@@ -19,88 +19,242 @@
 
 #include "AdafruitDeviceDriver.h"
 
-//Those are modified in the interrupt call
-volatile byte msgQueue[MSG_QUEUE_CAPACITY];
-volatile uint8_t queueTail; //next index to write
-volatile uint8_t queueSize;
+#ifdef ADAFRUIT_PREAMBLE_SAMPLING
+#include <avr/wdt.h>
+#endif
 
-uint8_t queueHead; //next index to read;
+//Filled in the interrupt call
+FrameQueue adafruitRxQueue;
 
 byte *adafruitAddr;
 
 uint16_t totalInterferingMargin;
 
+uint8_t adafruitCsPin;
+
+//Set in the interrupt raised on DIO0 at the end of a transmission
+volatile bool adafruitTxDone = true;
+
+//Mode the transceiver goes to once the transmission has ended
+volatile uint8_t adafruitModeAfterTx = RX;
+
+void (*adafruitTxDoneCallback)() = nullptr;
+
+//Result of the channel activity detection, set in the interrupt
+enum
+{
+    CAD_PENDING,
+    CAD_CLEAR,
+    CAD_BUSY
+};
+volatile uint8_t adafruitCadResult = CAD_CLEAR;
+
+/* Registers of the SX127x */
+#define REG_FIFO 0x00
+#define REG_MODEM_STAT 0x18
+
+/* Signal detected, signal synchronized, RX on-going and header info valid */
+#define MODEM_STAT_RECEIVING 0x0F
+
+/**
+ * Reads n bytes from the FIFO of the SX127x in a single SPI transaction. The FIFO pointer
+ * advances on its own, so consecutive calls return consecutive bytes. The LoRa library is
+ * assumed to use the default SPI and frequency
+ */
+static void readFifo(byte *dst, uint8_t n)
+{
+    SPI.beginTransaction(SPISettings(LORA_DEFAULT_SPI_FREQUENCY, MSBFIRST, SPI_MODE0));
+    digitalWrite(adafruitCsPin, LOW);
+    SPI.transfer(REG_FIFO);
+    SPI.transfer(dst, n);
+    digitalWrite(adafruitCsPin, HIGH);
+    SPI.endTransaction();
+}
+
+/* Reads a register of the SX127x, with the same SPI settings as readFifo() */
+static uint8_t readRegister(uint8_t address)
+{
+    SPI.beginTransaction(SPISettings(LORA_DEFAULT_SPI_FREQUENCY, MSBFIRST, SPI_MODE0));
+    digitalWrite(adafruitCsPin, LOW);
+    SPI.transfer(address & 0x7F);
+    uint8_t value = SPI.transfer(0x00);
+    digitalWrite(adafruitCsPin, HIGH);
+    SPI.endTransaction();
+    return value;
+}
+
+#ifdef ADAFRUIT_PREAMBLE_SAMPLING
+//Set in the watchdog interrupt that ends a sampling period
+volatile bool adafruitWatchdogFired;
+
+ISR(WDT_vect)
+{
+    adafruitWatchdogFired = true;
+}
+
+/**
+ * Powers the MCU down until the watchdog fires after 16 ms << prescaler, or until another
+ * interrupt wakes it up. Returns true if the watchdog woke it up and the RTC alarm has not
+ * fired (before or during the sleep)
+ */
+static bool powerDownFor(uint8_t prescaler)
+{
+    //Make sure the debugging messages are printed correctly before goes to sleep
+    Serial.flush();
+
+    byte adcState = ADCSRA;
+    ADCSRA = 0;
+
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    sleep_enable();
+
+    noInterrupts();
+
+    //The INT line of the RTC is held low, the alarm would not wake the MCU up again
+    if (rtcAlarmFired)
+    {
+        sleep_disable();
+        interrupts();
+        ADCSRA = adcState;
+        return false;
+    }
+
+    adafruitWatchdogFired = false;
+
+    //Timed sequence: the watchdog only raises an interrupt, it does not reset the MCU
+    MCUSR &= ~bit(WDRF);
+    WDTCSR = bit(WDCE) | bit(WDE);
+    WDTCSR = bit(WDIE) | ((prescaler & 0x08) ? bit(WDP3) : 0) | (prescaler & 0x07);
+    wdt_reset();
+
+    interrupts();
+    sleep_cpu();
+    sleep_disable();
+
+    wdt_disable();
+
+    // millis() has been frozen while sleeping, the software clock must be resynchronized
+    invalidateClock();
+
+    ADCSRA = adcState;
+    return adafruitWatchdogFired && !rtcAlarmFired;
+}
+#endif
+
 AdafruitDeviceDriver::AdafruitDeviceDriver(byte *addr,
                                            uint8_t csPin, uint8_t rstPin, uint8_t intPin) : DeviceDriver()
 {
 
     LoRa.setPins(csPin, rstPin, intPin);
+    adafruitCsPin = csPin;
 
     setAddress(addr);
 
     this->irqPin = intPin;
-
-    queueHead = 0;
-    queueTail = 0;
-    queueSize = 0;
 }
 
 AdafruitDeviceDriver::~AdafruitDeviceDriver()
 {
 }
 
-void onReceive(int packetSize)
+/* Copies a received packet into the queue if it is for us */
+static void receivePacket(uint8_t packetSize)
 {
-    if (queueSize + packetSize > MSG_QUEUE_CAPACITY)
+    //A packet shorter than the destination address is not for anyone
+    if (packetSize < 2)
     {
-        Serial.println(F("Queue is full"));
         return;
     }
-    byte add0 = LoRa.read();
-    byte add1 = LoRa.read();
-    //Serial.print(add0, HEX);
-    //Serial.print(add1, HEX);
 
-    bool correctRecipient = true;
-    if ((adafruitAddr[0] != add0 ||
-         adafruitAddr[1] != add1) &&
-        !(add0 == 0xFF && add1 == 0xFF))
+    //Only the destination address is read before the packet is known to be for us. The packets
+    //that are not are left in the FIFO, the next one overwrites them
+    byte addr[2];
+    readFifo(addr, 2);
+
+    if ((adafruitAddr[0] != addr[0] ||
+         adafruitAddr[1] != addr[1]) &&
+        !(addr[0] == 0xFF && addr[1] == 0xFF))
     {
 
         // Compute the margin of the packet (i.e. How many dB higher than the minimum sensitivity)
         totalInterferingMargin += (LoRa.packetRssi() + 123);
-        correctRecipient = false;
-    }else{
-        //Write the destination address into the buffer as well
-        msgQueue[queueTail] = add0;
-        queueTail = (queueTail + 1) % MSG_QUEUE_CAPACITY;
-        msgQueue[queueTail] = add1;
-        queueTail = (queueTail + 1) % MSG_QUEUE_CAPACITY;
-        queueSize += 2;
-    }
-    // Serial.print("onReceive to queue, size: ");
-    // Serial.println(packetSize);
-    // Serial.print("Before, queue size: ");
-    // Serial.println(queueSize);
-
-    //Regardless of the correct recipient or not, we should read the buffer
-    while (LoRa.available())
-    {
-        byte result = LoRa.read();
-        // Serial.print("0x");
-        // Serial.print(result,HEX);
-        // Serial.print(" ");
-
-        //Save the packet to buffer if the recipient is correct
-        if(correctRecipient){
-            queueSize++;
-            msgQueue[queueTail] = result;
-            queueTail = (queueTail + 1) % MSG_QUEUE_CAPACITY;
-        }
+        return;
     }
-    //     Serial.println("");
-    //     Serial.print("After, queue end: ");
-    //     Serial.println(queueSize);
+
+    if (!adafruitRxQueue.beginFrame(packetSize))
+    {
+        Serial.println(F("Queue is full"));
+        return;
+    }
+
+    //Write the destination address into the buffer as well
+    adafruitRxQueue.write(addr[0]);
+    adafruitRxQueue.write(addr[1]);
+
+    //The rest of the packet goes straight into the queue, in two bursts if it wraps around
+    uint8_t remaining = packetSize - 2;
+    while (remaining > 0)
+    {
+        byte *dst;
+        uint8_t n = adafruitRxQueue.writeSpan(&dst, remaining);
+        readFifo(dst, n);
+        adafruitRxQueue.advance(n);
+        remaining -= n;
+    }
+
+    adafruitRxQueue.endFrame(LoRa.packetRssi(), (int8_t)LoRa.packetSnr(), millis());
+}
+
+void onReceive(int packetSize)
+{
+#ifdef ADAFRUIT_ISR_DEBUG_PIN
+    digitalWrite(ADAFRUIT_ISR_DEBUG_PIN, HIGH);
+#endif
+
+    receivePacket((uint8_t)packetSize);
+
+#ifdef ADAFRUIT_ISR_DEBUG_PIN
+    digitalWrite(ADAFRUIT_ISR_DEBUG_PIN, LOW);
+#endif
+}
+
+/* Puts the transceiver into a DeviceMode. Returns false for the modes that cannot be entered directly */
+static bool enterMode(uint8_t mode)
+{
+    switch (mode)
+    {
+    case SLEEP:
+        LoRa.sleep();
+        return true;
+
+    case RX:
+        LoRa.receive();
+        return true;
+
+    case STANDBY:
+        LoRa.idle();
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+void onTransmitted()
+{
+    //The transceiver is in STANDBY after a transmission
+    enterMode(adafruitModeAfterTx);
+    adafruitTxDone = true;
+
+    if (adafruitTxDoneCallback != nullptr)
+    {
+        adafruitTxDoneCallback();
+    }
+}
+
+void onChannelActivity(boolean detected)
+{
+    adafruitCadResult = detected ? CAD_BUSY : CAD_CLEAR;
 }
 
 bool AdafruitDeviceDriver::init()
@@ -115,6 +269,8 @@ bool AdafruitDeviceDriver::init(long frequency, uint8_t sf, long bw, uint8_t cr)
     m_sf = sf;
     m_bw = bw;
     m_cr = cr;
+    m_defaultSf = sf;
+    m_defaultBw = bw;
 
     if (!LoRa.begin(m_freq))
     {
@@ -128,7 +284,13 @@ bool AdafruitDeviceDriver::init(long frequency, uint8_t sf, long bw, uint8_t cr)
     LoRa.setCodingRate4(m_cr);
     LoRa.enableCrc();
 
+#ifdef ADAFRUIT_ISR_DEBUG_PIN
+    pinMode(ADAFRUIT_ISR_DEBUG_PIN, OUTPUT);
+#endif
+
     LoRa.onReceive(onReceive);
+    LoRa.onTxDone(onTransmitted);
+    LoRa.onCadDone(onChannelActivity);
     setMode(STANDBY);
     Serial.println(F("LoRa Module initialized"));
 
@@ -137,38 +299,161 @@ bool AdafruitDeviceDriver::init(long frequency, uint8_t sf, long bw, uint8_t cr)
 
 int AdafruitDeviceDriver::send(byte *destAddr, byte *msg, uint8_t msgLen)
 {
+    waitForTx();
+
+    uint16_t preambleLength = (m_wakeUpPreamble && m_sampleInterval > 0) ? wakeUpPreambleLength() : ADAFRUIT_PREAMBLE_LENGTH;
+    if (preambleLength != m_preambleLength)
+    {
+        m_preambleLength = preambleLength;
+        LoRa.setPreambleLength(preambleLength);
+    }
+
+    if (m_lbt)
+    {
+        uint8_t attempts = 1;
+        while (!channelClear())
+        {
+            if (attempts == ADAFRUIT_LBT_MAX_ATTEMPTS)
+            {
+                m_lbtFailures++;
+                break;
+            }
+            attempts++;
+            m_lbtDeferrals++;
+
+            //Keep receiving while deferring, the frame on air may be for us
+            LoRa.receive();
+            m_mode = RX;
+            sleepForMillis(::random(ADAFRUIT_LBT_MIN_DEFERRAL, ADAFRUIT_LBT_MAX_DEFERRAL + 1) << (m_sf - 7));
+        }
+    }
+
     LoRa.beginPacket();
     //LoRa.write(destAddr, 2);
     LoRa.write(msg, msgLen);
-    int result = LoRa.endPacket(false) == 1 ? 1 : -1;
-    //After transmission, the transceiver is still in TX state
-    //Therefore, we should change it to the RX state
-    LoRa.receive();
+
+    //After transmission, the transceiver is in STANDBY
+    //Therefore, the interrupt changes it to the RX state unless another mode is requested meanwhile
+    adafruitModeAfterTx = RX;
     m_mode = RX;
-    return result;
+    adafruitTxDone = false;
+
+    //Returns as soon as the transmission has started
+    if (LoRa.endPacket(true) != 1)
+    {
+        adafruitTxDone = true;
+        enterMode(RX);
+        return -1;
+    }
+
+    m_txPending = true;
+    m_txStart = getTimeMillis();
+    return 1;
 }
 
-byte AdafruitDeviceDriver::recv()
+bool AdafruitDeviceDriver::txDone()
 {
-    if (available())
+    if (!m_txPending)
     {
-        byte result = msgQueue[queueHead];
-        //Serial.print("Received: 0x");
-        //Serial.print(result,HEX);
-        //Serial.println("");
-        queueHead = (queueHead + 1) % MSG_QUEUE_CAPACITY;
-        queueSize--;
-        return result;
+        return true;
     }
-    else
+
+    if (!adafruitTxDone && getTimeMillis() - m_txStart < ADAFRUIT_TX_TIMEOUT)
     {
-        return -1;
+        return false;
+    }
+
+    if (!adafruitTxDone)
+    {
+        Serial.println(F("Warning: No end of transmission from the LoRa module"));
+        LoRa.idle();
+        enterMode(adafruitModeAfterTx);
+        adafruitTxDone = true;
+    }
+    m_txPending = false;
+    return true;
+}
+
+void AdafruitDeviceDriver::onTxDone(void (*callback)())
+{
+    adafruitTxDoneCallback = callback;
+}
+
+void AdafruitDeviceDriver::waitForTx()
+{
+    while (!txDone())
+    {
+    }
+}
+
+bool AdafruitDeviceDriver::channelClear()
+{
+    //A CAD would abort the frame being received
+    if (m_mode == RX && (readRegister(REG_MODEM_STAT) & MODEM_STAT_RECEIVING) != 0)
+    {
+        return false;
     }
+
+    adafruitCadResult = CAD_PENDING;
+    LoRa.channelActivityDetection();
+
+    unsigned long start = getTimeMillis();
+    while (adafruitCadResult == CAD_PENDING)
+    {
+        if (getTimeMillis() - start >= ADAFRUIT_CAD_TIMEOUT)
+        {
+            //Without the interrupt, the frame is sent as without listen before talk
+            Serial.println(F("Warning: No CAD result from the LoRa module"));
+            return true;
+        }
+    }
+
+    return adafruitCadResult == CAD_CLEAR;
+}
+
+byte AdafruitDeviceDriver::recv()
+{
+    return adafruitRxQueue.read();
 }
+
 int AdafruitDeviceDriver::available()
 {
-    return queueSize;
+    return adafruitRxQueue.available();
+}
+
+uint8_t AdafruitDeviceDriver::read(byte *dst, uint8_t n, unsigned long timeout)
+{
+    uint8_t count = adafruitRxQueue.read(dst, n);
+    unsigned long startTime = millis();
+
+    while (count < n && (unsigned long)(millis() - startTime) < timeout)
+    {
+        count += adafruitRxQueue.read(dst + count, n - count);
+    }
+
+    return count;
+}
+
+int16_t AdafruitDeviceDriver::peekFrameLength()
+{
+    return adafruitRxQueue.peekFrameLength();
+}
+
+bool AdafruitDeviceDriver::frameInfo(FrameInfo *info)
+{
+    return adafruitRxQueue.frameInfo(info);
 }
+
+void AdafruitDeviceDriver::skipFrame()
+{
+    adafruitRxQueue.skipFrame();
+}
+
+uint16_t AdafruitDeviceDriver::getRxOverflows()
+{
+    return adafruitRxQueue.arenaOverflows() + adafruitRxQueue.slotOverflows();
+}
+
 int AdafruitDeviceDriver::getLastMessageRssi()
 {
 
@@ -200,6 +485,7 @@ void AdafruitDeviceDriver::setFrequency(unsigned long frequency)
     }
     m_freq = frequency;
 
+    waitForTx();
     DeviceMode prevMode = m_mode;
     setMode(STANDBY);
     LoRa.setFrequency(frequency);
@@ -212,6 +498,7 @@ void AdafruitDeviceDriver::setSpreadingFactor(uint8_t sf)
 {
     if (m_sf != sf)
     {
+        waitForTx();
         m_sf = sf;
         LoRa.setSpreadingFactor(sf);
     }
@@ -221,6 +508,7 @@ void AdafruitDeviceDriver::setChannelBandwidth(long bw)
 {
     if (m_bw != bw)
     {
+        waitForTx();
         m_bw = bw;
         LoRa.setSignalBandwidth(bw);
     }
@@ -230,21 +518,140 @@ void AdafruitDeviceDriver::setCodingRateDenominator(uint8_t cr)
 {
     if (m_cr != cr)
     {
+        waitForTx();
         m_cr = cr;
         LoRa.setCodingRate4(cr);
     }
 }
 
+void AdafruitDeviceDriver::setDataRate(uint8_t dataRate)
+{
+    dataRate = constrain(dataRate, getMinDataRate(), getMaxDataRate());
+
+    if (dataRate < DEFAULT_DATA_RATE)
+    {
+        setChannelBandwidth(m_defaultBw);
+        setSpreadingFactor(m_defaultSf + (DEFAULT_DATA_RATE - dataRate));
+    }
+    else
+    {
+        setSpreadingFactor(m_defaultSf);
+        setChannelBandwidth(m_defaultBw << (dataRate - DEFAULT_DATA_RATE));
+    }
+}
+
+uint8_t AdafruitDeviceDriver::getMinDataRate()
+{
+    return DEFAULT_DATA_RATE - min(DEFAULT_DATA_RATE - MIN_DATA_RATE, 12 - m_defaultSf);
+}
+
+uint8_t AdafruitDeviceDriver::getMaxDataRate()
+{
+    uint8_t dataRate = DEFAULT_DATA_RATE;
+    while (dataRate < MAX_DATA_RATE && (m_defaultBw << (dataRate + 1 - DEFAULT_DATA_RATE)) <= 500E3)
+    {
+        dataRate++;
+    }
+    return dataRate;
+}
+
 uint8_t AdafruitDeviceDriver::getDeviceType()
 {
     return DeviceType::ADAFRUIT_LORA;
 }
 
+/**
+ * The caller waits for txDone() first, as the interrupts may be disabled here: DIO0 would wake the
+ * MCU at the end of the transmission rather than on a received frame, and waitForTx() would never
+ * see the end of it
+ */
 void AdafruitDeviceDriver::powerDownMCU()
 {
     deepSleep(irqPin);
 }
 
+void AdafruitDeviceDriver::powerDownMCUSampling()
+{
+#ifdef ADAFRUIT_PREAMBLE_SAMPLING
+    //Does not abort a frame that is being received
+    if (m_sampleInterval == 0 || m_mode != RX || (readRegister(REG_MODEM_STAT) & MODEM_STAT_RECEIVING) != 0)
+    {
+        powerDownMCU();
+        return;
+    }
+
+    //Receiving a frame takes its preamble (up to an interval) and its payload
+    uint8_t rxPrescaler = max(m_samplePrescaler + 2, 4);
+    rxPrescaler = min(rxPrescaler, 9);
+
+    while (true)
+    {
+        LoRa.sleep();
+
+        if (!powerDownFor(m_samplePrescaler))
+        {
+            //Another interrupt (e.g. the RTC alarm) woke the MCU up, or the alarm fired while the
+            //MCU was awake for the previous sample
+            break;
+        }
+
+        LoRa.idle();
+        if (channelClear())
+        {
+            continue;
+        }
+
+        //A preamble is on air, receive the frame. The receive interrupt wakes the MCU up
+        LoRa.receive();
+        if (!powerDownFor(rxPrescaler))
+        {
+            break;
+        }
+    }
+
+    //The driver is still in RX
+    LoRa.receive();
+#else
+    powerDownMCU();
+#endif
+}
+
+void AdafruitDeviceDriver::setPreambleSampling(uint16_t interval)
+{
+#ifndef ADAFRUIT_PREAMBLE_SAMPLING
+    //The watchdog interrupt is left to the sketch
+    interval = 0;
+#endif
+
+    if (interval < 16)
+    {
+        m_sampleInterval = 0;
+        return;
+    }
+
+    //The longest watchdog period that is not longer than the interval
+    m_samplePrescaler = 0;
+    while (m_samplePrescaler < 9 && (16U << (m_samplePrescaler + 1)) <= interval)
+    {
+        m_samplePrescaler++;
+    }
+    m_sampleInterval = 16U << m_samplePrescaler;
+}
+
+void AdafruitDeviceDriver::setWakeUpPreamble(bool enabled)
+{
+    m_wakeUpPreamble = enabled;
+}
+
+uint16_t AdafruitDeviceDriver::wakeUpPreambleLength()
+{
+    //The watchdog runs up to 25% slow, a symbol lasts 2^sf / bw
+    uint32_t symbols = (((uint32_t)m_sampleInterval * 5 / 4) * (m_bw / 1000)) >> m_sf;
+    symbols += ADAFRUIT_PREAMBLE_LENGTH;
+
+    return (symbols > 0xFFFF) ? 0xFFFF : symbols;
+}
+
 uint16_t AdafruitDeviceDriver::getTotalInterferingMargin()
 {
     return totalInterferingMargin;
@@ -253,6 +660,23 @@ uint16_t AdafruitDeviceDriver::getTotalInterferingMargin()
 void AdafruitDeviceDriver::resetStatistics()
 {
     totalInterferingMargin = 0;
+    m_lbtDeferrals = 0;
+    m_lbtFailures = 0;
+}
+
+void AdafruitDeviceDriver::setListenBeforeTalk(bool enabled)
+{
+    m_lbt = enabled;
+}
+
+uint16_t AdafruitDeviceDriver::getLbtDeferrals()
+{
+    return m_lbtDeferrals;
+}
+
+uint16_t AdafruitDeviceDriver::getLbtFailures()
+{
+    return m_lbtFailures;
 }
 
 byte AdafruitDeviceDriver::random()
@@ -268,25 +692,22 @@ void AdafruitDeviceDriver::setMode(DeviceMode mode)
         return;
     }
 
-    switch (mode)
-    {
-    case SLEEP:
-        LoRa.sleep();
-        m_mode = mode;
-        break;
+    txDone();
 
-    case RX:
-        LoRa.receive();
+    //The transmission is not interrupted, the interrupt at its end switches to the mode instead
+    noInterrupts();
+    if (!adafruitTxDone)
+    {
+        adafruitModeAfterTx = mode;
         m_mode = mode;
-        break;
+        interrupts();
+        return;
+    }
+    interrupts();
 
-    case STANDBY:
-        LoRa.idle();
+    if (enterMode(mode))
+    {
         m_mode = mode;
-        break;
-
-    default:
-        break;
     }
 
     return;
@@ -299,6 +720,7 @@ void AdafruitDeviceDriver::setTxPwr(uint8_t pwr)
         return;
     }
     m_txPwr = pwr;
+    waitForTx();
     DeviceMode prevMode = m_mode;
     setMode(STANDBY);
 
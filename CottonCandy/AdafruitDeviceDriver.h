@@ -22,6 +22,7 @@
 
 #include "Arduino.h"
 #include "DeviceDriver.h"
+#include "FrameQueue.h"
 #include <LoRa.h>
 #include "Utilities.h"
 
@@ -31,13 +32,41 @@
 #define RFM95_INT 7
 #define RF95_FREQ 915E6
 
-#define MSG_QUEUE_CAPACITY 255
-
 #define DEFAULT_SPREADING_FACTOR 7
 #define DEFAULT_CHANNEL_BW 125E3
 #define DEFAULT_CODING_RATE_DENOMINATOR 5
 
-class AdafruitDeviceDriver : public DeviceDriver
+//Longer than the time on air of the longest frame at SF12 (ms)
+#define ADAFRUIT_TX_TIMEOUT 5000
+
+/**
+ * Listen before talk: send() runs a CAD first, and defers the frame by a random time while the
+ * channel is busy (ms at SF7, doubled with every step of the spreading factor). After
+ * ADAFRUIT_LBT_MAX_ATTEMPTS busy CADs, the frame is sent anyway
+ */
+#define ADAFRUIT_LBT_MIN_DEFERRAL 5
+#define ADAFRUIT_LBT_MAX_DEFERRAL 40
+#define ADAFRUIT_LBT_MAX_ATTEMPTS 8
+
+//A CAD takes a few symbols (ms)
+#define ADAFRUIT_CAD_TIMEOUT 100
+
+//Preamble of the frames that do not have to wake up a receiver (symbols, default of the SX127x)
+#define ADAFRUIT_PREAMBLE_LENGTH 8
+
+/**
+ * Uncomment to drive this pin HIGH for the duration of the receive interrupt, so that it can be
+ * measured with an oscilloscope or a logic analyzer
+ */
+//#define ADAFRUIT_ISR_DEBUG_PIN 5
+
+/**
+ * Uncomment to enable preamble sampling (setPreambleSampling()). The driver then defines the
+ * watchdog interrupt (WDT_vect), so the sketch cannot define its own
+ */
+//#define ADAFRUIT_PREAMBLE_SAMPLING
+
+class AdafruitDeviceDriver final : public DeviceDriver
 {
 public:
   /**
@@ -61,12 +90,28 @@ public:
 
   bool init(long frequency, uint8_t sf, long bw, uint8_t cr);
 
+  /**
+   * Returns once the frame is in the FIFO of the transceiver, which then transmits it on its own.
+   * The end of the transmission raises DIO0, and the transceiver goes to RX, or to the mode
+   * requested with setMode() while the frame was on air
+   */
   int send(byte *destAddr, byte *msg, uint8_t msgLen);
 
+  bool txDone();
+
+  void onTxDone(void (*callback)());
+
   byte recv();
 
   int available();
 
+  uint8_t read(byte *dst, uint8_t n, unsigned long timeout);
+  int16_t peekFrameLength();
+
+  bool frameInfo(FrameInfo *info);
+  void skipFrame();
+  uint16_t getRxOverflows();
+
   int getLastMessageRssi();
 
   uint8_t getDeviceType();
@@ -89,12 +134,36 @@ public:
   */
   void powerDownMCU();
 
+  /**
+   * Low-power listening: the transceiver sleeps and the MCU is powered down by the watchdog for
+   * the sampling interval, then a CAD looks for a preamble. The transceiver only stays in RX if it
+   * found one. The interval is rounded down to the periods of the watchdog (16 ms to 8 s), and
+   * the wake-up preamble covers it with a margin for the tolerance of the watchdog. A longer
+   * interval saves more energy in idle listening, but delays the wake-up frames by up to the
+   * interval and makes them longer on air.
+   *
+   * Only available with ADAFRUIT_PREAMBLE_SAMPLING defined, as the driver needs the watchdog
+   * interrupt (WDT_vect) for it. Otherwise the interval is ignored and the node listens continuously.
+   */
+  void setPreambleSampling(uint16_t interval);
+  void setWakeUpPreamble(bool enabled);
+  void powerDownMCUSampling();
+
   byte random();
 
   //Collect statistics
   uint16_t getTotalInterferingMargin();
   void resetStatistics();
 
+  /* Listen before talk in send(), disabled by default */
+  void setListenBeforeTalk(bool enabled);
+
+  /* Number of times send() found the channel busy and deferred the frame */
+  uint16_t getLbtDeferrals();
+
+  /* Number of frames sent on a busy channel after ADAFRUIT_LBT_MAX_ATTEMPTS */
+  uint16_t getLbtFailures();
+
   /*-----------Module Registers Configuration-----------*/
   void setAddress(byte *addr);
   void setFrequency(unsigned long frequency);
@@ -102,6 +171,14 @@ public:
   void setChannelBandwidth(long bw);
   void setCodingRateDenominator(uint8_t cr);
 
+  /**
+   * The data rates below the default raise the spreading factor of init() (up to SF12), the ones
+   * above it double the bandwidth (up to 500kHz)
+   */
+  void setDataRate(uint8_t dataRate);
+  uint8_t getMinDataRate();
+  uint8_t getMaxDataRate();
+
   void setMode(DeviceMode mode);
   void setTxPwr(uint8_t pwr);
 
@@ -111,9 +188,37 @@ private:
   long m_bw;
   uint8_t m_cr;
 
+  /* Modulation of DEFAULT_DATA_RATE */
+  uint8_t m_defaultSf;
+  long m_defaultBw;
+
   uint8_t m_txPwr = 17;
 
   uint8_t irqPin;
+
+  /* A frame has been sent and the driver has not seen the end of its transmission yet */
+  bool m_txPending = false;
+  unsigned long m_txStart;
+
+  /* Waits for the pending transmission to end (at most ADAFRUIT_TX_TIMEOUT) */
+  void waitForTx();
+
+  bool m_lbt = false;
+  uint16_t m_lbtDeferrals = 0;
+  uint16_t m_lbtFailures = 0;
+
+  /* Runs a CAD. Returns false if it detected LoRa symbols on the channel */
+  bool channelClear();
+
+  /* Sampling period as a watchdog prescaler (16 ms << prescaler), and in ms (0 when disabled) */
+  uint8_t m_samplePrescaler = 0;
+  uint16_t m_sampleInterval = 0;
+
+  bool m_wakeUpPreamble = false;
+  uint16_t m_preambleLength = ADAFRUIT_PREAMBLE_LENGTH;
+
+  /* Preamble that lasts longer than the sampling interval (symbols) */
+  uint16_t wakeUpPreambleLength();
 };
 
 #endif
@@ -43,6 +43,69 @@ void DeviceDriver::setTxPwr(uint8_t pwr){
     Serial.println(F("setTxPwr not implemented in this dummy driver"));
 }
 
+uint8_t DeviceDriver::read(byte* dst, uint8_t n, unsigned long timeout){
+    uint8_t count = 0;
+    unsigned long startTime = millis();
+
+    while (count < n && (unsigned long)(millis() - startTime) < timeout)
+    {
+        if (available())
+        {
+            dst[count++] = recv();
+        }
+    }
+
+    return count;
+}
+
+int16_t DeviceDriver::peekFrameLength(){
+    return -1;
+}
+
+bool DeviceDriver::frameInfo(FrameInfo *info){
+    return false;
+}
+
+void DeviceDriver::skipFrame(){
+
+}
+
+uint16_t DeviceDriver::getRxOverflows(){
+    return 0;
+}
+
+bool DeviceDriver::txDone(){
+    return true;
+}
+
+void DeviceDriver::onTxDone(void (*callback)()){
+}
+
+uint16_t DeviceDriver::getTimeScale(){
+    return 100;
+}
+
+void DeviceDriver::setPreambleSampling(uint16_t interval){
+}
+
+void DeviceDriver::setWakeUpPreamble(bool enabled){
+}
+
+void DeviceDriver::setDataRate(uint8_t dataRate){
+}
+
+uint8_t DeviceDriver::getMinDataRate(){
+    return DEFAULT_DATA_RATE;
+}
+
+uint8_t DeviceDriver::getMaxDataRate(){
+    return DEFAULT_DATA_RATE;
+}
+
+void DeviceDriver::powerDownMCUSampling(){
+    powerDownMCU();
+}
+
 uint16_t DeviceDriver::getTotalInterferingMargin(){
     return 0;
 }
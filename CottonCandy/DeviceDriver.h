@@ -26,6 +26,15 @@
 #define MIN_TX_PWR 9 // We can go down to 2 but it is very short-range
 #define MAX_TX_PWR 17 //We can go up to 23 but it will require more power
 
+/**
+ * Data rates of the links to the parent (see DeviceDriver::setDataRate()). DEFAULT_DATA_RATE is
+ * the modulation set up by init(). Every step below it doubles the time on air and gains ~3dB of
+ * sensitivity, every step above it halves the time on air
+ */
+#define MIN_DATA_RATE 0
+#define DEFAULT_DATA_RATE 2
+#define MAX_DATA_RATE 4
+
 static byte BROADCAST_ADDR[2] = {0xFF, 0xFF};
 
 typedef enum{
@@ -41,6 +50,19 @@ typedef enum{
     RX
 }DeviceMode;
 
+/* A received frame and its link metrics */
+struct FrameInfo
+{
+    /* Position of the first byte in the receive queue of the driver */
+    uint8_t offset;
+    uint8_t length;
+    int16_t rssi;
+    int8_t snr;
+
+    /* millis() when the frame was received */
+    unsigned long rxMillis;
+};
+
 class DeviceDriver{
 
 public:
@@ -64,11 +86,27 @@ public:
      */
     virtual int send(byte* destAddr, byte* msg, uint8_t msgLen) = 0;
 
+    /**
+     * A driver may return from send() as soon as the frame has been handed to the transceiver,
+     * while it is still on air. The caller can then reuse msg right away, and the driver waits
+     * for the transmission to end before it uses the transceiver again.
+     *
+     * txDone() returns false while such a frame is on air, and the callback registered with
+     * onTxDone() is called (from an interrupt) when it has been transmitted. With the default
+     * blocking send(), txDone() is always true and the callback is never called
+     */
+    virtual bool txDone();
+    virtual void onTxDone(void (*callback)());
+
     /**
      * Returns a byte received. Returns -1 if none available
      */
     virtual byte recv() = 0;
 
+    /**
+     * RSSI of the last message received. Without frameInfo(), it is called once for every message,
+     * right after its last byte has been read
+     */
     virtual int getLastMessageRssi() = 0;
 
     /**
@@ -76,12 +114,70 @@ public:
      */
     virtual int available() = 0;
 
+    /**
+     * Reads up to n bytes into dst, waiting at most timeout milliseconds for them to arrive.
+     * Returns the number of bytes read. The default implementation polls available() and recv()
+     */
+    virtual uint8_t read(byte* dst, uint8_t n, unsigned long timeout);
+
+    /**
+     * Number of unread bytes in the frame that the next read() starts with, 0 if nothing has
+     * been received yet, or -1 if the driver only provides a stream of bytes (default)
+     */
+    virtual int16_t peekFrameLength();
+
+    /**
+     * Frame-level API for the drivers that keep the boundaries of the received frames.
+     *
+     * frameInfo() describes the frame that the next recv() returns a byte of. It returns false
+     * if nothing has been received, or if the driver only provides a stream of bytes (default).
+     * skipFrame() drops the unread bytes of that frame, e.g. after a parse error. A stream driver
+     * may implement it to drop the rest of a message that could not be parsed instead.
+     */
+    virtual bool frameInfo(FrameInfo *info);
+    virtual void skipFrame();
+
+    /* Number of received frames that were dropped because the receive queue was full */
+    virtual uint16_t getRxOverflows();
+
     virtual uint8_t getDeviceType() = 0;
 
+    /**
+     * Time on air of a frame relative to the link the timing constants of the ForwardEngine were
+     * tuned for (SF7/125kHz, Ebyte 9.6kbps air rate over a 9600 baud UART), in percent. The
+     * receive timeouts and the backoffs are scaled with it. Default: 100
+     */
+    virtual uint16_t getTimeScale();
+
+    /**
+     * Low-power listening. With an interval, powerDownMCUSampling() may keep the transceiver
+     * asleep and only sample the channel for a preamble every interval ms. The frames that have
+     * to wake up such receivers are sent with setWakeUpPreamble(true), which makes their preamble
+     * longer than the interval. All the nodes use the same interval, 0 (default) listens
+     * continuously. Drivers without it ignore both
+     */
+    virtual void setPreambleSampling(uint16_t interval);
+    virtual void setWakeUpPreamble(bool enabled);
+
     virtual void setTxPwr(uint8_t pwr);
 
+    /**
+     * Switches the modulation to a data rate between getMinDataRate() and getMaxDataRate(). Drivers
+     * that cannot change it only support DEFAULT_DATA_RATE (default)
+     */
+    virtual void setDataRate(uint8_t dataRate);
+    virtual uint8_t getMinDataRate();
+    virtual uint8_t getMaxDataRate();
+
+    /**
+     * Powers the MCU down until the transceiver receives a frame or another interrupt fires. The
+     * interrupts may be disabled by the caller, which waits for txDone() before
+     */
     virtual void powerDownMCU();
 
+    /* powerDownMCU() in RX, sampling the channel (see setPreambleSampling()). Default: powerDownMCU() */
+    virtual void powerDownMCUSampling();
+
     virtual void setFrequency(unsigned long frequency) = 0;
 
     virtual void setMode(DeviceMode mode) = 0;
@@ -18,16 +18,77 @@
 */
 
 #include "EbyteDeviceDriver.h"
+#include "MessageProcessor.h"
+
+//Set in the interrupt on the rising edge of AUX that ends a transmission
+volatile bool ebyteTxDone = true;
+
+void (*ebyteTxDoneCallback)() = nullptr;
+
+uint8_t ebyteAuxPin;
+
+/* Air rate (REG0 bits 2-0), sub-packet size (REG1 bits 7-6) and air rate in bps of every EbyteProfile */
+static const struct
+{
+    byte airRate;
+    byte packetSize;
+    uint16_t bps;
+} PROFILES[] = {
+    {0b010, 0b00, 2400},
+    {0b100, 0b00, 9600},
+    {0b101, 0b01, 19200},
+    {0b111, 0b01, 62500}};
+
+/**
+ * Smallest sub-packet of the profiles (REG1 0b01). A longer frame would be split by the module,
+ * which appends an RSSI byte to every sub-packet, in the middle of the frame then
+ */
+#define EBYTE_MIN_SUB_PACKET_SIZE 128
+static_assert(EBYTE_ADDRESS_SIZE + 1 + TRX_BUFFER_SIZE + 1 <= EBYTE_MIN_SUB_PACKET_SIZE,
+              "The largest frame and its RSSI byte must fit in a sub-packet of every profile");
+
+/* UART baud rate bits of REG0 (7-5), -1 if the module does not support the baud rate */
+static int8_t baudRateBits(unsigned long baud)
+{
+    switch (baud)
+    {
+    case 1200:
+        return 0b000;
+    case 2400:
+        return 0b001;
+    case 4800:
+        return 0b010;
+    case 9600:
+        return 0b011;
+    case 19200:
+        return 0b100;
+    case 38400:
+        return 0b101;
+    case 57600:
+        return 0b110;
+    case 115200:
+        return 0b111;
+    default:
+        return -1;
+    }
+}
 
 EbyteDeviceDriver::EbyteDeviceDriver(uint8_t rx, uint8_t tx, uint8_t m0, uint8_t m1, uint8_t aux_pin, byte *addr,
-                                     uint8_t channel) : DeviceDriver()
+                                     uint8_t channel, EbyteProfile profile, unsigned long baud)
+    : EbyteDeviceDriver((HardwareSerial *)nullptr, m0, m1, aux_pin, addr, channel, profile, baud)
+{
+    m_softwareSerial = new SoftwareSerial(rx, tx);
+    module = m_softwareSerial;
+}
+
+EbyteDeviceDriver::EbyteDeviceDriver(HardwareSerial *serial, uint8_t m0, uint8_t m1, uint8_t aux_pin, byte *addr,
+                                     uint8_t channel, EbyteProfile profile, unsigned long baud) : DeviceDriver()
 {
-    this->rx = rx;
-    this->tx = tx;
     this->m0 = m0;
     this->m1 = m1;
     this->aux_pin = aux_pin;
-    module = new SoftwareSerial(rx, tx);
+    m_hardwareSerial = serial;
+    module = serial;
 
     if (sizeof(addr) < EBYTE_ADDRESS_SIZE)
     {
@@ -40,11 +101,19 @@ EbyteDeviceDriver::EbyteDeviceDriver(uint8_t rx, uint8_t tx, uint8_t m0, uint8_t
     }
 
     myChannel = channel;
+    m_profile = profile;
+
+    if (baudRateBits(baud) < 0)
+    {
+        Serial.println(F("Error: Baud rate not supported by the LoRa module, using 9600"));
+        baud = BAUD_RATE;
+    }
+    m_baud = baud;
 }
 
 EbyteDeviceDriver::~EbyteDeviceDriver()
 {
-    delete module;
+    delete m_softwareSerial;
 }
 
 bool EbyteDeviceDriver::init()
@@ -61,25 +130,14 @@ bool EbyteDeviceDriver::init()
         sleepForMillis(10);
     }
 
-    module->begin(BAUD_RATE);
+    beginSerial(BAUD_RATE);
     Serial.println(F("LoRa Module initialized"));
 
-    enterStandbyMode();
-    setAddress(m_addr);
-    setChannel(myChannel);
-    setNetId(0x00);
-    setAirRate();
-
-    //6th Byte: 0101 0000
-    //Fixed-Point tranmission: enabled
-    //Listen-before-talk: enabled
-    setOthers(0x50);
-
-    setEnableRSSI();
+    bool configured = enterStandbyMode() && configure();
 
     enterRxMode();
     Serial.println("Enter Transmission Mode");
-    return true;
+    return configured;
 }
 /**
  * Here we are using the fixed transmission feature in Ebyte. Thus, for every outgoing message, we
@@ -91,38 +149,88 @@ bool EbyteDeviceDriver::init()
  */
 int EbyteDeviceDriver::send(byte *destAddr, byte *msg, uint8_t msgLen)
 {
+    waitForTx();
 
-    uint8_t totalLen = 3 + msgLen;
+    //The wake-up frames go out in the WOR mode as transmitter, which receives like the transmission mode
+    bool wakeUp = m_wakeUpPreamble && m_worEnabled;
+    if (wakeUp && !m_worTransmitter)
+    {
+        enterWor(true);
+        m_mode = RX;
+    }
+    else if (!wakeUp && m_worTransmitter)
+    {
+        enterRxMode();
+        m_worTransmitter = false;
+    }
 
-    byte *data = new byte[totalLen];
-    memcpy(data, destAddr, EBYTE_ADDRESS_SIZE);
-    data[2] = (byte)myChannel;
+    //The header goes out first, the message is written from the buffer of the caller
+    byte header[3] = {destAddr[0], destAddr[1], (byte)myChannel};
 
-    memcpy(data + 3, msg, msgLen);
-    /*
-    Serial.print(F("Messsage to be sent 0x"));
+    //AUX goes LOW once the module has data to transmit, and back HIGH when it is done
+    ebyteTxDone = false;
+    ebyteAuxPin = aux_pin;
+    attachInterrupt(translateInterruptPin(aux_pin), txDoneISR, RISING);
 
-    for(int i = 0; i < totalLen; i++){
-         Serial.print(data[i], HEX);
-        Serial.print(" ");
-     }
-    Serial.print("\n");
-    */
-    int bytesSent = module->write(data, totalLen);
+    int bytesSent = module->write(header, sizeof(header));
+    bytesSent += module->write(msg, msgLen);
 
-    //Wait for the message written to the Ebyte chip
-    //This delay is estimated by using the maximum message length (~70 Bytes) divided by the
-    //baud rate (9600 8N1 ~= 1040 bytes per second) and get ~60ms
-    sleepForMillis(60);
+    m_txPending = true;
+    m_txStart = getTimeMillis();
 
-    //Wait till Ebyte has transmitted the message
-    while (digitalRead(this->aux_pin) != HIGH)
+    return bytesSent;
+}
+
+bool EbyteDeviceDriver::txDone()
+{
+    if (!m_txPending)
     {
+        return true;
     }
 
-    delete[] data;
+    //The wake-up preamble comes on top of the frame
+    unsigned long timeout = EBYTE_TX_TIMEOUT;
+    if (m_worTransmitter)
+    {
+        timeout += worPeriod();
+    }
 
-    return bytesSent;
+    if (!ebyteTxDone && getTimeMillis() - m_txStart < timeout)
+    {
+        return false;
+    }
+
+    if (!ebyteTxDone)
+    {
+        Serial.println(F("Warning: No end of transmission from the LoRa module"));
+        detachInterrupt(translateInterruptPin(aux_pin));
+        ebyteTxDone = true;
+    }
+    m_txPending = false;
+    return true;
+}
+
+void EbyteDeviceDriver::onTxDone(void (*callback)())
+{
+    ebyteTxDoneCallback = callback;
+}
+
+void EbyteDeviceDriver::txDoneISR()
+{
+    detachInterrupt(translateInterruptPin(ebyteAuxPin));
+    ebyteTxDone = true;
+
+    if (ebyteTxDoneCallback != nullptr)
+    {
+        ebyteTxDoneCallback();
+    }
+}
+
+void EbyteDeviceDriver::waitForTx()
+{
+    while (!txDone())
+    {
+    }
 }
 
 byte EbyteDeviceDriver::recv()
@@ -140,213 +248,298 @@ int EbyteDeviceDriver::available()
 {
     return module->available();
 }
+uint8_t EbyteDeviceDriver::read(byte *dst, uint8_t n, unsigned long timeout)
+{
+    //The UART does not keep the frame boundaries, so the caller decides how many bytes to wait for
+    module->setTimeout(timeout);
+    return module->readBytes(dst, n);
+}
 int EbyteDeviceDriver::getLastMessageRssi()
 {
+    byte rssi;
+    if (read(&rssi, 1, EBYTE_RSSI_BYTE_TIMEOUT) < 1)
+    {
+        Serial.println(F("Warning: No RSSI byte after the packet"));
+        return 0;
+    }
 
-    // retrieve rssi from register
-    module->write(0xC0);
-    module->write(0xC1);
-    module->write(0xC2);
-    module->write(0xC3);
+    //RSSI (dBm) = -(256 - value)
+    return -(256 - (int)rssi);
+}
 
-    module->write(0x01);
-    module->write(0x01);
+void EbyteDeviceDriver::skipFrame()
+{
+    byte discarded;
+    while (read(&discarded, 1, EBYTE_RSSI_BYTE_TIMEOUT) == 1)
+    {
+    }
+}
+
+bool EbyteDeviceDriver::switchMode(uint8_t m0Level, uint8_t m1Level)
+{
+    unsigned long start = micros();
+    digitalWrite(this->m0, m0Level);
+    digitalWrite(this->m1, m1Level);
 
-    int bytesRead = 0;
-    int result = 0;
-    while (bytesRead < 4)
+    // Wait for the falling edge of AUX that starts the switch, then for the rising one that ends it
+    while (digitalRead(this->aux_pin) == HIGH && micros() - start < EBYTE_AUX_FALL_WINDOW)
     {
-        if (module->available())
+    }
+
+    while (digitalRead(this->aux_pin) != HIGH)
+    {
+        if (micros() - start >= EBYTE_MODE_SWITCH_TIMEOUT * 1000UL)
         {
-            char b = module->read();
-            if (bytesRead == 2)
-                result = (int)b;
-            bytesRead++;
+            m_modeSwitchLatency = micros() - start;
+            Serial.println(F("Warning: AUX timeout during a mode switch"));
+            return false;
         }
     }
-    return result;
+    m_modeSwitchLatency = micros() - start;
+
+    sleepForMillis(EBYTE_AUX_SETTLE_TIME);
+    return true;
 }
 
-void EbyteDeviceDriver::enterStandbyMode()
+unsigned long EbyteDeviceDriver::getModeSwitchLatency()
 {
-    digitalWrite(this->m0, LOW);
-    digitalWrite(this->m1, HIGH);
-    //Need to wait for the configuration to be in effect
-    sleepForMillis(1000);
-    //Make Sure the AUX is now in HIGH state
-    while (digitalRead(this->aux_pin) != HIGH)
+    return m_modeSwitchLatency;
+}
+
+bool EbyteDeviceDriver::enterStandbyMode()
+{
+    if (!switchMode(LOW, HIGH))
     {
+        return false;
     }
-    Serial.println(F("Successfully entered CONFIGURATION mode"));
+    beginSerial(BAUD_RATE);
+    Serial.print(F("Successfully entered CONFIGURATION mode in (us) "));
+    Serial.println(m_modeSwitchLatency);
+    return true;
 }
 
 //Ebyte defines a transmission mode where both RX and TX can be performed
-void EbyteDeviceDriver::enterRxMode()
+bool EbyteDeviceDriver::enterRxMode()
 {
-    digitalWrite(this->m0, LOW);
-    digitalWrite(this->m1, LOW);
-    //Need to wait for the configuration to be in effect
-    sleepForMillis(1000);
-
-    //Make Sure the AUX is now in HIGH state
-    while (digitalRead(this->aux_pin) != HIGH)
+    if (!switchMode(LOW, LOW))
     {
+        return false;
     }
-    Serial.println(F("Successfully entered TRANSMISSION mode"));
+    beginSerial(m_baud);
+    Serial.print(F("Successfully entered TRANSMISSION mode in (us) "));
+    Serial.println(m_modeSwitchLatency);
+    return true;
 }
 
-void EbyteDeviceDriver::enterWorMode()
+bool EbyteDeviceDriver::enterWorMode()
 {
-    digitalWrite(this->m0, HIGH);
-    digitalWrite(this->m1, LOW);
-
-    //Need to wait for the configuration to be in effect
-    sleepForMillis(1000);
-    //Make Sure the AUX is now in HIGH state
-    while (digitalRead(this->aux_pin) != HIGH)
+    if (!switchMode(HIGH, LOW))
     {
+        return false;
     }
-    Serial.println(F("Successfully entered WOR mode"));
+    beginSerial(m_baud);
+    Serial.print(F("Successfully entered WOR mode in (us) "));
+    Serial.println(m_modeSwitchLatency);
+    return true;
 }
 
-void EbyteDeviceDriver::enterSleepMode()
+bool EbyteDeviceDriver::enterSleepMode()
 {
-    digitalWrite(this->m0, HIGH);
-    digitalWrite(this->m1, HIGH);
-
-    //Need to wait for the configuration to be in effect
-    sleepForMillis(1000);
-    //Make Sure the AUX is now in HIGH state
-    while (digitalRead(this->aux_pin) != HIGH)
+    if (!switchMode(HIGH, HIGH))
     {
+        return false;
     }
-    Serial.println(F("Successfully entered SLEEP mode"));
+    Serial.print(F("Successfully entered SLEEP mode in (us) "));
+    Serial.println(m_modeSwitchLatency);
+    return true;
 }
 
 /*-----------LoRa Configuration-----------*/
-void EbyteDeviceDriver::setAddress(byte *addr)
+bool EbyteDeviceDriver::configure()
 {
-    module->write(0xC0);
-    module->write((byte)0x00);
-    module->write(0x02);
-    module->write(addr, EBYTE_ADDRESS_SIZE);
+    byte config[EBYTE_CONFIG_SIZE];
 
-    //Block and read the reply to clear the buffer
-    receiveConfigReply(5);
+    //00H-01H: address, 02H: net id
+    config[0] = m_addr[0];
+    config[1] = m_addr[1];
+    config[2] = 0x00;
 
-    Serial.print(F("Successfully set Address to 0x"));
-    Serial.print(addr[0], HEX);
-    Serial.print(addr[1], HEX);
-    Serial.print("\n");
-}
+    //03H: UART baud rate, 8N1 and air rate (e.g. 0x64 = 0b01100100 for 9600 baud and 9.6kbps)
+    config[3] = (byte)(baudRateBits(m_baud) << 5 | PROFILES[m_profile].airRate);
 
-void EbyteDeviceDriver::setNetId(uint8_t netId)
-{
-    module->write(0xC0);
-    module->write(0x02);
-    module->write(0x01);
-    module->write((byte)netId);
+    //04H: sub-packet size, RSSI of the ambient noise enabled
+    config[4] = (byte)(PROFILES[m_profile].packetSize << 6 | 0x20);
 
-    //Read the reply to clear the buffer
-    receiveConfigReply(4);
+    //05H: channel (Frequency = 850.125 MHz + channel * 1 MHz)
+    config[5] = myChannel;
 
-    Serial.print(F("Successfully set Net Id to "));
-    Serial.print(netId);
-    Serial.print("\n");
+    //06H: 1101 0xxx
+    //RSSI byte appended to the received packets: enabled
+    //Fixed-Point tranmission: enabled
+    //Listen-before-talk: enabled
+    //WOR receiver with the WOR period
+    config[6] = EBYTE_REG3_OPTIONS | m_worCycle;
 
+    unsigned long start = getTimeMillis();
+    if (!writeRegisters(0x00, config, EBYTE_CONFIG_SIZE, true))
+    {
+        Serial.println(F("Error: Unable to configure the LoRa module"));
+        return false;
+    }
+
+    //Read the registers back, the reply to the write only echoes the command
+    byte readBack[EBYTE_CONFIG_SIZE];
+    if (!readRegisters(0x00, readBack, EBYTE_CONFIG_SIZE) || memcmp(config, readBack, EBYTE_CONFIG_SIZE) != 0)
+    {
+        Serial.println(F("Error: LoRa module configuration not applied"));
+        return false;
+    }
+
+    m_reg3 = config[6];
+
+    Serial.print(F("Successfully configured the LoRa module in (ms) "));
+    Serial.println(getTimeMillis() - start);
+    Serial.print(F("Air rate (bps): "));
+    Serial.println(PROFILES[m_profile].bps);
+    return true;
 }
 
-void EbyteDeviceDriver::setChannel(uint8_t channel)
+bool EbyteDeviceDriver::setChannel(uint8_t channel, bool save)
 {
-    module->write(0xC0);
-    module->write(0x05);
-    module->write(0x01);
-    module->write((byte)channel);
-
-    //Read the reply to clear the buffer
-    receiveConfigReply(4);
+    byte value = channel;
+    if (!writeRegisters(0x05, &value, 1, save))
+    {
+        Serial.println(F("Error: Unable to set the channel"));
+        return false;
+    }
 
-    //Frequency = 410.125 MHz + channel * 1 MHz
+    //Frequency = 850.125 MHz + channel * 1 MHz
     Serial.print(F("Successfully set Channel to "));
     Serial.print(channel);
     Serial.print("\n");
-
+    return true;
 }
 
 void EbyteDeviceDriver::setFrequency(unsigned long frequency)
 {
+    waitForTx();
+
     uint8_t channel = (uint8_t) ((frequency - BASE_FREQUENCY)/CHANNEL_INTERVAL);
-    
-    if(myChannel != channel){
+
+    if (channel == myChannel)
+    {
+        m_channelPending = false;
+        return;
+    }
+
+    m_pendingChannel = channel;
+    m_channelPending = true;
+
+    switch (m_mode)
+    {
+    case SLEEP:
+        // Written by setMode() when the module wakes up
+        break;
+
+    case STANDBY:
+        writePendingChannel();
+        break;
+
+    default:
+    {
         DeviceMode prevMode = m_mode;
-        
         setMode(STANDBY);
-        setChannel(channel);
         setMode(prevMode);
-
-        myChannel = channel;
+        break;
+    }
     }
 }
 
-void EbyteDeviceDriver::setOthers(byte config)
+bool EbyteDeviceDriver::writePendingChannel()
 {
-    module->write(0xC0);
-    module->write(0x06);
-    module->write(0x01);
-    module->write((byte)config);
+    unsigned long start = micros();
+    if (!setChannel(m_pendingChannel, false))
+    {
+        //Still pending, written again on the next mode switch
+        return false;
+    }
+    myChannel = m_pendingChannel;
+    m_channelPending = false;
+
+    Serial.print(F("Channel written in (us) "));
+    Serial.println(micros() - start);
+    return true;
+}
 
-    //Read the reply to clear the buffer
-    receiveConfigReply(4);
+bool EbyteDeviceDriver::writeRegisters(byte address, const byte *values, uint8_t len, bool save)
+{
+    // C2 writes the registers without saving them
+    module->write(save ? 0xC0 : 0xC2);
+    module->write(address);
+    module->write(len);
+    module->write(values, len);
+
+    //The module echoes the registers that have been written
+    byte reply[EBYTE_CONFIG_SIZE];
+    return receiveConfigReply(address, reply, len) && memcmp(reply, values, len) == 0;
+}
 
-    Serial.println(F("Successfully set other configs"));
+bool EbyteDeviceDriver::readRegisters(byte address, byte *values, uint8_t len)
+{
+    module->write(0xC1);
+    module->write(address);
+    module->write(len);
 
+    return receiveConfigReply(address, values, len);
 }
 
-void EbyteDeviceDriver::receiveConfigReply(int replyLen)
+bool EbyteDeviceDriver::receiveConfigReply(byte address, byte *values, uint8_t len)
 {
-    int bytesRead = 0;
-    while (bytesRead < replyLen)
+    //Reply: C1, address, length, registers
+    byte header[3];
+    module->setTimeout(EBYTE_CONFIG_REPLY_TIMEOUT);
+    if (module->readBytes(header, sizeof(header)) < sizeof(header) ||
+        module->readBytes(values, len) < len)
     {
-        if (module->available())
-        {
-            byte b = module->read();
-            //Serial.print(b,HEX);
-            bytesRead++;
-        }
+        Serial.println(F("Warning: No reply from the LoRa module"));
+        return false;
     }
-    //Serial.print("\n");
+
+    if (header[0] != 0xC1 || header[1] != address || header[2] != len)
+    {
+        Serial.println(F("Warning: Wrong reply from the LoRa module"));
+        return false;
+    }
+    return true;
 }
 
-void EbyteDeviceDriver::setEnableRSSI()
+void EbyteDeviceDriver::beginSerial(unsigned long baud)
 {
-    module->write(0xC0);
-    module->write(0x04);
-    module->write(0x01);
-    module->write(0x20);
-
-    //Read the reply to clear the buffer
-    receiveConfigReply(4);
-    
-    Serial.println(F("Successfully enable RSSI"));
+    if (m_serialBaud == baud)
+    {
+        return;
+    }
 
+    if (m_hardwareSerial)
+    {
+        m_hardwareSerial->flush();
+        m_hardwareSerial->begin(baud);
+    }
+    else
+    {
+        m_softwareSerial->begin(baud);
+    }
+    m_serialBaud = baud;
 }
 
-void EbyteDeviceDriver::setAirRate()
+uint16_t EbyteDeviceDriver::getTimeScale()
 {
+    // A frame goes over the UART of both nodes and through the air, about as long at the reference rates
+    uint16_t airScale = (uint32_t)BAUD_RATE * 100 / PROFILES[m_profile].bps;
+    uint16_t uartScale = (uint32_t)BAUD_RATE * 100 / m_baud;
+    uint16_t scale = (airScale + uartScale) / 2;
 
-    //Set baud rate to 9600
-    //Serial mode = 8N1
-    //Air rate = 9.6kbps
-    module->write(0xC0);
-    module->write(0x03);
-    module->write(0x01);
-    //0x64 = 0b01100100
-    module->write(0x64);
-
-    //Read the reply to clear the buffer
-    receiveConfigReply(4);
-
-    Serial.println(F("Successfully set the air rate"));
+    return (scale < EBYTE_MIN_TIME_SCALE) ? EBYTE_MIN_TIME_SCALE : scale;
 }
 
 uint8_t EbyteDeviceDriver::getInterruptPin()
@@ -366,6 +559,9 @@ void EbyteDeviceDriver::wakeISR()
 
 void EbyteDeviceDriver::powerDownMCU()
 {
+    //AUX wakes up the MCU, so the caller waits for txDone() first (the AUX interrupt that ends a
+    //transmission may be disabled here)
+
     //Make sure the debugging messages are printed correctly before goes to sleep
     Serial.flush();
 
@@ -382,6 +578,15 @@ void EbyteDeviceDriver::powerDownMCU()
     // ISR will detach interrupts and we won't wake.
     noInterrupts();
 
+    //The RTC alarm fired while the MCU was awake and cannot wake it up again
+    if (rtcAlarmFired)
+    {
+        sleep_disable();
+        interrupts();
+        ADCSRA = adc_state;
+        return;
+    }
+
     attachInterrupt(translateInterruptPin(aux_pin), wakeISR, FALLING);
 
     /* 
@@ -405,6 +610,9 @@ void EbyteDeviceDriver::powerDownMCU()
     sleep_cpu();  // one cycle
     //The MCU is turned off after this point
 
+    // millis() has been frozen while sleeping
+    invalidateClock();
+
     //When MCU wakes up, first thing is to disable the interrupt
     detachInterrupt(translateInterruptPin(aux_pin));
 
@@ -412,34 +620,120 @@ void EbyteDeviceDriver::powerDownMCU()
     ADCSRA = adc_state;
 }
 
+void EbyteDeviceDriver::powerDownMCUSampling()
+{
+    if (!m_worEnabled || m_mode != RX)
+    {
+        powerDownMCU();
+        return;
+    }
+
+    //The module only listens once per WOR period, AUX falls when it outputs a frame
+    bool wor = enterWor(false);
+    m_worTransmitter = false;
+
+    powerDownMCU();
+
+    //The module can only send in the transmission mode
+    if (wor)
+    {
+        enterRxMode();
+    }
+}
+
+bool EbyteDeviceDriver::enterWor(bool transmitter)
+{
+    byte reg3 = EBYTE_REG3_OPTIONS | (transmitter ? EBYTE_WOR_TRANSMITTER : 0) | m_worCycle;
+
+    //The role and the period can only be written in the configuration mode
+    if (reg3 != m_reg3)
+    {
+        if (!enterStandbyMode() || !writeRegisters(0x06, &reg3, 1, false))
+        {
+            enterRxMode();
+            return false;
+        }
+        m_reg3 = reg3;
+    }
+
+    if (!enterWorMode())
+    {
+        enterRxMode();
+        return false;
+    }
+    m_worTransmitter = transmitter;
+    return true;
+}
+
+unsigned long EbyteDeviceDriver::worPeriod()
+{
+    return (unsigned long)(m_worCycle + 1) * EBYTE_WOR_PERIOD_STEP;
+}
+
+void EbyteDeviceDriver::setPreambleSampling(uint16_t interval)
+{
+    if (interval < EBYTE_WOR_PERIOD_STEP)
+    {
+        m_worEnabled = false;
+        return;
+    }
+
+    uint16_t cycle = interval / EBYTE_WOR_PERIOD_STEP - 1;
+    m_worCycle = (cycle > EBYTE_WOR_MAX_CYCLE) ? EBYTE_WOR_MAX_CYCLE : cycle;
+    m_worEnabled = true;
+}
+
+void EbyteDeviceDriver::setWakeUpPreamble(bool enabled)
+{
+    m_wakeUpPreamble = enabled;
+}
+
 uint8_t EbyteDeviceDriver::getDeviceType()
 {
     return DeviceType::EBYTE_E22;
 }
 
 void EbyteDeviceDriver::setMode(DeviceMode mode){
+    waitForTx();
+
+    // A channel set while sleeping is written on the way out of sleep
+    if (m_channelPending && mode != SLEEP)
+    {
+        if (m_mode == STANDBY || enterStandbyMode())
+        {
+            m_mode = STANDBY;
+            m_worTransmitter = false;
+            writePendingChannel();
+        }
+    }
+
     if(m_mode == mode){
         return;
     }
 
+    //The mode is left unchanged if the module did not complete the switch
+    bool switched = false;
     switch (mode)
     {
     case SLEEP:
-        enterSleepMode();
-        m_mode = mode;
+        switched = enterSleepMode();
         break;
 
     case RX:
-        enterRxMode();
-        m_mode = mode;
+        switched = enterRxMode();
         break;
 
     case STANDBY:
-        enterStandbyMode();
-        m_mode = mode;
+        switched = enterStandbyMode();
         break;
     
     default:
         break;
     }
+
+    if (switched)
+    {
+        m_mode = mode;
+        m_worTransmitter = false;
+    }
 }
@@ -26,33 +26,126 @@
 #include "Utilities.h"
 #include <avr/sleep.h>
 
+/* UART baud rate of the configuration mode, and default for the transmission mode */
 #define BAUD_RATE 9600
 #define EBYTE_ADDRESS_SIZE 2
 
 #define BASE_FREQUENCY 850.125E6
 #define CHANNEL_INTERVAL 1E6
 
-class EbyteDeviceDriver : public DeviceDriver
+/**
+ * Mode switches (E22 datasheet): AUX goes LOW while the module reconfigures itself and back
+ * HIGH once it is done, typically after a few ms. It stays LOW longer if the module still has
+ * data to transmit or to output on the UART, hence the timeout (ms)
+ */
+#define EBYTE_MODE_SWITCH_TIMEOUT 100
+
+/* The falling edge of AUX is waited for this long (us) at most, it can be too short to be seen */
+#define EBYTE_AUX_FALL_WINDOW 1000
+
+/* The module accepts new commands 2ms after AUX goes HIGH */
+#define EBYTE_AUX_SETTLE_TIME 2
+
+/**
+ * Maximum time (ms) for a frame to be transmitted after send() (a 240-byte packet takes ~1s at
+ * 2.4kbps). The driver stops waiting for AUX after this
+ */
+#define EBYTE_TX_TIMEOUT 2000
+
+/**
+ * Maximum time (ms) to wait for the RSSI byte that the module appends to every received packet.
+ * It follows the last byte of the packet on the UART (~1ms at 9600 baud)
+ */
+#define EBYTE_RSSI_BYTE_TIMEOUT 10
+
+/* Maximum time (ms) to wait for the reply to a register command */
+#define EBYTE_CONFIG_REPLY_TIMEOUT 100
+
+/* Registers 00H-06H, which init() writes at once */
+#define EBYTE_CONFIG_SIZE 7
+
+/* REG3 (06H) without the WOR bits: RSSI byte, fixed transmission and listen before talk enabled */
+#define EBYTE_REG3_OPTIONS 0xD0
+
+/* REG3 bit 3: WOR transmitter instead of receiver */
+#define EBYTE_WOR_TRANSMITTER 0x08
+
+/* REG3 bits 2-0: the WOR period is (1 + cycle) * 500ms, up to 4s */
+#define EBYTE_WOR_PERIOD_STEP 500
+#define EBYTE_WOR_MAX_CYCLE 7
+
+/**
+ * The ForwardEngine timing is not scaled below this (percent): part of it is processing and
+ * wake-up time, which does not shrink with the air rate
+ */
+#define EBYTE_MIN_TIME_SCALE 25
+
+/**
+ * Air rate and sub-packet size written to the module at init(). All the nodes of a network
+ * must use the same profile
+ */
+typedef enum
+{
+    EBYTE_PROFILE_LONG_RANGE,  // 2.4kbps (factory default of the module), 240-byte packets
+    EBYTE_PROFILE_DEFAULT,     // 9.6kbps, 240-byte packets
+    EBYTE_PROFILE_FAST,        // 19.2kbps, 128-byte packets
+    EBYTE_PROFILE_DENSE        // 62.5kbps, 128-byte packets, for dense short-range clusters
+} EbyteProfile;
+
+class EbyteDeviceDriver final : public DeviceDriver
 {
 public:
-    EbyteDeviceDriver(uint8_t rx, uint8_t tx, uint8_t m0, uint8_t m1, uint8_t aux_pin, byte *addr, uint8_t channel);
+    /**
+     * The module is either on a SoftwareSerial (rx and tx pins), or on a HardwareSerial (e.g.
+     * Serial1), which does not block the interrupts while bytes are exchanged. The baud rate is
+     * used in the transmission mode, the configuration mode always runs at 9600 baud. Supported
+     * rates: 1200 to 115200 baud
+     */
+    EbyteDeviceDriver(uint8_t rx, uint8_t tx, uint8_t m0, uint8_t m1, uint8_t aux_pin, byte *addr, uint8_t channel,
+                      EbyteProfile profile = EBYTE_PROFILE_DEFAULT, unsigned long baud = BAUD_RATE);
+    EbyteDeviceDriver(HardwareSerial *serial, uint8_t m0, uint8_t m1, uint8_t aux_pin, byte *addr, uint8_t channel,
+                      EbyteProfile profile = EBYTE_PROFILE_DEFAULT, unsigned long baud = BAUD_RATE);
 
     ~EbyteDeviceDriver();
 
     bool init();
 
+    /**
+     * Returns once the frame has been written to the module, which then transmits it on its own.
+     * The end of the transmission is signalled by the rising edge of AUX
+     */
     int send(byte *destAddr, byte *msg, uint8_t msgLen);
 
+    bool txDone();
+
+    void onTxDone(void (*callback)());
+
     byte recv();
 
     int available();
 
+    uint8_t read(byte *dst, uint8_t n, unsigned long timeout);
+
+    /**
+     * Consumes the RSSI byte that the module appends to the packet, which must have been read up to
+     * its last byte. It costs no UART transaction with the module
+     */
     int getLastMessageRssi();
 
-    void enterStandbyMode();
-    void enterRxMode();
-    void enterWorMode();
-    void enterSleepMode();
+    /**
+     * Drops the rest of a packet that could not be parsed, and its RSSI byte. The module outputs
+     * them at once, so the packet ends when the UART has been idle for EBYTE_RSSI_BYTE_TIMEOUT
+     */
+    void skipFrame();
+
+    /* Each returns false if the module did not complete the switch in time */
+    bool enterStandbyMode();
+    bool enterRxMode();
+    bool enterWorMode();
+    bool enterSleepMode();
+
+    /* Duration (us) of the last mode switch */
+    unsigned long getModeSwitchLatency();
 
     uint8_t getInterruptPin();
 
@@ -60,37 +153,123 @@ public:
 
     static void wakeISR();
 
+    static void txDoneISR();
+
     void powerDownMCU();
 
+    /**
+     * Wake on radio. While the node waits in RX, powerDownMCUSampling() puts the module in the WOR
+     * mode as receiver: it only listens for a preamble once per WOR period, and AUX still wakes the
+     * MCU up when it outputs a frame. The wake-up frames are sent in the WOR mode as transmitter,
+     * with a preamble as long as the period. The interval is rounded down to the WOR periods of the
+     * module (500ms to 4s), below 500ms the module listens continuously
+     */
+    void setPreambleSampling(uint16_t interval);
+    void setWakeUpPreamble(bool enabled);
+    void powerDownMCUSampling();
+
     uint8_t getDeviceType();
 
+    uint16_t getTimeScale();
+
 private:
-    SoftwareSerial *module;
-    uint8_t rx;
-    uint8_t tx;
+    Stream *module;
+
+    /* Exactly one of them is set, to restart the UART at another baud rate */
+    SoftwareSerial *m_softwareSerial = nullptr;
+    HardwareSerial *m_hardwareSerial = nullptr;
+
+    EbyteProfile m_profile;
+    unsigned long m_baud;
+
+    /* Baud rate the UART of the MCU currently runs at, 0 before init() */
+    unsigned long m_serialBaud = 0;
+
     uint8_t m0;
     uint8_t m1;
     uint8_t aux_pin;
 
     uint8_t myChannel;
 
+    /**
+     * A channel set while the module sleeps is only written when it wakes up, on the way
+     * through the configuration mode, instead of waking it up for it
+     */
+    bool m_channelPending = false;
+    uint8_t m_pendingChannel;
+
+    unsigned long m_modeSwitchLatency = 0;
+
+    /* A frame has been sent and the driver has not seen the end of its transmission yet */
+    bool m_txPending = false;
+    unsigned long m_txStart;
+
+    /* REG3 as last written to the module */
+    byte m_reg3 = EBYTE_REG3_OPTIONS;
+
+    bool m_worEnabled = false;
+    uint8_t m_worCycle = 0;
+    bool m_wakeUpPreamble = false;
+
+    /**
+     * The module is in the WOR mode as transmitter since the last wake-up frame. It receives like
+     * in the transmission mode, only the next regular frame switches back
+     */
+    bool m_worTransmitter = false;
+
     /*-----------Module Registers Configuration-----------*/
-    void setAddress(byte *addr);
-    void setChannel(uint8_t channel);
-    void setNetId(uint8_t netId);
-    void setOthers(byte config);
-    void setEnableRSSI();
+    /**
+     * Writes the whole configuration (address, net id, UART and air rates, sub-packet size,
+     * channel and options) with a single command and reads it back. Returns false if the
+     * module did not apply it
+     */
+    bool configure();
+
+    /**
+     * The channel is saved in the flash of the module unless save is false. The channel
+     * changes during operation are not saved, which also spares the flash write. Returns false
+     * if the module did not apply it
+     */
+    bool setChannel(uint8_t channel, bool save = true);
 
     void setFrequency(unsigned long frequency);
     void setMode(DeviceMode mode);
 
+    /*-----------Helper Function-----------*/
     /**
-     * The function sets the air rate to 9.6kbps by default
+     * Writes len consecutive registers from address with a single command, saved in the flash
+     * of the module unless save is false. Returns false if the module did not echo them
      */
-    void setAirRate();
+    bool writeRegisters(byte address, const byte *values, uint8_t len, bool save);
 
-    /*-----------Helper Function-----------*/
-    void receiveConfigReply(int replyLen);
+    bool readRegisters(byte address, byte *values, uint8_t len);
+
+    /* Reads the reply to a register command. Returns false if it did not arrive within EBYTE_CONFIG_REPLY_TIMEOUT */
+    bool receiveConfigReply(byte address, byte *values, uint8_t len);
+
+    /* Sets M0 and M1 and waits for the module to complete the mode switch */
+    bool switchMode(uint8_t m0Level, uint8_t m1Level);
+
+    /**
+     * Writes the pending channel, the module has to be in the configuration mode. Returns false
+     * if the module did not apply it, the channel is still pending then
+     */
+    bool writePendingChannel();
+
+    /**
+     * Enters the WOR mode in the given role, writing REG3 first if the role or the period changed.
+     * Returns false, with the module back in the transmission mode, if it did not complete
+     */
+    bool enterWor(bool transmitter);
+
+    /* WOR period (ms) */
+    unsigned long worPeriod();
+
+    /* Waits for the pending transmission to end (at most EBYTE_TX_TIMEOUT) */
+    void waitForTx();
+
+    /* Restarts the UART of the MCU if it does not run at this baud rate yet */
+    void beginSerial(unsigned long baud);
 };
 
 #endif
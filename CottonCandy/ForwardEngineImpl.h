@@ -0,0 +1,1907 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * Definitions of the members of BasicForwardEngine. They are in a header so that an engine
+ * bound to a driver class at compile time (e.g. BasicForwardEngine<AdafruitDeviceDriver>) can be
+ * instantiated by the sketch. Only include ForwardEngine.h.
+ */
+
+#ifndef HEADER_FORWARD_ENGINE_IMPL
+#define HEADER_FORWARD_ENGINE_IMPL
+
+#include "MemoryFree.h"
+
+/* Defined in ForwardEngine.cpp */
+extern uint8_t myRTCInterruptPin;
+extern uint8_t myRTCVccPin;
+extern volatile uint8_t state;
+extern volatile bool alarmSetForReceiving;
+
+template <class Driver>
+BasicForwardEngine<Driver>::BasicForwardEngine(byte *addr, Driver *driver)
+{
+    this->setAddr(addr);
+
+    myDriver = driver;
+
+    // A node is its own parent initially
+    memcpy(myParent.parentAddr, myAddr, 2);
+    myParent.hopsToGateway = 255;
+    myParent.replySlot = NO_REPLY_SLOT;
+
+    numChildren = 0;
+    numOutgoingJoinAcks = 0;
+
+    /**
+     * Here we will set the random seed to a random value associated with the transceiver wideband RSSI
+     * If the transceiver does not have a random function, analogRead(A3) will be used (A3 must not be
+     * connected to anything)
+     */
+    randomSeed(analogRead(A3));
+
+    sleepMode = SleepMode::NO_SLEEP;
+}
+
+template <class Driver>
+BasicForwardEngine<Driver>::~BasicForwardEngine()
+{
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::setAddr(byte *addr)
+{
+    memcpy(myAddr, addr, 2);
+}
+
+template <class Driver>
+byte *BasicForwardEngine<Driver>::getMyAddr()
+{
+    return this->myAddr;
+}
+
+template <class Driver>
+byte *BasicForwardEngine<Driver>::getParentAddr()
+{
+    return this->myParent.parentAddr;
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::setGatewayReqTime(unsigned long gatewayReqTime)
+{
+    this->gatewayReqTime = gatewayReqTime;
+}
+
+template <class Driver>
+unsigned long BasicForwardEngine<Driver>::getGatewayReqTime()
+{
+    return this->gatewayReqTime;
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::onReceiveRequest(void (*callback)(byte **, byte *))
+{
+    this->onRecvRequest = callback;
+}
+template <class Driver>
+void BasicForwardEngine<Driver>::onReceiveResponse(void (*callback)(byte *, byte, byte *))
+{
+    this->onRecvResponse = callback;
+}
+template <class Driver>
+void BasicForwardEngine<Driver>::preDataCollectionCallback(void (*callback)())
+{
+    this->onPreDataCollection = callback;
+}
+template <class Driver>
+void BasicForwardEngine<Driver>::postDataCollectionCallback(void (*callback)())
+{
+    this->onPostDataCollection = callback;
+}
+
+/**
+ * The join function is responsible for sending out a beacon to discover neighboring
+ * nodes. After sending out the beacon, the node will receive messages for a given
+ * period of time. Since the node might receive multiple replies of its beacon, as well
+ * as the beacons from other nearby nodes, it waits for a period of time to collect info
+ * from the nearby neighbors, and pick the best parent using the replies received.
+ *
+ * Returns: True if the node has joined a parent
+ */
+template <class Driver>
+bool BasicForwardEngine<Driver>::join()
+{
+    if (state != DISCONNECTED)
+    {
+        // The node has already joined a network
+        return true;
+    }
+
+    Serial.println(F("Ready to join"));
+
+    MessageView msg;
+
+    ParentInfo bestCandidate;
+    bestCandidate.hopsToGateway = 255;
+
+    // Set the Tx power
+    myDriver->setMode(STANDBY);
+    myDriver->setTxPwr(m_txPwr);
+    myDriver->setFrequency(channelFrequency(DOWNLINK_CHANNEL));
+
+    Join beacon(myAddr);
+
+    // Send out the beacon once to discover nearby nodes
+    sendWakeUpMessage(BROADCAST_ADDR, &beacon);
+
+    unsigned long previousTime = getTimeMillis();
+
+    /**
+     * In this loop, for a period of MAX_JOIN_ACK_BACKOFF_TIME + some air time,
+     * the node will wait for joinAck messages
+     *
+     * It is possible that the node did not receive any joinAck messages at all.
+     * In this case, the loop will timeout eventually.
+     */
+
+    // Add 300ms for turning on RTC at the candidate and 200ms for air time
+    unsigned long timeout = scaledTime(MAX_JOIN_ACK_BACKOFF_TIME + 200) + 300;
+
+    /**
+     * The messages are handled as they arrive. Otherwise the beacons of the nodes that join at the
+     * same time could fill up the receive queue before the joinAcks arrive
+     */
+    while (getTimeMillis() - previousTime < timeout || myDriver->available())
+    {
+        if (!myDriver->available())
+        {
+            sleepForMillis(JOIN_POLL_INTERVAL);
+            continue;
+        }
+
+        // Now try to receive the message
+        // If no joinAck message has been received
+        if (!receiveMessage(myDriver, scaledTime(RECEIVE_TIMEOUT), &msg))
+        {
+            //Serial.println("no message");
+            continue;
+        }
+        else if (msg.type != MESSAGE_JOIN_ACK)
+        {
+            //Serial.println("wrong message");
+            continue;
+        }
+
+        JoinAckFields *ack = &msg.joinAck;
+        byte *nodeAddr = msg.srcAddr;
+
+        ParentInfo candidate;
+        memcpy(candidate.parentAddr, nodeAddr, 2);
+        candidate.hopsToGateway = ack->hopsToGateway;
+        candidate.numChildren = ack->numChildren;
+        // Relative until the end of the loop
+        candidate.nextGatewayReqTime = ack->nextReqTime;
+        candidate.replySlot = ack->replySlot;
+
+        // The JoinAck is sent at MAX_TX_PWR like the gateway requests
+        candidate.linkMargin = linkMargin(&msg);
+        candidate.txPwrBoost = 0;
+
+        // The uplink channel of the parent is only known from its first GatewayRequest
+        candidate.channel = DOWNLINK_CHANNEL;
+
+        /**
+         * Usually the lower one will be the rssiFeedback since the new node is using smaller tx power
+         * for broadcasting beacons
+         */
+        candidate.linkQuality = min(msg.rssi, ack->rssiFeedback);
+
+        Serial.print(F("Parent Candidate: src=0x"));
+        Serial.print(nodeAddr[0], HEX);
+        Serial.print(nodeAddr[1], HEX);
+        Serial.print(F(", Hops="));
+        Serial.print(candidate.hopsToGateway);
+        Serial.print(F(", # children="));
+        Serial.print(candidate.numChildren);
+        Serial.print(F(", Out RSSI="));
+        Serial.print(ack->rssiFeedback);
+        Serial.print(F(", In RSSI="));
+        Serial.print(msg.rssi);
+        Serial.print(F(", Link quality="));
+        Serial.print(candidate.linkQuality);
+        Serial.print(F(", Data collection in "));
+        Serial.println(candidate.nextGatewayReqTime);
+
+        if (candidate.linkQuality > MIN_LINK_QUALITY)
+        {
+            // Less hop is always prefered
+            if (candidate.hopsToGateway == bestCandidate.hopsToGateway)
+            {
+                if (candidate.numChildren == bestCandidate.numChildren)
+                {
+                    // Final tiebreaker using the link quality
+                    bestCandidate = (candidate.linkQuality > bestCandidate.linkQuality) ? candidate : bestCandidate;
+                }
+                else
+                {
+                    // First tiebreaker using the number of children
+                    bestCandidate = (candidate.numChildren < bestCandidate.numChildren) ? candidate : bestCandidate;
+                }
+            }
+            else
+            {
+                bestCandidate = (candidate.hopsToGateway < bestCandidate.hopsToGateway) ? candidate : bestCandidate;
+            }
+        }
+        else if (m_txPwr == MAX_TX_PWR && bestCandidate.hopsToGateway == 255)
+        {
+            // Take whatever possible if we have reached the max Tx power and there is still no parent
+            bestCandidate = candidate;
+        }
+    }
+
+    //Compensate for the 1.5 seconds in the loop (and 300ms in case the RTC has to be turned on for a resync)
+    time_t now = getTime(myRTCVccPin) - 2;
+
+    if (bestCandidate.hopsToGateway != 255)
+    {
+        bestCandidate.nextGatewayReqTime += now;
+
+        // New parent has found
+        Serial.print(F("Parent: 0x"));
+        Serial.print(bestCandidate.parentAddr[0], HEX);
+        Serial.println(bestCandidate.parentAddr[1], HEX);
+
+        myParent = bestCandidate;
+
+        hopsToGateway = myParent.hopsToGateway + 1;
+
+        Serial.println(F("Send JoinCFM to parent"));
+        // Send a confirmation to the parent node
+        
+        JoinCFM cfm(myAddr);
+        sendWakeUpMessage(myParent.parentAddr, &cfm);
+
+        //Reset the child list if there is any
+        children.clear();
+        numChildren = 0;
+        numOutgoingJoinAcks = 0;
+
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::handleJoin(MessageView *join)
+{
+    if (state != CONNECTED && state != READY1)
+    {
+        Serial.println(F("Wrong state for join messages"));
+        // Only process join messages during the connected phase and the ready phase
+        return;
+    }
+    // If a join message comes from the parent node, it suggests that the parent node has
+    // disconnected from the gateway, do not reply back with a JoinACK
+    if (DeviceDriver::compareAddr(join->srcAddr, myParent.parentAddr))
+    {
+        Serial.println(F("Parent node has disconnected from the gateway"));
+        return;
+    }
+
+    time_t now = getTime(myRTCVccPin);
+
+    // Remove those expired outgoing joinAcks
+    uint8_t numExpires = cleanChildrenList(now);
+    numOutgoingJoinAcks -= numExpires;
+
+    uint8_t c = children.find(join->srcAddr);
+    if( c != NO_CHILD){
+        children.linkMargin[c] = linkMargin(join);
+        if(children.confirmed[c]){
+            children.confirmed[c] = false;
+            numChildren --;
+        }
+    }else{
+        // Only send out joinAcks when there is sufficient capacity
+        if (numOutgoingJoinAcks + numChildren >= MAX_NUM_CHILDREN)
+        {
+            Serial.println(F("No more capacity for accepting new children"));
+            return;
+        }
+        c = children.add(join->srcAddr, false);
+        if (c == NO_CHILD)
+        {
+            Serial.println(F("Children table is full"));
+            return;
+        }
+        children.linkMargin[c] = linkMargin(join);
+    }
+
+    unsigned long backoff = random(0, scaledTime(MAX_JOIN_ACK_BACKOFF_TIME));
+
+    // Use full power when replies back
+    myDriver->setTxPwr(MAX_TX_PWR);
+    myDriver->setFrequency(channelFrequency(DOWNLINK_CHANNEL));
+
+    sleepForMillis(backoff);
+
+    now = getTime(myRTCVccPin);
+    
+    time_t timeTillNextReq = myParent.nextGatewayReqTime - now + ((unsigned long)m_forwardDelay)/MILLISECOND_MULTIPLIER;
+    // The child replies to the gateway requests in the slot matching its index in the children table
+    JoinAck ack(myAddr, hopsToGateway, numChildren, join->rssi, timeTillNextReq, c);
+    sendMessage(myDriver, join->srcAddr, &ack);
+    children.hasSlot[c] = true;
+
+    // revert the power
+    myDriver->setTxPwr(m_txPwr);
+
+    // If the node does not send back a CFM 4 seconds after its approximate discovery timeout, it is removed
+    children.joinAckExpiryTime[c] = now + scaledTime(MAX_JOIN_ACK_BACKOFF_TIME) / MILLISECOND_MULTIPLIER + 1;
+
+    numOutgoingJoinAcks++;
+
+    Serial.print(F("Send joinAck to a potential child: src=0x"));
+    Serial.print(join->srcAddr[0], HEX);
+    Serial.println(join->srcAddr[1], HEX);
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::handleJoinCFM(MessageView *cfm)
+{
+    uint8_t child = children.find(cfm->srcAddr);
+
+    if (child == NO_CHILD)
+    {
+        /**
+         * This node is not registered. It should not happen since every
+         * potential child is registered when a joinack is sent. However, if the
+         * potential child has delayed sending the CFM (for unknown reasons),
+         * then its record might be expired and removed.
+         */
+        child = children.add(cfm->srcAddr, true);
+        if (child == NO_CHILD)
+        {
+            Serial.println(F("Children table is full"));
+            return;
+        }
+        numChildren++;
+    }
+    else
+    {
+        // We have resigtered this node.
+        if (!children.confirmed[child])
+        {
+            children.confirmed[child] = true;
+            numChildren++;
+            numOutgoingJoinAcks--;
+        }
+        else
+        {
+            Serial.println(F("An existing child seems to re-join"));
+        }
+    }
+
+    Serial.print(F("A new child has connected: 0x"));
+    Serial.print(cfm->srcAddr[0], HEX);
+    Serial.println(cfm->srcAddr[1], HEX);
+
+    // Its slot may have belonged to another child in the last DCP
+    m_expectedReplies &= ~(1 << child);
+
+    time_t currentTime = getTime(myRTCVccPin);
+
+    /**
+     * If for a node or gateway,
+     * 1. the max capacity is reached, and
+     * 2. the gateway request will take more than 10 seconds to arrive (send)
+     * Go to sleep
+     */
+    if (state == CONNECTED && numChildren >= MAX_NUM_CHILDREN && myParent.nextGatewayReqTime - currentTime > 2 * EARLY_WAKE_UP_TIME)
+    {
+        state = HIBERNATE3;
+    }
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::handleReq(MessageView *msg)
+{
+    GatewayRequestFields *req = &msg->gatewayReq;
+
+    // GatewayReq is broadcasted, we should only accept REQ from the parent
+    if (!DeviceDriver::compareAddr(msg->srcAddr, myParent.parentAddr) && state != OBSERVE)
+    {
+        Serial.println(F("Req is not received from parent. Ignore."));
+        return;
+    }
+
+    // first gateway req in the cycle
+    // Usually the device should be in the READY state when receiving a request.
+    // However, in case the request arrives quickily (<5 seconds) after the node joins the network
+    if (state == READY1 || state == READY2 || state == CONNECTED || state == OBSERVE)
+    {
+
+        time_t receivingPeriodStart = getTime(myRTCVccPin);
+
+        if (state != OBSERVE)
+        {
+            // The requests are sent at MAX_TX_PWR, the average follows a change of the link within a few DCPs
+            myParent.linkMargin = (int8_t)((3 * (int)myParent.linkMargin + linkMargin(msg)) / 4);
+
+            if (state == READY2 || req->missedReply(myParent.replySlot))
+            {
+                // The first receiving period ended without the request, or the parent did not get our last reply
+                myParent.txPwrBoost = min(myParent.txPwrBoost + LINK_TX_PWR_STEP, MAX_TX_PWR - MIN_LINK_TX_PWR);
+            }
+            else if (myParent.txPwrBoost > 0)
+            {
+                myParent.txPwrBoost--;
+            }
+        }
+
+        if (req->newNextReqTime())
+        {
+            // Get the expected time for the next gateway request
+            gatewayReqTime = req->nextReqTime;
+            Serial.print(F("Next DCP will be in "));
+            Serial.println(gatewayReqTime);
+        }
+
+        // Estimate the time when the next request will arrive
+        myParent.nextGatewayReqTime = receivingPeriodStart + gatewayReqTime;
+
+        // Wake up in the next cycle to join the network
+        if (state == OBSERVE)
+        {
+            state = HIBERNATE1;
+            return;
+        }
+
+        resetPendingChildren();
+
+        /*
+         * For less frequent data gathering every 10 minutes or more (e.g.
+         * every hours), only receive for 5 minutes. For more frequent data
+         * gathering every 20 minutes or less (e.g. every 5 minutes), receive
+         * for 50% of the request interval 
+         * 
+         * TODO: Make this time more dynamic based on previous iterations
+         */
+        if (gatewayReqTime < 600)
+        {
+            // Calculate the end of the receiving period
+            receivingPeriod = gatewayReqTime / 2;
+        }
+        else
+        {
+            receivingPeriod = 300;
+        }
+
+        receivingPeriodTimeout = receivingPeriodStart + receivingPeriod;
+
+        //Serial.print(F("Receiving period: "));
+        //Serial.print(receivingPeriodStart);
+        //Serial.print(F(" to "));
+        //Serial.println(receivingPeriodTimeout);    
+
+        myParent.channel = req->ulChannel;
+        Serial.print(F("Switch to parent channel: "));
+        Serial.print(myParent.channel, DEC);
+        Serial.println();
+
+        uint64_t freq = channelFrequency(myParent.channel);
+
+        myDriver->setMode(STANDBY);
+        myDriver->setFrequency(freq);
+
+        // Only the replies are sent at the data rate of the parent
+        uint8_t dataRate = req->replyDataRate();
+
+        if (req->newMaxBackoff())
+        {
+            maxBackoffTime = (uint16_t)req->childBackoffTime * 1E3 + scaledTime(MIN_BACKOFF_TIME);
+            Serial.print(F("Max backoff: "));
+            Serial.println(maxBackoffTime);
+        }
+
+        uint16_t backoff = 0;
+        bool slotted = waitForReplySlot(req);
+
+        // The siblings are done after the last slot of the parent
+        uint16_t slotsEnd = REPLY_SLOT_OFFSET + req->numSlots * req->slotLength() + REPLY_SLOT_GUARD_TIME;
+        m_forwardDelay = slotted ? slotsEnd : maxBackoffTime;
+
+        if (!slotted)
+        {
+            // backoff to avoid collision
+            backoff = random(scaledTime(MIN_BACKOFF_TIME), maxBackoffTime);
+            Serial.print(F("First backoff: "));
+            Serial.println(backoff);
+
+            sleepForMillis(backoff);
+        }
+
+        // Use callback to get node data
+        byte data[MAX_LEN_DATA_NODE_REPLY];
+        uint8_t dataLen = 0;
+
+        /**
+         * For our test bed, we also add 2-byte parent address
+         * TODO: Remove it for real-life application
+         */
+        memcpy(data, myParent.parentAddr, 2);
+        byte* payload = data + 2;
+
+        if (onRecvRequest)
+        {
+            // Here it might take time to fetch the sensor data that the random backoff delay is not
+            // accounted for
+            onRecvRequest(&payload, &dataLen);
+        }
+
+        /**
+         * For our test bed, we also add 2-byte parent address
+         * TODO: Remove it for real-life application
+         */
+        dataLen += 2;
+
+        if(dataLen > 0 && dataLen <= MAX_LEN_DATA_NODE_REPLY){
+            uint8_t txPwr = uplinkTxPwr(dataRate);
+            Serial.print(F("Uplink TX power: "));
+            Serial.print(txPwr);
+            Serial.print(F(", Data rate="));
+            Serial.print(dataRate);
+            Serial.print(F(", Link margin="));
+            Serial.println(myParent.linkMargin);
+            myDriver->setDataRate(dataRate);
+            myDriver->setTxPwr(txPwr);
+
+            byte option = 0b0010000 | uplinkDataRate();
+            if (m_pendingChildren != 0)
+            {
+                // The data of our children will follow in the next requests
+                option |= MASK_NODE_REPLY_SUBTREE_PENDING;
+            }
+            // Send reply to the parent
+            NodeReply nReply(myAddr, option, dataLen, data);
+            sendMessage(myDriver, myParent.parentAddr, &nReply);
+
+            Serial.println(F("Done uploading local data"));
+        }else{
+            Serial.println(F("Sensor data must be between 0 to 64 bytes"));
+        }
+
+        // Prepare for the request
+        // No need to keep the RX on while waiting
+        myDriver->setMode(STANDBY);
+        myDriver->setDataRate(DEFAULT_DATA_RATE);
+
+        if(state != READY2){
+            if (slotted)
+            {
+                /**
+                 * Forward right after the slots of the parent. The siblings forward on the downlink
+                 * channel as well, so they spread their requests over as long as their replies took
+                 */
+                sleepUntilMillis(m_rxMillis + slotsEnd);
+                backoff = random(0, slotsEnd);
+            }
+            else
+            {
+                // Siblings will finish transmitting after the maxBackoff, so it is better to
+                // wait until all of them finished transmitting before forwarding the messages
+                uint16_t remainingTime = maxBackoffTime - backoff;
+                backoff = random(remainingTime, remainingTime + maxBackoffTime);
+            }
+
+            Serial.print(F("Second backoff: "));
+            Serial.println(backoff);
+
+            sleepForMillis(backoff);
+            m_useDLChannel = true;
+        }else{
+            /**
+             * If we are at READY2, the request is already delayed, and the descendants might
+             * have already switched to their READY2 state for receiving the request. Therefore,
+             * the request should be sent using the node's own channel right away
+             */
+            m_useDLChannel = false;
+        }
+
+        state = TALK_TO_CHILDREN;
+    }
+    else if (state == LISTEN_TO_PARENT)
+    {
+        // This should never happen
+        if (children.replyBytes() == 0)
+        {
+            state = TALK_TO_CHILDREN;
+            return;
+        }
+
+        uint8_t dataRate = req->replyDataRate();
+
+        myDriver->setMode(STANDBY);
+        myDriver->setDataRate(dataRate);
+        myDriver->setTxPwr(uplinkTxPwr(dataRate));
+
+        if (!waitForReplySlot(req))
+        {
+            uint16_t backoff = random(scaledTime(MIN_BACKOFF_TIME), maxBackoffTime);
+            Serial.print(F("Backoff: "));
+            Serial.println(backoff);
+            sleepForMillis(backoff);
+        }
+
+        uint8_t i = 0;
+        byte payload[MAX_LEN_DATA_NODE_REPLY];
+
+        byte option = 0b10100000 | uplinkDataRate();
+
+        // Source and option of a reply that is too long to be aggregated (forwarded as it is)
+        byte singleSrcAddr[2];
+        byte singleOption = 0;
+
+        for (uint8_t c = 0; c < CHILD_TABLE_SIZE; c++)
+        {
+            if (!children.used[c])
+            {
+                continue;
+            }
+
+            Serial.print(F("Child: "));
+            Serial.print(children.nodeAddr[c][0], HEX);
+            Serial.print(children.nodeAddr[c][1], HEX);
+            Serial.print(F(", Link margin="));
+            Serial.println(children.linkMargin[c]);
+
+            if (!children.hasReply[c])
+            {
+                Serial.println(F("No reply received"));
+                continue;
+            }
+
+            uint8_t dataLength = children.replyLength[c];
+            byte *data = children.replyData(c);
+
+            Serial.print(F("Reply data len: "));
+            Serial.println(dataLength);
+
+            // Although this checking is for the case that the packet is not aggregated and
+            // requires a 3-byte mini-header, it also works for the aggregated case.
+            if (children.replyOption[c] & MASK_NODE_REPLY_AGGREGATED)
+            {
+                if(i + dataLength > MAX_LEN_DATA_NODE_REPLY){
+                    break;
+                }
+                // If the packet is already aggregated, we can simply copy the data potion
+                memcpy(payload + i, data, dataLength);
+                i += dataLength;
+            }
+            else
+            {
+                if (i + 3 + dataLength > MAX_LEN_DATA_NODE_REPLY)
+                {
+                    /**
+                     * TODO: A problem would occur if the reply data length is > 61 bytes.
+                     * Such packet should be sent without the aggregation header.
+                     */
+                    if( i == 0 && dataLength > MAX_LEN_DATA_NODE_REPLY - 3){
+                        option ^= MASK_NODE_REPLY_AGGREGATED;
+                        memcpy(singleSrcAddr, children.nodeAddr[c], 2);
+                        // The data rate in the option is the one of our own link
+                        singleOption = (children.replyOption[c] & ~MASK_NODE_REPLY_DATA_RATE) | uplinkDataRate();
+                        memcpy(payload, data, dataLength);
+                        i = dataLength;
+
+                        children.dropReply(c);
+                    }
+                    break;           
+                }
+                //Create mini-packets
+                memcpy(payload + i, children.nodeAddr[c], 2);
+                payload[i + 2] = dataLength;
+                memcpy(payload + i + 3, data, dataLength);
+
+                i += (3 + dataLength);
+            }
+
+            // Free the space of the reply in the arena
+            children.dropReply(c);
+        }
+
+        if (children.replyBytes() == 0)
+        {
+            state = TALK_TO_CHILDREN;
+        }
+        else
+        {
+            state = LISTEN_TO_PARENT;
+            option |= 0x40; // Tell the parent that there are more
+        }
+
+        if (m_pendingChildren != 0)
+        {
+            option |= MASK_NODE_REPLY_SUBTREE_PENDING;
+        }
+
+        // A reply forwarded as it is tells our parent about our own pending data, not the child's
+        singleOption &= ~(MASK_NODE_REPLY_FETCH_MORE | MASK_NODE_REPLY_SUBTREE_PENDING);
+        singleOption |= option & (MASK_NODE_REPLY_FETCH_MORE | MASK_NODE_REPLY_SUBTREE_PENDING);
+
+        if(option & MASK_NODE_REPLY_AGGREGATED){
+            NodeReply aggregatedReply = NodeReply(myAddr, option, i, payload);
+            sendMessage(myDriver, myParent.parentAddr, &aggregatedReply);
+        }else{
+            //Simply send the original packet to the parent node
+            NodeReply singleReply = NodeReply(singleSrcAddr, singleOption, i, payload);
+            sendMessage(myDriver, myParent.parentAddr, &singleReply);
+        }
+        myDriver->setDataRate(DEFAULT_DATA_RATE);
+
+        Serial.println(F("Done uploading non-local data"));
+    }
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::handleReply(MessageView *msg)
+{
+    NodeReplyFields *reply = &msg->nodeReply;
+
+    if (state != TALK_TO_CHILDREN)
+    {
+        return;
+    }
+
+    if (children.replyBytes() + reply->dataLength + 3 > AGGREGATION_BUFFER_SIZE)
+    {
+        Serial.println(F("NodeReply: Buffer is full. Packet dropped."));
+        return;
+    }
+
+    //Serial.print(F("Data received from node "));
+    //Serial.print(reply->srcAddr[0], HEX);
+    //Serial.print(reply->srcAddr[1], HEX);
+    //Serial.println();
+
+    uint8_t child = children.find(msg->srcAddr);
+
+    if(child == NO_CHILD){
+        /**
+         *  TODO: A good question is whether we accept packet from a non-child who clearly knows me 
+         */
+        Serial.print(msg->srcAddr[0]);
+        Serial.print(msg->srcAddr[1]);
+        Serial.println(F(" is now added to the children list"));
+
+        //A child that we did not put in the list
+        child = children.add(msg->srcAddr, true);
+        if (child == NO_CHILD)
+        {
+            Serial.println(F("NodeReply: Children table is full. Packet dropped."));
+            return;
+        }
+        numChildren ++;
+    }
+
+    children.linkMargin[child] = (int8_t)((3 * (int)children.linkMargin[child] + linkMargin(msg)) / 4);
+    children.dataRate[child] = reply->dataRate();
+
+    children.storeReply(child, reply->option, reply->data, reply->dataLength);
+    m_missingReplies &= ~(1 << child);
+    m_repliedChildren |= (1 << child);
+
+    if (reply->fetchMore() || reply->subtreePending())
+    {
+        m_pendingChildren |= (1 << child);
+    }
+    else
+    {
+        m_pendingChildren &= ~(1 << child);
+    }
+
+    return;
+}
+
+template <class Driver>
+bool BasicForwardEngine<Driver>::runGateway()
+{
+    state = CONNECTED;
+
+    // Set the alarm for the next data collection cycle
+    turnOnRTC(myRTCVccPin);
+    time_t now = getTime(myRTCVccPin);
+    //Serial.println(now);
+    //Serial.println(gatewayReqTime);
+    myParent.nextGatewayReqTime = now + gatewayReqTime;
+    setAlarm(myParent.nextGatewayReqTime);
+    turnOffRTC(myRTCVccPin);
+
+    Serial.print(F("First DCP after "));
+    Serial.println(gatewayReqTime);
+
+    // Gateway has the cost of 0
+    hopsToGateway = 0;
+    
+    m_channel = (uint8_t)random(0, NUM_UL_CHANNELS);
+
+    while (true)
+    {
+        if(DEBUG_ENABLE){
+            Serial.print(F("Free memory: "));
+            Serial.println(freeMemory());
+        }
+        
+        now = getTime(myRTCVccPin);
+
+        // A quick check to see if the receiving period has ended
+        if (state == TALK_TO_CHILDREN || state == LISTEN_TO_PARENT)
+        {
+            if (now >= receivingPeriodTimeout)
+            {
+                state = HIBERNATE3;
+            }
+        }
+
+        switch (state)
+        {
+        case CONNECTED:
+        {
+            // Callback for initializing Gateway
+            if(onPreDataCollection) {
+                onPreDataCollection();
+            }
+
+            receiveUntillInterrupt();
+            break;
+        }
+        case READY1:
+        {
+            Serial.println(F("Data collection starts"));
+
+            // Update the time for the next iteration
+            myParent.nextGatewayReqTime = now + gatewayReqTime;
+
+            if (gatewayReqTime < 600)
+            {
+                // Calculate the end of the receiving period
+                receivingPeriod = gatewayReqTime / 2;
+            }
+            else
+            {
+                receivingPeriod = 300;
+            }
+
+            receivingPeriodTimeout = now + receivingPeriod;
+            resetPendingChildren();
+            m_useDLChannel = true;
+            // For gateway, it does not need to wait for the request, it should issue request immediately
+            state = TALK_TO_CHILDREN;
+            continue;
+        }
+        case TALK_TO_CHILDREN:
+        {
+            Serial.println(F("Talking to children"));
+            talkToChildren();
+            break;
+        }
+
+        case HIBERNATE2:
+        {
+            hibernationCounter++;
+            if (hibernationCounter == 5)
+            {
+                state = HIBERNATE3;
+                continue;
+            }
+
+            if (m_pendingChildren == 0)
+            {
+                Serial.println(F("No child is pending"));
+                state = HIBERNATE3;
+                continue;
+            }
+
+            Serial.print(F("Hibernate untill the next request after "));
+            Serial.println(requestInterval);
+
+            if(!hibernate(now + requestInterval)){
+                delay(requestInterval * MILLISECOND_MULTIPLIER);
+                state = TALK_TO_CHILDREN;
+            }
+
+            break;
+        }
+        case HIBERNATE3:
+        {
+            //TODO: Turn off the Gateway
+            if (onPostDataCollection){
+                onPostDataCollection();
+            }
+            hibernationCounter = 0;
+
+            //Clean up the data if there are any
+            children.dropReplies();
+
+            printClockStatistics();
+
+            time_t timeout = myParent.nextGatewayReqTime - EARLY_WAKE_UP_TIME;
+
+            Serial.print(F("Hibernate untill the next DCP after "));
+            Serial.println(timeout - now);
+
+            if(!hibernate(timeout)){
+                Serial.println(F("ERROR: The gateway has to reset the collection cycle due to RTC errors"));
+                state = READY1;
+                break;
+            }
+
+            turnOnRTC(myRTCVccPin);
+            setAlarm(myParent.nextGatewayReqTime);
+            turnOffRTC(myRTCVccPin);
+
+            /** Unlike a node, the gateway should not go to the READY state immediately
+            * because the READY state initiates the DCP. It should stay for a few seconds in case
+            * some new nodes wants to join in
+            */
+            state = CONNECTED;
+            break;
+        }
+        case LISTEN_TO_PARENT:
+        {
+            //reset the counter
+            hibernationCounter = 0;
+            bool fetchMore = false;
+            // For gateway, it processes data here
+            for (uint8_t c = 0; c < CHILD_TABLE_SIZE; c++)
+            {
+                if (children.used[c] && children.hasReply[c])
+                {
+                    byte *data = children.replyData(c);
+                    uint8_t dataLength = children.replyLength[c];
+
+                    Serial.print(F("Processing packet from "));
+                    Serial.print(children.nodeAddr[c][0], HEX);
+                    Serial.print(children.nodeAddr[c][1], HEX);
+                    Serial.print(": ");
+
+                    //Currently it simply print the data (maybe aggregated)
+                    for(uint8_t i = 0; i < dataLength; i ++){
+                        Serial.print(data[i], HEX);
+                        Serial.print('-');
+                    }
+                    Serial.println();
+
+                    if(!fetchMore && (children.replyOption[c] & MASK_NODE_REPLY_FETCH_MORE)){
+                        fetchMore = true;
+                    }
+
+                    if(onRecvResponse){
+                        if(children.replyOption[c] & MASK_NODE_REPLY_AGGREGATED){
+                            //Break down the aggregated packet into smaller packets
+
+                            uint8_t bytesRead = 0;
+                            
+                            while(bytesRead + 3 <= dataLength){
+
+                                //Parse the mini header
+                                byte* srcAddrPtr = data + bytesRead;
+                                bytesRead += 2;
+
+                                uint8_t datalen = data[bytesRead];
+                                bytesRead += 1;
+
+                                if(bytesRead + datalen > dataLength){
+                                    Serial.println("Warning: Mismatched data length");
+                                    break;
+                                }
+
+                                byte* dataPtr = data + bytesRead;
+
+                                onRecvResponse(dataPtr, datalen, srcAddrPtr);
+
+                                bytesRead += datalen;
+                            }
+                        }else{
+                            onRecvResponse(data, dataLength, children.nodeAddr[c]);
+                        }
+                    }
+                }
+            }
+            children.dropReplies();
+
+            if(fetchMore){
+                state = TALK_TO_CHILDREN;
+            }else{
+                state = HIBERNATE2;
+            }
+            break;
+        }
+        default:
+        {
+            break;
+        }
+        }
+
+        if (myDriver->available() == 0)
+        {
+            // No need to receive anything if there is nothing to read
+            continue;
+        }
+
+        MessageView msg;
+
+        // Receive failed (e.g. unrecognizable packet format)
+        if (!receiveMessage(myDriver, scaledTime(RECEIVE_TIMEOUT), &msg))
+        {
+            continue;
+        }
+
+        // Based on the received message, do the corresponding actions
+        switch (msg.type)
+        {
+        case MESSAGE_JOIN:
+        {
+            handleJoin(&msg);
+            break;
+        }
+        case MESSAGE_JOIN_CFM:
+        {
+            handleJoinCFM(&msg);
+            break;
+        }
+        case MESSAGE_NODE_REPLY:
+        {
+            handleReply(&msg);
+            break;
+        }
+        default:
+        {
+            break;
+        }
+        }
+    }
+}
+
+template <class Driver>
+bool BasicForwardEngine<Driver>::runNode()
+{
+    MessageView msg;
+
+    // Uninitilized gateway cost
+    hopsToGateway = 255;
+
+    state = OBSERVE;
+    m_maxJoinAttempts = SELF_HEAL_MAX_JOIN_ATTEMPTS;
+
+    // The core network operations are carried out here
+    while (true)
+    {
+        time_t now = getTime(myRTCVccPin);
+
+        // A quick check to see if the receiving period has ended
+        if (state == TALK_TO_CHILDREN ||  state == LISTEN_TO_PARENT)
+        {
+            if (now >= receivingPeriodTimeout)
+            {
+                state = HIBERNATE3;
+            }
+        }
+
+        if(DEBUG_ENABLE){
+            Serial.print(F("Free memory: "));
+            Serial.println(freeMemory());
+        }
+
+        switch (state)
+        {
+        case DISCONNECTED:
+        {
+            m_joinAttempts++;
+            Serial.print(F("Current TX power at "));
+            Serial.println(m_txPwr);
+            if (join())
+            {
+                Serial.println(F("Joining successful"));
+                state = CONNECTED;
+
+                // Reset join attempts
+                m_joinAttempts = 0;
+
+                m_channel = (uint8_t)random(0, NUM_UL_CHANNELS);
+
+                turnOnRTC(myRTCVccPin);
+
+                time_t readyTime = myParent.nextGatewayReqTime - EARLY_WAKE_UP_TIME;
+                // Set the alarm if there is plenty of time before the next data collection phase
+                if (readyTime > getTime(myRTCVccPin))
+                {
+                    Serial.print(F("Node will be ready at "));
+                    Serial.print(readyTime);
+                    Serial.println();
+                    setAlarm(readyTime);
+                }
+                else
+                {
+                    // If we do not have too much time left before the data collection,
+                    // Go to ready state
+                    state = READY1;
+                }
+                turnOffRTC(myRTCVccPin);
+            }
+            else
+            {
+                if (m_joinAttempts < m_maxJoinAttempts)
+                {
+                    myDriver->setMode(SLEEP);
+                    if (m_txPwr < MAX_TX_PWR)
+                    {
+                        // Increment the tx power
+                        m_txPwr++;
+                    }
+
+                    /**
+                     * Use truncated exponential random backoffs
+                     */
+                    unsigned long maxDelay = ((unsigned long)1 << m_joinAttempts) * MILLISECOND_MULTIPLIER + 1E3;
+
+                    if (maxDelay > DEFAULT_MAX_JOIN_BACKOFF)
+                    {
+                        maxDelay = DEFAULT_MAX_JOIN_BACKOFF;
+                    }
+
+                    unsigned long delayTime = random(1E3, maxDelay);
+
+                    Serial.print(F("Joining unsuccessful. Retry joining in "));
+                    Serial.print(delayTime / MILLISECOND_MULTIPLIER);
+                    Serial.println(F(" seconds"));
+
+                    sleepForMillis(delayTime);
+                    continue;
+                }
+                else
+                {
+                    // if a node enters observe state, it has to catch the
+                    // few seconds before a data collection cycle begins.
+                    // Therefore, it has less chances.
+                    m_maxJoinAttempts = SELF_HEAL_MAX_JOIN_ATTEMPTS;
+                    m_joinAttempts = 0;
+
+                    state = OBSERVE;
+                    Serial.println(F("Start the OBSERVE mode"));
+                    continue;
+                }
+            }
+            break;
+        }
+        case CONNECTED:
+        case OBSERVE:{
+            receiveUntillInterrupt();
+            break;
+        }
+        case READY1:
+        case READY2:
+        {
+            if (!alarmSetForReceiving){
+                    turnOnRTC(myRTCVccPin);
+                    //TODO: Justify this time 15 seconds
+                    time_t timeout = getTime(myRTCVccPin);
+                    if(state == READY1){
+                        timeout += 15;
+                    }else{
+                        //In the READY2 state, we will listen for the old receiving period
+                        timeout += receivingPeriod;
+                    }
+                    setAlarm(timeout);
+                    alarmSetForReceiving = true;
+                    turnOffRTC(myRTCVccPin);
+                }
+            receiveUntillInterrupt();
+            break;
+        }
+        case LISTEN_TO_PARENT:
+        {
+            Serial.println(F("Listen to parent"));
+
+            // reset the counter
+            hibernationCounter = 0;
+
+            if (receivingPeriodTimeout <= now + 3)
+            {
+                state = HIBERNATE3;
+                continue;
+            }
+            else if (!alarmSetForReceiving)
+            {
+                /** Need to have a timeout since if the parent is dead, the node
+                 * will stuck in this state permanently
+                 */
+                turnOnRTC(myRTCVccPin);
+                setAlarm(receivingPeriodTimeout);
+                alarmSetForReceiving = true;
+                turnOffRTC(myRTCVccPin);
+
+                /**
+                 * If the parent successfully fetches all the data within
+                 * the receivingPeriodTimeout, the alarm above will be replaced
+                 * by a new alarm in TALK_TO_CHILDREN
+                 */
+            }
+            receiveUntillInterrupt();
+            break;
+        }
+
+        case TALK_TO_CHILDREN:
+        {
+            Serial.println(F("Talking to children"));
+            talkToChildren();
+            continue;
+        }
+
+        case HIBERNATE2:
+        {
+            hibernationCounter++;
+            if (hibernationCounter >= 5 || m_pendingChildren == 0)
+            {
+                state = HIBERNATE3;
+                continue;
+            }
+            if(!hibernate(now + requestInterval)){
+                delay(requestInterval * MILLISECOND_MULTIPLIER);
+                state = TALK_TO_CHILDREN;
+            }
+            break;
+        }
+
+        case HIBERNATE1:
+        {
+            time_t timeout = myParent.nextGatewayReqTime - EARLY_WAKE_UP_TIME + (time_t)MAX_RTC_READ_ERROR_SECOND;
+            Serial.print(F("Join at the next DCP after "));
+            Serial.println(timeout - now);
+
+            if(!hibernate(timeout)){
+                //We can simply use the gatewayReq time here since there is no delay from OBSERVE to HIBERNATE1
+                delay((gatewayReqTime - EARLY_WAKE_UP_TIME) * MILLISECOND_MULTIPLIER);
+                state = DISCONNECTED;
+            }
+            continue;
+        }
+        case HIBERNATE3:
+        {
+
+            // Clean up the buffer (the parent might fail to fetch them)
+            children.dropReplies();
+
+            // Reset the parameters
+            alarmSetForReceiving = false;
+            hibernationCounter = 0;
+
+            printClockStatistics();
+
+            time_t timeout = myParent.nextGatewayReqTime - EARLY_WAKE_UP_TIME;
+            Serial.print(F("Hibernate untill the next DCP after "));
+            Serial.println(timeout - now);
+
+            if(!hibernate(timeout)){
+                rtcError = true;
+                //If the RTC fails, the node loses synchronization with the gateway 
+                // and should enter self-healing
+                state = OBSERVE;
+            }
+            break;
+        }
+        }
+
+        if (myDriver->available() == 0)
+        {
+            // No need to receive anything if there is nothing to read
+            continue;
+        }
+
+        if (!m_rxMillisFromWake)
+        {
+            m_rxMillis = getTimeMillis();
+        }
+        m_rxMillisFromWake = false;
+
+        // Receive failed (e.g. unrecognizable packet format)
+        if (!receiveMessage(myDriver, scaledTime(RECEIVE_TIMEOUT), &msg))
+        {
+            continue;
+        }
+
+        // Based on the received message, do the corresponding actions
+        switch (msg.type)
+        {
+        case MESSAGE_JOIN:
+        {
+            handleJoin(&msg);
+            break;
+        }
+        case MESSAGE_JOIN_CFM:
+        {
+            handleJoinCFM(&msg);
+            break;
+        }
+        case MESSAGE_GATEWAY_REQ:
+        {
+            handleReq(&msg);
+            break;
+        }
+        case MESSAGE_NODE_REPLY:
+        {
+            handleReply(&msg);
+            break;
+        }
+        default:
+        {
+            break;
+        }
+        }
+    }
+}
+
+template <class Driver>
+bool BasicForwardEngine<Driver>::run()
+{
+    if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+    {
+        return runGateway();
+    }
+    else
+    {
+        return runNode();
+    }
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::setReplySlotLength(uint16_t slotLength)
+{
+    m_replySlotLength = slotLength;
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::setAdaptiveDataRate(bool enabled)
+{
+    m_adaptiveDataRate = enabled;
+}
+
+template <class Driver>
+unsigned long BasicForwardEngine<Driver>::scaledTime(unsigned long ms)
+{
+    return ms * myDriver->getTimeScale() / 100;
+}
+
+template <class Driver>
+bool BasicForwardEngine<Driver>::waitForReplySlot(GatewayRequestFields *req)
+{
+    uint16_t slotLength = req->slotLength();
+
+    // Either the parent does not use slots or it has not assigned one to us
+    if (slotLength == 0 || myParent.replySlot >= req->numSlots)
+    {
+        return false;
+    }
+
+    Serial.print(F("Reply slot: "));
+    Serial.println(myParent.replySlot);
+
+    sleepUntilMillis(m_rxMillis + REPLY_SLOT_OFFSET + (unsigned long)myParent.replySlot * slotLength);
+    return true;
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::setSleepMode(uint8_t sleepMode, uint8_t rtcInterruptPin, uint8_t rtcVccPin)
+{
+
+    if (sleepMode == SleepMode::SLEEP_RTC_INTERRUPT)
+    {
+        myRTCVccPin = rtcVccPin;
+        pinMode(myRTCVccPin, OUTPUT);
+
+        // Turn on the RTC
+        digitalWrite(myRTCVccPin, HIGH);
+        sleepForMillis(1000);
+
+        time_t now = RTC.get();
+        // If the user intends to use RTC-based interrupt/sleep mode
+        // Make sure that a RTC is properly connected to the microcontroller
+        if (now == 0)
+        {
+            Serial.println(F("Error: Unable to set RTC-based interrupt. I2C error with the RTC."));
+            return;
+        }
+
+        if (translateInterruptPin(rtcInterruptPin) == NOT_AN_INTERRUPT)
+        {
+            Serial.println(F("Error: RTC interrupt (SQW) has to be connected to a valid interrupt pin"));
+            return;
+        }
+
+        myRTCInterruptPin = rtcInterruptPin;
+
+        RTC.set(compileTime());
+        invalidateClock();
+        // Initialize the RTC module with Alarm1
+        clearAlarm();
+        RTC.squareWave(SQWAVE_NONE);
+
+        now = RTC.get();
+        //Set a 24-hour alarm to erase any old alarms on the RTC
+        setAlarm(now + DEFAULT_NEXT_GATEWAY_REQ_TIME);
+
+        RTC.alarmInterrupt(ALARM_1, true);
+        RTC.alarmInterrupt(ALARM_2, false);
+        pinMode(myRTCInterruptPin, INPUT_PULLUP);
+        attachInterrupt(translateInterruptPin(myRTCInterruptPin), wake, FALLING);
+
+        turnOffRTC(myRTCVccPin);
+    }
+
+    this->sleepMode = sleepMode;
+    Serial.print(F("Sleep Mode set to: "));
+    Serial.println(sleepMode);
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::printClockStatistics()
+{
+    ClockStatistics stats = getClockStatistics();
+
+    // Every read served by the software clock saves one RTC power-up (300ms)
+    Serial.print(F("RTC power-ups: "));
+    Serial.print(stats.rtcPowerUps);
+    Serial.print(F(", RTC reads: "));
+    Serial.print(stats.rtcReads);
+    Serial.print(F(", Software clock reads: "));
+    Serial.println(stats.clockReads);
+
+    resetClockStatistics();
+}
+
+template <class Driver>
+uint8_t BasicForwardEngine<Driver>::cleanChildrenList(time_t currentTime)
+{
+    uint8_t childrenRemoved = 0;
+
+    Serial.print(F("Current time: "));
+    Serial.println(currentTime);
+
+    // Do a quick scan of the children table and clean up expired joinAcks
+    for (uint8_t c = 0; c < CHILD_TABLE_SIZE; c++)
+    {
+        if (!children.used[c])
+        {
+            continue;
+        }
+
+        Serial.print(F("Node "));
+        Serial.print(children.nodeAddr[c][0], HEX);
+        Serial.print(children.nodeAddr[c][1], HEX);
+        Serial.print(F(", Confirmed: "));
+        Serial.print(children.confirmed[c]);
+        Serial.print(F(", Expiry time: "));
+        Serial.println(children.joinAckExpiryTime[c]);
+        // Remove the child that has an expired joinAck
+        if (!children.confirmed[c] && children.joinAckExpiryTime[c] < currentTime)
+        {
+            Serial.println(F("Removing expired joinAck"));
+
+            children.remove(c);
+            childrenRemoved++;
+        }
+    }
+
+    return childrenRemoved;
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::talkToChildren()
+{
+    /**
+     * Listen for only 1 second if there are 0 child (in case there is an unknown child). 
+     * Otherwise use the adaptive backoff time
+     */
+    uint8_t maxChildBackoffTime = (numChildren == 0 ) ? 1 : numChildren * MAX_BACKOFF_TIME_FOR_ONE_CHILD ;
+
+    /**
+     * Children that received a JoinAck reply in their own slot. If all of them did, the receiving
+     * window ends right after the last slot. Otherwise (e.g. a child has been added after its
+     * JoinAck expired) the window must also cover the random backoff of the others
+     */
+    uint8_t numSlots = 0;
+    bool allSlotted = (m_replySlotLength != 0);
+    for (uint8_t c = 0; c < CHILD_TABLE_SIZE; c++)
+    {
+        if (children.used[c])
+        {
+            if (children.hasSlot[c])
+            {
+                numSlots = c + 1;
+            }
+            else
+            {
+                allSlotted = false;
+            }
+        }
+    }
+
+    // Without any child, keep listening in case a child we do not know about replies
+    if (numSlots == 0)
+    {
+        allSlotted = false;
+    }
+
+    /**
+     * The window ends as soon as every confirmed child that is still pending has replied. Without
+     * such children, the whole window is used in case a child we do not know about replies
+     */
+    m_missingReplies = 0;
+    for (uint8_t c = 0; c < CHILD_TABLE_SIZE; c++)
+    {
+        if (children.used[c] && children.confirmed[c] && (m_pendingChildren & (1 << c)))
+        {
+            m_missingReplies |= (1 << c);
+        }
+    }
+    bool awaitingReplies = (m_missingReplies != 0);
+
+    myDriver->setMode(STANDBY);
+    
+    uint8_t channelToUse = m_channel;
+    if (m_useDLChannel)
+    {
+        channelToUse = DOWNLINK_CHANNEL;
+        m_useDLChannel = false;
+    }
+    Serial.print(F("Using channel: "));
+    Serial.print(channelToUse, DEC);
+    Serial.println();
+
+    myDriver->setFrequency(channelFrequency(channelToUse));
+    myDriver->setTxPwr(MAX_TX_PWR);
+
+    time_t now = getTime(myRTCVccPin);
+
+    uint8_t dataRate = replyDataRate();
+
+    byte queryType = 0b10000;
+    // We simply broadcast the gatewayReq
+    GatewayRequest gwReq(myAddr, queryType, m_channel, myParent.nextGatewayReqTime - now + ((unsigned long)m_forwardDelay)/MILLISECOND_MULTIPLIER, maxChildBackoffTime,
+                         m_replySlotLength, numSlots, dataRate, m_missedReplies);
+
+    sendWakeUpMessage(BROADCAST_ADDR, &gwReq);
+
+    // The children count their slots from the end of the request
+    unsigned long requestEnd = getTimeMillis();
+
+    Serial.print(F("Request sent, replies at data rate "));
+    Serial.println(dataRate);
+
+    myDriver->setFrequency(channelFrequency(m_channel));
+    myDriver->setDataRate(dataRate);
+    myDriver->setMode(RX);
+
+    if (allSlotted)
+    {
+        /**
+         * Every child replies in its own slot, so the window ends right after the last one. A
+         * child that missed its slot replies in the next request, which the children wait for
+         * from the end of the slots as well (see m_forwardDelay)
+         */
+        sleepUntilMillis(requestEnd + REPLY_SLOT_OFFSET + (unsigned long)numSlots * m_replySlotLength + REPLY_SLOT_GUARD_TIME);
+        myDriver->setMode(SLEEP);
+        receiveReplies();
+    }
+
+    if (allSlotted || (awaitingReplies && m_missingReplies == 0))
+    {
+        Serial.println(allSlotted ? F("End of the reply slots") : F("All children replied"));
+        myDriver->setDataRate(DEFAULT_DATA_RATE);
+        state = (children.replyBytes() > 0) ? LISTEN_TO_PARENT : HIBERNATE2;
+        alarmSetForReceiving = false;
+        return;
+    }
+
+    /** Set up the aggregation timeout (we can guarantee that
+     * all children should have replied back). Add a 2-second margin
+     * since 
+     * 1. the child could send it at the last second with an air time of hundreds of miliseconds
+     * 2. the resolution of the RTC is in seconds, therefore, we can miss ~0.99 seconds when reading it
+     * 3. the child needs 300ms for turning on the RTC
+     */ 
+    now = getTime(myRTCVccPin);
+    time_t timeout = now + (time_t)(maxChildBackoffTime + 2);
+
+    turnOnRTC(myRTCVccPin);
+    if(timeout < compileTime() || RTC.oscStopped(true)){
+        turnOffRTC(myRTCVccPin);
+        //If RTC error occurs, we manually wait for the time period and parse the messages
+        //after the timeout. The state is also switched manually.
+        rtcError = true;
+
+        delay((unsigned long)(maxChildBackoffTime + 2) * MILLISECOND_MULTIPLIER);
+    }else{
+
+        setAlarm(timeout);
+
+        turnOffRTC(myRTCVccPin);
+    
+        while (true)
+        {
+           myDriver->powerDownMCU();
+
+           turnOnRTC(myRTCVccPin);
+           if(clearAlarm()){
+               break;
+           }
+
+           // Woken up by a packet
+           receiveReplies();
+           if(awaitingReplies && m_missingReplies == 0){
+               /**
+                * The alarm of the window is still pending and its interrupt would end the
+                * receiving period. Make LISTEN_TO_PARENT set the alarm again (HIBERNATE2 always does)
+                */
+               Serial.println(F("All children replied"));
+               alarmSetForReceiving = false;
+               break;
+           }
+           turnOffRTC(myRTCVccPin);
+        }
+        // Resynchronize the software clock while the RTC is still on
+        getTime(myRTCVccPin);
+        turnOffRTC(myRTCVccPin);
+    }
+    Serial.println(F("End talking to children"));
+    receiveReplies();
+    myDriver->setDataRate(DEFAULT_DATA_RATE);
+
+    state = (children.replyBytes() > 0) ? LISTEN_TO_PARENT : HIBERNATE2;
+    return;
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::resetPendingChildren()
+{
+    m_pendingChildren = 0;
+    uint8_t confirmed = 0;
+    for (uint8_t c = 0; c < CHILD_TABLE_SIZE; c++)
+    {
+        if (children.used[c])
+        {
+            m_pendingChildren |= (1 << c);
+        }
+        if (children.used[c] && children.confirmed[c])
+        {
+            confirmed |= (1 << c);
+        }
+    }
+
+    // The children that were expected in the last DCP and are still there, but did not reply
+    m_missedReplies = m_expectedReplies & confirmed & ~m_repliedChildren;
+    m_expectedReplies = confirmed;
+    m_repliedChildren = 0;
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::receiveReplies()
+{
+    while (myDriver->available() > 0)
+    {
+        Serial.println(F("Some data received"));
+        MessageView msg;
+
+        if (!receiveMessage(myDriver, scaledTime(RECEIVE_TIMEOUT), &msg))
+        {
+            continue;
+        }
+
+        if (msg.type == MESSAGE_NODE_REPLY)
+        {
+            handleReply(&msg);
+        }
+    }
+}
+
+template <class Driver>
+bool BasicForwardEngine<Driver>::hibernate(time_t hibernationEnd)
+{
+    // Turn off the transceiver
+    myDriver->setMode(SLEEP);
+
+    turnOnRTC(myRTCVccPin);
+    //Safe guard: in case the RTC.get() returns 0 due to errors, the alarm will be set to a point in the past and the MCU never wakes up
+    if(hibernationEnd < compileTime() || hibernationEnd <= getTime(myRTCVccPin) || RTC.oscStopped(true)){
+      Serial.println(F("Error: RTC invalid alarm"));
+      turnOffRTC(myRTCVccPin);
+      rtcError = true;
+      return false;
+    }
+
+    setAlarm(hibernationEnd);
+    turnOffRTC(myRTCVccPin);
+
+    deepSleep();
+
+    turnOnRTC(myRTCVccPin);
+    clearAlarm();
+    // Resynchronize the software clock while the RTC is still on
+    getTime(myRTCVccPin);
+    turnOffRTC(myRTCVccPin);
+    return true;
+}
+
+template <class Driver>
+int8_t BasicForwardEngine<Driver>::linkMargin(const MessageView *msg)
+{
+    int margin = msg->rssi - LINK_SENSITIVITY;
+
+    // Below the noise floor the RSSI is mostly noise, the SNR tells how far the frame is from the limit
+    if (msg->snr < 0)
+    {
+        margin = min(margin, msg->snr - LINK_SNR_LIMIT);
+    }
+
+    return (int8_t)constrain(margin, -128, 127);
+}
+
+template <class Driver>
+uint8_t BasicForwardEngine<Driver>::uplinkTxPwr(uint8_t dataRate)
+{
+    // The link is assumed to be symmetric: the surplus margin of the requests can be taken off the replies
+    int margin = (int)myParent.linkMargin + DATA_RATE_STEP * ((int)DEFAULT_DATA_RATE - dataRate);
+    int pwr = MAX_TX_PWR - (margin - TARGET_LINK_MARGIN) + myParent.txPwrBoost;
+
+    return (uint8_t)constrain(pwr, MIN_LINK_TX_PWR, MAX_TX_PWR);
+}
+
+template <class Driver>
+uint8_t BasicForwardEngine<Driver>::uplinkDataRate()
+{
+    if (!m_adaptiveDataRate)
+    {
+        return DEFAULT_DATA_RATE;
+    }
+
+    // The power boost after missed requests counts against the margin
+    int margin = (int)myParent.linkMargin - myParent.txPwrBoost;
+
+    uint8_t dataRate = myDriver->getMaxDataRate();
+    while (dataRate > myDriver->getMinDataRate() &&
+           margin - DATA_RATE_STEP * ((int)dataRate - DEFAULT_DATA_RATE) < TARGET_LINK_MARGIN)
+    {
+        dataRate--;
+    }
+    return dataRate;
+}
+
+template <class Driver>
+uint8_t BasicForwardEngine<Driver>::replyDataRate()
+{
+    // A child we do not know about replies at the default data rate
+    if (!m_adaptiveDataRate || numChildren == 0)
+    {
+        return DEFAULT_DATA_RATE;
+    }
+
+    uint8_t dataRate = myDriver->getMaxDataRate();
+    for (uint8_t c = 0; c < CHILD_TABLE_SIZE; c++)
+    {
+        if (children.used[c])
+        {
+            dataRate = min(dataRate, children.dataRate[c]);
+        }
+    }
+
+    // The reply slots are only long enough for the default data rate
+    if (m_replySlotLength != 0)
+    {
+        dataRate = max(dataRate, (uint8_t)DEFAULT_DATA_RATE);
+    }
+
+    return max(dataRate, myDriver->getMinDataRate());
+}
+
+template <class Driver>
+int BasicForwardEngine<Driver>::sendWakeUpMessage(byte *destAddr, GenericMessage *msg)
+{
+    myDriver->setWakeUpPreamble(true);
+    int result = sendMessage(myDriver, destAddr, msg);
+    myDriver->setWakeUpPreamble(false);
+
+    // The wake-up preamble can last seconds, the receivers only get the message at its end
+    while (!myDriver->txDone())
+    {
+        sleepForMillis(1);
+    }
+    return result;
+}
+
+template <class Driver>
+void BasicForwardEngine<Driver>::receiveUntillInterrupt()
+{
+    uint8_t channelToUse = DOWNLINK_CHANNEL;
+    switch(state){
+        case CONNECTED:
+        case READY1:
+        case OBSERVE:
+        {
+            channelToUse = DOWNLINK_CHANNEL;
+            break;
+        }
+        case LISTEN_TO_PARENT:
+        case READY2:
+        {
+            channelToUse = myParent.channel;
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+    myDriver->setFrequency(channelFrequency(channelToUse));
+    myDriver->setMode(RX);
+
+    // The end of the last transmission is only seen in an interrupt (and millis() stops without them)
+    while (!myDriver->txDone())
+    {
+        sleepForMillis(1);
+    }
+
+    // Do not want available() to change during our checking
+    noInterrupts();
+
+    if (myDriver->available() == 0)
+    {
+        //Serial.println(F("Put MCU to sleep"));
+
+        // Put the MCU to sleep and set the interrupt handler
+        myDriver->powerDownMCUSampling();
+
+        // If a packet woke us up, it has been received around now
+        m_rxMillis = getTimeMillis();
+
+        turnOnRTC(myRTCVccPin);
+        Serial.print(F("MCU wakes up due to "));
+        if (clearAlarm())
+        {
+            Serial.println(F("alarm"));
+        }
+        else
+        {
+            Serial.println(F("packet"));
+            m_rxMillisFromWake = true;
+        }
+        // Resynchronize the software clock while the RTC is still on
+        getTime(myRTCVccPin);
+        turnOffRTC(myRTCVccPin);
+    }
+    else
+    {
+        interrupts();
+    }
+}
+
+#endif
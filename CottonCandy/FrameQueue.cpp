@@ -0,0 +1,197 @@
+/*    
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "FrameQueue.h"
+
+#define ARENA_MASK (FRAME_ARENA_SIZE - 1)
+#define SLOT_MASK (FRAME_QUEUE_SLOTS - 1)
+
+FrameQueue::FrameQueue()
+{
+    m_writePos = 0;
+    m_committedPos = 0;
+    m_frameTail = 0;
+
+    m_readPos = 0;
+    m_frameHead = 0;
+    m_frameRead = 0;
+
+    m_arenaOverflows = 0;
+    m_slotOverflows = 0;
+}
+
+bool FrameQueue::beginFrame(uint8_t length)
+{
+    // One byte of the arena stays free, since a full arena could not be told apart from an empty one
+    uint8_t used = m_committedPos - m_readPos;
+    if ((uint16_t)used + length > FRAME_ARENA_SIZE - 1)
+    {
+        m_arenaOverflows++;
+        return false;
+    }
+
+    if ((uint8_t)(m_frameTail - m_frameHead) >= FRAME_QUEUE_SLOTS)
+    {
+        m_slotOverflows++;
+        return false;
+    }
+
+    m_writePos = m_committedPos;
+    return true;
+}
+
+void FrameQueue::write(byte b)
+{
+    m_arena[m_writePos & ARENA_MASK] = b;
+    m_writePos++;
+}
+
+uint8_t FrameQueue::writeSpan(byte **dst, uint8_t n)
+{
+    uint8_t start = m_writePos & ARENA_MASK;
+    uint16_t untilEnd = FRAME_ARENA_SIZE - start;
+
+    *dst = m_arena + start;
+    return (n > untilEnd) ? untilEnd : n;
+}
+
+void FrameQueue::advance(uint8_t n)
+{
+    m_writePos += n;
+}
+
+void FrameQueue::endFrame(int rssi, int8_t snr, unsigned long rxMillis)
+{
+    uint8_t length = m_writePos - m_committedPos;
+    if (length == 0)
+    {
+        return;
+    }
+
+    FrameInfo *frame = &m_frames[m_frameTail & SLOT_MASK];
+    frame->offset = m_committedPos & ARENA_MASK;
+    frame->length = length;
+    frame->rssi = rssi;
+    frame->snr = snr;
+    frame->rxMillis = rxMillis;
+
+    m_committedPos = m_writePos;
+    m_frameTail++;
+}
+
+int FrameQueue::available()
+{
+    return (uint8_t)(m_committedPos - m_readPos);
+}
+
+int FrameQueue::read()
+{
+    if (m_readPos == m_committedPos)
+    {
+        return -1;
+    }
+
+    byte result = m_arena[m_readPos & ARENA_MASK];
+    m_readPos++;
+    m_frameRead++;
+
+    if (m_frameRead == m_frames[m_frameHead & SLOT_MASK].length)
+    {
+        m_frameHead++;
+        m_frameRead = 0;
+    }
+
+    return result;
+}
+
+uint8_t FrameQueue::read(byte *dst, uint8_t n)
+{
+    uint8_t count = 0;
+
+    // Every committed byte belongs to a frame that has a descriptor, so the head is valid here
+    while (count < n && m_readPos != m_committedPos)
+    {
+        FrameInfo *frame = &m_frames[m_frameHead & SLOT_MASK];
+
+        uint8_t chunk = frame->length - m_frameRead;
+        if (chunk > n - count)
+        {
+            chunk = n - count;
+        }
+
+        // The frame may wrap around the end of the arena
+        uint8_t start = m_readPos & ARENA_MASK;
+        uint16_t untilEnd = FRAME_ARENA_SIZE - start;
+        if (chunk > untilEnd)
+        {
+            memcpy(dst + count, m_arena + start, untilEnd);
+            memcpy(dst + count + untilEnd, m_arena, chunk - untilEnd);
+        }
+        else
+        {
+            memcpy(dst + count, m_arena + start, chunk);
+        }
+
+        // Only free the space once the bytes have been copied
+        m_readPos += chunk;
+        count += chunk;
+        m_frameRead += chunk;
+
+        if (m_frameRead == frame->length)
+        {
+            m_frameHead++;
+            m_frameRead = 0;
+        }
+    }
+
+    return count;
+}
+
+uint8_t FrameQueue::peekFrameLength()
+{
+    if (m_frameHead == m_frameTail)
+    {
+        return 0;
+    }
+
+    return m_frames[m_frameHead & SLOT_MASK].length - m_frameRead;
+}
+
+bool FrameQueue::frameInfo(FrameInfo *info)
+{
+    if (m_frameHead == m_frameTail)
+    {
+        return false;
+    }
+
+    *info = m_frames[m_frameHead & SLOT_MASK];
+    return true;
+}
+
+void FrameQueue::skipFrame()
+{
+    if (m_frameRead == 0)
+    {
+        return;
+    }
+
+    m_readPos += m_frames[m_frameHead & SLOT_MASK].length - m_frameRead;
+    m_frameHead++;
+    m_frameRead = 0;
+}
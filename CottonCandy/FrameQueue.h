@@ -0,0 +1,119 @@
+/*    
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEADER_FRAME_QUEUE
+#define HEADER_FRAME_QUEUE
+
+#include "Arduino.h"
+#include "DeviceDriver.h"
+
+/* Size of the arena holding the received bytes. It must be a power of two (up to 256) */
+#define FRAME_ARENA_SIZE 256
+
+/* Number of frame descriptors. It must be a power of two (up to 128) */
+#define FRAME_QUEUE_SLOTS 8
+
+#if (FRAME_ARENA_SIZE & (FRAME_ARENA_SIZE - 1)) != 0 || FRAME_ARENA_SIZE > 256
+#error "FRAME_ARENA_SIZE must be a power of two up to 256"
+#endif
+
+#if (FRAME_QUEUE_SLOTS & (FRAME_QUEUE_SLOTS - 1)) != 0 || FRAME_QUEUE_SLOTS > 128
+#error "FRAME_QUEUE_SLOTS must be a power of two up to 128"
+#endif
+
+/**
+ * Receive queue of a transceiver that keeps the frame boundaries. The bytes of the frames are
+ * stored back to back in a power-of-two arena, and a ring of descriptors holds the position,
+ * length and link metrics of each frame.
+ *
+ * The receive interrupt is the only writer and the main program the only reader. All the
+ * indices are free-running 8-bit counters, so no interrupts have to be disabled on AVR.
+ */
+class FrameQueue
+{
+public:
+    FrameQueue();
+
+    /*-----------Receive interrupt-----------*/
+
+    /**
+     * Starts a frame of the given length. Returns false (and counts an overflow) if there is no
+     * room for it, in which case the frame must not be written
+     */
+    bool beginFrame(uint8_t length);
+
+    /* Appends a byte to the frame that has been started */
+    void write(byte b);
+
+    /**
+     * Contiguous room for the next bytes of the frame, so that they can be written in bulk (e.g.
+     * by a SPI burst). Points dst to it and returns its length: n, or less at the end of the
+     * arena. advance() must then be called with the number of bytes written
+     */
+    uint8_t writeSpan(byte **dst, uint8_t n);
+    void advance(uint8_t n);
+
+    /* Makes the frame that has been written visible to the reader */
+    void endFrame(int rssi, int8_t snr, unsigned long rxMillis);
+
+    /*-----------Main program-----------*/
+
+    /* Number of bytes left in the queue, over all the frames */
+    int available();
+
+    /* Returns the next byte, or -1 if the queue is empty */
+    int read();
+
+    /* Copies up to n bytes (possibly spanning several frames) into dst. Returns the number of bytes copied */
+    uint8_t read(byte *dst, uint8_t n);
+
+    /* Unread bytes of the frame at the head of the queue, 0 if the queue is empty */
+    uint8_t peekFrameLength();
+
+    /* Information about the frame that the next read() returns a byte of. Returns false if the queue is empty */
+    bool frameInfo(FrameInfo *info);
+
+    /* Drops the unread bytes of the frame being read (nothing happens at a frame boundary) */
+    void skipFrame();
+
+    /* Frames dropped because the arena or the descriptor ring was full */
+    uint16_t arenaOverflows() const { return m_arenaOverflows; }
+    uint16_t slotOverflows() const { return m_slotOverflows; }
+
+private:
+    byte m_arena[FRAME_ARENA_SIZE];
+    FrameInfo m_frames[FRAME_QUEUE_SLOTS];
+
+    /* Written by the interrupt */
+    volatile uint8_t m_writePos;
+    volatile uint8_t m_committedPos;
+    volatile uint8_t m_frameTail;
+
+    /* Written by the reader */
+    volatile uint8_t m_readPos;
+    volatile uint8_t m_frameHead;
+
+    /* Bytes already read from the frame at the head */
+    uint8_t m_frameRead;
+
+    volatile uint16_t m_arenaOverflows;
+    volatile uint16_t m_slotOverflows;
+};
+
+#endif
@@ -88,3 +88,13 @@ void LoRaMesh::setSleepMode(uint8_t sleepMode, uint8_t rtcInterruptPin, uint8_t
   }
   myEngine->setSleepMode(sleepMode, rtcInterruptPin, rtcVccPin);
 }
+
+void LoRaMesh::setReplySlotLength(uint16_t slotLength)
+{
+  myEngine->setReplySlotLength(slotLength);
+}
+
+void LoRaMesh::setAdaptiveDataRate(bool enabled)
+{
+  myEngine->setAdaptiveDataRate(enabled);
+}
@@ -103,6 +103,16 @@ public:
 
     void setSleepMode(uint8_t sleepMode, uint8_t rtcInterruptPin = 2, uint8_t rtcVccPin = 7);
 
+    /**
+     * Setter for the length (ms) of the reply slots assigned to the children (0 to disable them)
+     */
+    void setReplySlotLength(uint16_t slotLength);
+
+    /**
+     * Setter for the adaptive data rate of the replies of the children (enabled by default)
+     */
+    void setAdaptiveDataRate(bool enabled);
+
 private:
 
   ForwardEngine* myEngine;
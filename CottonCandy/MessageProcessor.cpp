@@ -22,61 +22,105 @@
 
 /* Security CMAC*/
 #include "AES_CMAC.h"
-AESTiny128 aes128;
+AES128 aes128;
 AES_CMAC cmac(aes128);
 
 const uint8_t key[16] = {0x01, 0x00, 0x00, 0x02, 0x00, 0x06, 0x05, 0x06, 0x03, 0x01,
                          0x01, 0x00, 0x00, 0x02, 0x00, 0x06};
 
+/**
+ * Starts a new MAC. The key never changes, so the key schedule and the CMAC subkeys
+ * are computed before the first MAC only
+ */
+void startMAC()
+{
+    static bool keySet = false;
+    if (!keySet)
+    {
+        cmac.setKey(key);
+        keySet = true;
+    }
+
+    cmac.reset();
+}
+
 /**
  * A preallocated buffer reserved for tx/rx events, i.e. receiving a packet
  * It is safe to share it among tx/rx events since they are not concurrent
  * 
  * The size is set to a large value which no packet would be larger than this
  */
-static byte trxBuff[TRX_BUFFER_SIZE];
-
-// The caller makes sure that the buff has a size > UNSIGNED_LONG_SIZE
-static unsigned long bytesToLong(byte *buff)
-{
+byte trxBuff[TRX_BUFFER_SIZE];
 
-    unsigned long l = 0;
+/**
+ * Number of bytes of the message being parsed by receiveMessage() that are already in trxBuff,
+ * and whether they are a whole frame (i.e. no more bytes of the message can arrive)
+ */
+uint8_t rxLength = 0;
+bool rxFramed = false;
 
-    uint8_t shifter = (UNSIGNED_LONG_SIZE - 1) * 8;
+/**
+ * The MAC of a received message is computed while its bytes arrive: macLength is the number of
+ * bytes of trxBuff known to be covered by the MAC (it grows as the message is parsed), and
+ * macHashed the number of bytes already passed to the CMAC
+ */
+uint8_t macLength = 0;
+uint8_t macHashed = 0;
 
-    for (uint8_t i = 0; i < UNSIGNED_LONG_SIZE; i++)
+/* Passes the received bytes that are covered by the MAC to the CMAC */
+void updateMAC()
+{
+    uint8_t end = (rxLength < macLength) ? rxLength : macLength;
+    if (end > macHashed)
     {
-        l += (unsigned long)buff[i] << shifter;
-        shifter -= 8;
+        cmac.update(trxBuff + macHashed, end - macHashed);
+        macHashed = end;
     }
+}
 
+/* The first length bytes of trxBuff are known to be covered by the MAC */
+void extendMAC(uint8_t length)
+{
+    macLength = length;
+    updateMAC();
+}
 
-    return l;
+/* Compares the MAC of the received message, which ends at msgEnd, with the one that follows it */
+bool checkMAC(uint8_t msgEnd)
+{
+    // Only the last block is left to hash
+    byte mac[16];
+    cmac.finalize(mac);
+    for(uint8_t i = 0; i < TRUNCATED_CMAC_SIZE; i++){
+        if(mac[i] != trxBuff[msgEnd + i]){
+            Serial.println(F("Warning: Packet MAC corrupted. Discard."));
+            return false;
+        }
+    }
+    return true;
 }
 
-static void longToBytes(byte* const buff, unsigned long l)
+/* Appends the MAC of the first length bytes of trxBuff to them, returns the new length */
+uint8_t appendMAC(uint8_t length)
 {
-    uint8_t shifter = (UNSIGNED_LONG_SIZE - 1) * 8;
+    byte mac[16];
+    startMAC();
+    cmac.generateMAC(mac, trxBuff, length);
 
-    for (uint8_t i = 0; i < UNSIGNED_LONG_SIZE; i++)
-    {
-        buff[i] = (byte)(l >> shifter) & 0xFF;
-        shifter -= 8;
-    }
+    //Use the first 4 bytes of the MAC
+    memcpy(trxBuff + length, mac, TRUNCATED_CMAC_SIZE);
+    return length + TRUNCATED_CMAC_SIZE;
 }
 
 GenericMessage::GenericMessage(byte type, byte *srcAddr)
 {
     this->type = type;
     memcpy(this->srcAddr, srcAddr, 2);
-
-    len = MSG_LEN_GENERIC;
 }
 
-void GenericMessage::toBytes(byte* const msg)
+uint8_t GenericMessage::toBytes(byte* const msg)
 {
-    msg[0] = this->type;
-    memcpy(msg + 1, this->srcAddr, 2);
+    return HeaderLayout::encode(*this, msg) - msg;
 }
 
 GenericMessage::~GenericMessage()
@@ -89,34 +133,20 @@ Join::Join(byte *srcAddr) : GenericMessage(MESSAGE_JOIN, srcAddr)
 }
 
 /*--------------------JoinACK Message-------------------*/
-JoinAck::JoinAck(byte *srcAddr, uint8_t hopsToGateway, uint8_t numChildren, int rssiFeedback, unsigned long nextReqTime) : GenericMessage(MESSAGE_JOIN_ACK, srcAddr)
+JoinAck::JoinAck(byte *srcAddr, uint8_t hopsToGateway, uint8_t numChildren, int rssiFeedback, unsigned long nextReqTime,
+                 uint8_t replySlot) : GenericMessage(MESSAGE_JOIN_ACK, srcAddr)
 {
     this->hopsToGateway = hopsToGateway;
     this->rssiFeedback = rssiFeedback;
     this->numChildren = numChildren;
     this->nextReqTime = nextReqTime;
-
-    len = MSG_LEN_GENERIC + MSG_LEN_JOIN_ACK;
+    this->replySlot = replySlot;
 }
 
-void JoinAck::toBytes(byte* const msg)
+uint8_t JoinAck::toBytes(byte* const msg)
 {
     GenericMessage::toBytes(msg);
-
-    uint8_t index = MSG_LEN_GENERIC;
-    msg[index] = hopsToGateway;
-    index++;
-
-    msg[index] = numChildren;
-    index++;
-
-    // Convert the negative rssi to a (positive) byte
-    msg[index] = (uint8_t)(abs(rssiFeedback));
-    index++;
-
-    byte b[UNSIGNED_LONG_SIZE];
-    longToBytes(b, nextReqTime);
-    memcpy(msg + index, b, UNSIGNED_LONG_SIZE);
+    return JoinAckLayout::encode(*this, msg + MSG_LEN_GENERIC) - msg;
 }
 
 /*--------------------JoinCFM Message-------------------*/
@@ -125,354 +155,62 @@ JoinCFM::JoinCFM(byte *srcAddr) : GenericMessage(MESSAGE_JOIN_CFM, srcAddr)
 }
 
 /*--------------------GatewayRequest Message-------------------*/
-GatewayRequest::GatewayRequest(byte *srcAddr, byte queryType, byte ulChannel, unsigned long nextReqTime, byte childBackoffTime) : GenericMessage(MESSAGE_GATEWAY_REQ, srcAddr)
+GatewayRequest::GatewayRequest(byte *srcAddr, byte queryType, byte ulChannel, unsigned long nextReqTime, byte childBackoffTime,
+                               uint16_t slotLength, byte numSlots, byte dataRate, byte missedReplies)
+    : GenericMessage(MESSAGE_GATEWAY_REQ, srcAddr)
 {
-    this->option = queryType & 0x3F;
+    this->option = queryType & MASK_GATEWAY_REQ_QUERY_TYPE;
     this->ulChannel = ulChannel;
+    this->nextReqTime = nextReqTime;
+    this->childBackoffTime = childBackoffTime;
+    this->numSlots = numSlots;
+    this->linkControl = (dataRate & MASK_LINK_CONTROL_DATA_RATE) | (missedReplies << LINK_CONTROL_MISSED_SHIFT);
 
-    len = MSG_LEN_GENERIC + MSG_LEN_HEADER_GATEWAY_REQ;
-
+    // The optional fields are only sent if they are set
     if (nextReqTime != 0)
     {
         this->option |= MASK_GATEWAY_REQ_NEW_NEXT_TIME;
-        this->nextReqTime = nextReqTime;
-        len += FIELD_LEN_GATEWAY_REQ_NEXT_TIME;
     }
 
     if (childBackoffTime != 0)
     {
         this->option |= MASK_GATEWAY_REQ_NEW_MAX_BACKOFF;
-        this->childBackoffTime = childBackoffTime;
-        len += FIELD_LEN_GATEWAY_REQ_MAX_BACKOFF;
     }
-}
 
-void GatewayRequest::toBytes(byte* const msg)
-{
-    GenericMessage::toBytes(msg);
-
-    uint8_t index = MSG_LEN_GENERIC;
-
-    msg[index] = option;
-    index++;
-
-    msg[index] = ulChannel;
-    index++;
-
-    //Serial.println(option, HEX);
-
-    if (option & MASK_GATEWAY_REQ_NEW_NEXT_TIME)
+    uint16_t slotUnits = slotLength / REPLY_SLOT_UNIT;
+    if (slotUnits > MASK_GATEWAY_REQ_SLOT_LENGTH)
     {
-        byte b[UNSIGNED_LONG_SIZE];
-        
-        longToBytes(b, nextReqTime);
-
-        memcpy(msg + index, b, UNSIGNED_LONG_SIZE);
-        index += FIELD_LEN_GATEWAY_REQ_NEXT_TIME;
+        slotUnits = MASK_GATEWAY_REQ_SLOT_LENGTH;
     }
+    this->option |= slotUnits;
 
-    if (option & MASK_GATEWAY_REQ_NEW_MAX_BACKOFF)
+    if (dataRate != DEFAULT_DATA_RATE || missedReplies != 0)
     {
-        msg[index] = childBackoffTime;
+        this->option |= MASK_GATEWAY_REQ_LINK_CONTROL;
     }
 }
 
-bool GatewayRequest::newMaxBackoff()
-{
-    return (option & MASK_GATEWAY_REQ_NEW_MAX_BACKOFF);
-}
-
-bool GatewayRequest::newNextReqTime()
+uint8_t GatewayRequest::toBytes(byte* const msg)
 {
-    return (option & MASK_GATEWAY_REQ_NEW_NEXT_TIME);
+    GenericMessage::toBytes(msg);
+    return GatewayRequestLayout::encode(*this, msg + MSG_LEN_GENERIC) - msg;
 }
 
 /*--------------------NodeReply Message-------------------*/
 NodeReply::NodeReply(byte *srcAddr, byte option,
-                     byte dataLength, byte *data) : GenericMessage(MESSAGE_NODE_REPLY, srcAddr)
+                     byte dataLength, const byte *data) : GenericMessage(MESSAGE_NODE_REPLY, srcAddr)
 {
     this->option = option;
-    this->dataLength = dataLength;
-    this->data = new byte[dataLength];
-    memcpy(this->data, data, dataLength);
-
-    len = MSG_LEN_GENERIC + MSG_LEN_HEADER_NODE_REPLY + dataLength;
-}
-
-NodeReply::~NodeReply()
-{
-    if(this->data != nullptr){
-        delete[] this->data;
-    }
-}
-
-/* Copy constructor */
-NodeReply::NodeReply(const NodeReply &reply) : GenericMessage(reply)
-{
-    this->option = reply.option;
-    this->dataLength = reply.dataLength;
-    this->data = new byte[dataLength];
-    memcpy(this->data, reply.data, dataLength);
-
-    len = MSG_LEN_GENERIC + MSG_LEN_HEADER_NODE_REPLY + dataLength;
+    this->dataLength = (dataLength > MAX_LEN_DATA_NODE_REPLY) ? MAX_LEN_DATA_NODE_REPLY : dataLength;
+    this->data = data;
 }
 
-bool NodeReply::aggregated(){
-    return option & MASK_NODE_REPLY_AGGREGATED;
-}
-
-bool NodeReply::fetchMore(){
-    return option & MASK_NODE_REPLY_FETCH_MORE;
-}
-
-void NodeReply::toBytes(byte* const msg)
+uint8_t NodeReply::toBytes(byte* const msg)
 {
     GenericMessage::toBytes(msg);
-
-    uint8_t index = MSG_LEN_GENERIC;
-    msg[index] = option;
-    index++;
-
-    msg[index] = dataLength;
-    index++;
-
-    memcpy(msg + index, data, dataLength);
+    return NodeReplyLayout::encode(*this, msg + MSG_LEN_GENERIC) - msg;
 }
 
-GenericMessage *receiveMessage(DeviceDriver *driver, unsigned long timeout)
-{
-    unsigned long startTime = getTimeMillis();
-    GenericMessage *msg = nullptr;
-
-    byte msgType = 0xFF;
-    byte destAddr[2];
-    byte srcAddr[2];
-    byte* buffPtr = trxBuff;
-
-    while ((unsigned long)(getTimeMillis() - startTime) < timeout)
-    {
-        if(!readMsgFromBuff(driver, trxBuff, 2 + MSG_LEN_GENERIC, timeout)){
-            continue;
-        }
-
-        msgType = trxBuff[2];      
-        memcpy(destAddr, trxBuff, 2);
-        memcpy(srcAddr, trxBuff + 3, 2);
-        
-        break;
-    }
-
-    if(msgType == 0xFF){
-        return nullptr;
-    }
-
-    buffPtr += (2 + MSG_LEN_GENERIC);
- 
-    // get the complete message from device buffer
-    switch (msgType)
-    {
-    case MESSAGE_JOIN:
-    {
-        msg = new Join(srcAddr);
-        break;
-    }
-
-    case MESSAGE_JOIN_ACK:
-    {
-        // we have already read the msg type
-        if(!readMsgFromBuff(driver, buffPtr, MSG_LEN_JOIN_ACK, timeout)){
-            break;
-        }
-
-        uint8_t hopsToGateway = buffPtr[0];
-        uint8_t numChildren = buffPtr[1];
-        int rssiFeedback = -((int)buffPtr[2]);
-        unsigned long nextReqTime = bytesToLong(buffPtr + 3);
-
-        msg = new JoinAck(srcAddr, hopsToGateway, numChildren, rssiFeedback, nextReqTime);
-        break;
-    }
-
-    case MESSAGE_JOIN_CFM:
-    {
-        msg = new JoinCFM(srcAddr);
-        break;
-    }
-    case MESSAGE_GATEWAY_REQ:
-    {
-        // we have already read the msg type & src addr
-        if(!readMsgFromBuff(driver, buffPtr, MSG_LEN_HEADER_GATEWAY_REQ, timeout)){
-            break;
-        }
-
-        byte option = buffPtr[0];
-        byte ulChannel = buffPtr[1];
-
-        unsigned long nextReqTime = 0;
-        byte childBackoffTime = 0;
-
-        buffPtr += MSG_LEN_HEADER_GATEWAY_REQ;
-
-        if (option & MASK_GATEWAY_REQ_NEW_NEXT_TIME)
-        {
-            if(readMsgFromBuff(driver, buffPtr, UNSIGNED_LONG_SIZE, timeout)){
-                nextReqTime = bytesToLong(buffPtr);
-                buffPtr += UNSIGNED_LONG_SIZE;
-            }
-        }
-
-        if (option & MASK_GATEWAY_REQ_NEW_MAX_BACKOFF)
-        {
-            if(readMsgFromBuff(driver, buffPtr, 1, timeout)){
-                childBackoffTime = buffPtr[0];
-            }
-            
-        }
-        //Serial.println(nextReqTime);
-        //Serial.println(childBackoffTime);
-
-        msg = new GatewayRequest(srcAddr, option, ulChannel, nextReqTime, childBackoffTime);
-
-        break;
-    }
-
-    case MESSAGE_NODE_REPLY:
-    {
-        // we have already read the msg type
-        // need to know the data length before getting the data
-
-        // get Header first
-        if(!readMsgFromBuff(driver, buffPtr, MSG_LEN_HEADER_NODE_REPLY, timeout)){
-            break;
-        }
-
-        byte option = buffPtr[0];
-        byte dataLength = buffPtr[1];
-
-        if(dataLength > MAX_LEN_DATA_NODE_REPLY){
-            break;
-        }
-
-        buffPtr += MSG_LEN_HEADER_NODE_REPLY;
-        if(readMsgFromBuff(driver, buffPtr, dataLength, timeout)){
-            msg = new NodeReply(srcAddr, option, dataLength, buffPtr);
-        }
-
-        break;
-    }
-
-    default:
-        msg = nullptr;
-        break;
-    }
-
-    if (msg != nullptr)
-    {
-        bool secure = true;
-        byte receivedMac[TRUNCATED_CMAC_SIZE];
-
-        if(!readMsgFromBuff(driver, receivedMac, TRUNCATED_CMAC_SIZE, timeout)){
-            secure = false;
-        }
-        else{
-            //unsigned long start = getTimeMillis();
-            byte mac[16];
-            /*
-            for(int i = 0; i < msg->len + 2; i++){
-                Serial.print(trxBuff[i],HEX);
-                Serial.print("-");
-            }
-            Serial.println();
-            */
-
-            cmac.generateMAC(mac, key, trxBuff, msg->len + 2);
-            for(uint8_t i = 0; i < TRUNCATED_CMAC_SIZE; i++){
-                //Serial.print(receivedMac[i],HEX);
-                //Serial.print("/");
-                //Serial.print(mac[i],HEX);
-                //Serial.print("-");
-                if(mac[i] != receivedMac[i]){
-                    secure = false;
-                    break;
-                }
-            }
-            //Serial.println(F("Time for CMAC verification: "));
-            //Serial.println(getTimeMillis() - start);
-        }
-
-        if(!secure){
-            Serial.println(F("Warning: Packet MAC corrupted. Discard."));
-            delete msg;
-            msg = nullptr;
-            return nullptr;
-        }
-
-        msg->rssi = driver->getLastMessageRssi();
-    }
-
-    return msg;
-}
-
-int sendMessage(DeviceDriver* driver, byte* destAddr, GenericMessage* msg){
-    if(driver == nullptr){
-        return -1;
-    }
-
-    //Insert the destination address at the very beginning
-    memcpy(trxBuff, destAddr, 2);
-
-    uint8_t finalPacketLen = 2;
-    
-    msg->toBytes(trxBuff + finalPacketLen);
-    finalPacketLen += msg->len;
-
-    byte mac[16];
-    cmac.generateMAC(mac, key, trxBuff, finalPacketLen);
-    
-    //Use the first 4 bytes of the MAC
-    memcpy(trxBuff + finalPacketLen, mac, TRUNCATED_CMAC_SIZE);
-    finalPacketLen += TRUNCATED_CMAC_SIZE;
-
-    /*
-    for(uint8_t i = 0; i< finalPacketLen; i++){
-        Serial.print(trxBuff[i], HEX);
-        Serial.print('_');
-    }
-    */
-
-    int result = 0;
-    result= driver->send(destAddr, trxBuff, finalPacketLen);
-
-    return result;
-}
-
-/*-------------------- Helpers -------------------*/
-//Make sure the buff has enough space for the msgLen
-uint8_t readMsgFromBuff(DeviceDriver *driver, byte* buff, uint8_t msgLen, unsigned long timeout)
-{
-    int i = 0;
-
-    unsigned long startTime = getTimeMillis();
-
-    while (i < msgLen && (unsigned long)(getTimeMillis() - startTime) < timeout)
-    {
-        if (driver->available())
-        {
-            byte c = driver->recv();
-            buff[i] = c;
-            //Serial.print(buff[i], HEX);
-            //Serial.print(" _ ");
-            i++;
-        }
-        // if(c == 0xFF){
-        //     continue;
-        // }
-    }
-
-    if(i < msgLen){
-        Serial.println(F("Warning: Incomplete Message"));
-        return 0;
-    }
-
-    return i;
-}
\ No newline at end of file
+/* The messages are parsed and sent through a DeviceDriver pointer by ForwardEngine */
+template bool receiveMessage<DeviceDriver>(DeviceDriver *driver, unsigned long timeout, MessageView *msg);
+template int sendMessage<DeviceDriver>(DeviceDriver *driver, byte *destAddr, GenericMessage *msg);
@@ -22,6 +22,7 @@
 #define HEADER_MESSAGE_PROCESSOR
 
 #include "DeviceDriver.h"
+#include "MessageSchema.h"
 
 #define MESSAGE_JOIN              1
 #define MESSAGE_JOIN_ACK          2
@@ -35,51 +36,169 @@
 #define MESSAGE_NODE_REPLY        7
 #define MESSAGE_AGGREGATED_REPLY  8
 
-#define MSG_LEN_GENERIC           3
-
-//The following message lengths exclude the length of generic header
-#define MSG_LEN_JOIN_ACK          7
-#define MSG_LEN_HEADER_GATEWAY_REQ  2
-#define MSG_LEN_HEADER_NODE_REPLY 2
-
 #define MASK_GATEWAY_REQ_NEW_NEXT_TIME      0x80
 #define MASK_GATEWAY_REQ_NEW_MAX_BACKOFF    0x40
-#define MASK_GATEWAY_REQ_QUERY_TYPE         0x3F
+#define MASK_GATEWAY_REQ_LINK_CONTROL       0x20
+#define MASK_GATEWAY_REQ_QUERY_TYPE         0x10
+#define MASK_GATEWAY_REQ_SLOT_LENGTH        0x0F
+
+/* The length of the reply slots is sent in units of 50ms (i.e. up to 750ms) */
+#define REPLY_SLOT_UNIT 50
+
+/**
+ * Link control byte of a GatewayRequest: the data rate of the replies, and a bit per reply slot
+ * (from bit 3 up) for the children whose NodeReply the parent missed in its last DCP
+ */
+#define MASK_LINK_CONTROL_DATA_RATE 0x07
+#define LINK_CONTROL_MISSED_SHIFT 3
 
-#define FIELD_LEN_GATEWAY_REQ_NEXT_TIME 4
-#define FIELD_LEN_GATEWAY_REQ_MAX_BACKOFF 1
+/* Sent in a JoinAck when the parent does not assign a reply slot to the child */
+#define NO_REPLY_SLOT 0xFF
 
 #define MASK_NODE_REPLY_AGGREGATED 0x80
 #define MASK_NODE_REPLY_FETCH_MORE 0x40
 
-#define MAX_LEN_DATA_NODE_REPLY 64
+/* The sender still waits for the data of some of its own children, so it will reply again */
+#define MASK_NODE_REPLY_SUBTREE_PENDING 0x08
+
+/* Fastest data rate the link of the sender to its parent sustains (see DEFAULT_DATA_RATE) */
+#define MASK_NODE_REPLY_DATA_RATE 0x07
 
-#define UNSIGNED_LONG_SIZE sizeof(unsigned long)
+#define MAX_LEN_DATA_NODE_REPLY 64
 
 #define TRUNCATED_CMAC_SIZE 4
 
 #define TRX_BUFFER_SIZE 100
 
-/* We will use polymorphism here */
-class GenericMessage
+/*--------------------Message fields-------------------*/
+/* Generic header of every message */
+struct MessageHeader
 {
-
-public:
     byte type;
     byte srcAddr[2];
-    
-    /**
-     * For every message receveid, there will be an RSSI value associated
-     */
-    int rssi;
+};
+
+struct JoinAckFields
+{
+    uint8_t hopsToGateway;
+    uint8_t numChildren;
+    int rssiFeedback;
+    unsigned long nextReqTime;
+
+    /* Slot in which the child replies to the gateway requests of this parent */
+    uint8_t replySlot;
+};
 
+struct GatewayRequestFields
+{
     /**
-     * Message length
+     * Bit number from right(lowest) to left(highest) 
+     * 
+     * Bit 7: new GatewayReqTime
+     * Bit 6: new BackoffTime
+     * Bit 5: the link control byte follows the other fields: the children reply at another data
+     *        rate than DEFAULT_DATA_RATE, or the replies of some of them were missed
+     * Bit 4: reserved for network management
+     * Bit 3-0: length of the reply slots in units of REPLY_SLOT_UNIT (0 if the children should
+     *          reply after a random backoff). If set, the number of slots follows the other fields
+     * 
      */ 
-    uint8_t len;
+    byte option;
+    byte ulChannel;
+    unsigned long nextReqTime;
+    byte childBackoffTime;
+    byte numSlots;
+    byte linkControl;
+
+    bool newNextReqTime() const { return option & MASK_GATEWAY_REQ_NEW_NEXT_TIME; }
+    bool newMaxBackoff() const { return option & MASK_GATEWAY_REQ_NEW_MAX_BACKOFF; }
+
+    /* Length of the reply slots in ms, or 0 if the children should use a random backoff */
+    uint16_t slotLength() const { return (uint16_t)(option & MASK_GATEWAY_REQ_SLOT_LENGTH) * REPLY_SLOT_UNIT; }
+
+    /* Data rate the children reply at */
+    uint8_t replyDataRate() const
+    {
+        return (option & MASK_GATEWAY_REQ_LINK_CONTROL) ? (linkControl & MASK_LINK_CONTROL_DATA_RATE) : DEFAULT_DATA_RATE;
+    }
+
+    /* Whether the sender missed the NodeReply of the child in the given reply slot in its last DCP */
+    bool missedReply(uint8_t slot) const
+    {
+        return slot < 8 - LINK_CONTROL_MISSED_SHIFT && (option & MASK_GATEWAY_REQ_LINK_CONTROL) &&
+               (linkControl & (1 << (slot + LINK_CONTROL_MISSED_SHIFT)));
+    }
+};
 
+struct NodeReplyFields
+{
+    byte option;
+    byte dataLength;
+    const byte* data;
+
+    bool aggregated() const { return option & MASK_NODE_REPLY_AGGREGATED; }
+    bool fetchMore() const { return option & MASK_NODE_REPLY_FETCH_MORE; }
+    bool subtreePending() const { return option & MASK_NODE_REPLY_SUBTREE_PENDING; }
+    uint8_t dataRate() const { return option & MASK_NODE_REPLY_DATA_RATE; }
+};
+
+/*--------------------Message layouts-------------------*/
+/* The generic header. It follows the destination address (see sendMessage()) */
+typedef MessageLayout<MessageHeader,
+                      ByteField<MessageHeader, &MessageHeader::type>,
+                      AddressField<MessageHeader, &MessageHeader::srcAddr> > HeaderLayout;
+
+/* The following layouts come after the generic header. Join and JoinCFM have nothing else */
+typedef MessageLayout<JoinAckFields,
+                      ByteField<JoinAckFields, &JoinAckFields::hopsToGateway>,
+                      ByteField<JoinAckFields, &JoinAckFields::numChildren>,
+                      RssiField<JoinAckFields, &JoinAckFields::rssiFeedback>,
+                      LongField<JoinAckFields, &JoinAckFields::nextReqTime>,
+                      ByteField<JoinAckFields, &JoinAckFields::replySlot> > JoinAckLayout;
+
+typedef MessageLayout<GatewayRequestFields,
+                      ByteField<GatewayRequestFields, &GatewayRequestFields::option>,
+                      ByteField<GatewayRequestFields, &GatewayRequestFields::ulChannel>,
+                      OptionalField<GatewayRequestFields, &GatewayRequestFields::option, MASK_GATEWAY_REQ_NEW_NEXT_TIME,
+                                    LongField<GatewayRequestFields, &GatewayRequestFields::nextReqTime> >,
+                      OptionalField<GatewayRequestFields, &GatewayRequestFields::option, MASK_GATEWAY_REQ_NEW_MAX_BACKOFF,
+                                    ByteField<GatewayRequestFields, &GatewayRequestFields::childBackoffTime> >,
+                      OptionalField<GatewayRequestFields, &GatewayRequestFields::option, MASK_GATEWAY_REQ_SLOT_LENGTH,
+                                    ByteField<GatewayRequestFields, &GatewayRequestFields::numSlots> >,
+                      OptionalField<GatewayRequestFields, &GatewayRequestFields::option, MASK_GATEWAY_REQ_LINK_CONTROL,
+                                    ByteField<GatewayRequestFields, &GatewayRequestFields::linkControl> > > GatewayRequestLayout;
+
+typedef MessageLayout<NodeReplyFields,
+                      ByteField<NodeReplyFields, &NodeReplyFields::option>,
+                      ByteField<NodeReplyFields, &NodeReplyFields::dataLength>,
+                      DataField<NodeReplyFields, &NodeReplyFields::dataLength, &NodeReplyFields::data,
+                                MAX_LEN_DATA_NODE_REPLY> > NodeReplyLayout;
+
+#define MSG_LEN_GENERIC HeaderLayout::MAX_SIZE
+
+/* The longest message, with its destination address and MAC, has to fit in the trx buffer */
+static_assert(HeaderLayout::MIN_SIZE == 3 && HeaderLayout::MAX_SIZE == 3, "The generic header is 3 bytes long");
+static_assert(JoinAckLayout::MIN_SIZE == 8 && JoinAckLayout::MAX_SIZE == 8, "A JoinAck has 8 bytes of fields");
+static_assert(GatewayRequestLayout::PREFIX_SIZE == 2, "The option byte of a GatewayRequest must be sent first");
+static_assert(NodeReplyLayout::PREFIX_SIZE == 2, "The data length of a NodeReply must be sent before the data");
+static_assert(2 + MSG_LEN_GENERIC + GatewayRequestLayout::MAX_SIZE + TRUNCATED_CMAC_SIZE <= TRX_BUFFER_SIZE,
+              "A GatewayRequest does not fit in the trx buffer");
+static_assert(2 + MSG_LEN_GENERIC + NodeReplyLayout::MAX_SIZE + TRUNCATED_CMAC_SIZE <= TRX_BUFFER_SIZE,
+              "A NodeReply does not fit in the trx buffer");
+
+/*--------------------Outgoing messages-------------------*/
+/**
+ * Messages to be sent. We will use polymorphism here. The messages that are received
+ * are parsed into a MessageView instead (see below)
+ */
+class GenericMessage: public MessageHeader
+{
+
+public:
     GenericMessage(byte type, byte* srcAddr);
-    virtual void toBytes(byte* const msg);
+
+    /* Writes the message to msg and returns its length */
+    virtual uint8_t toBytes(byte* const msg);
 
     virtual ~GenericMessage();
 };
@@ -92,18 +211,13 @@ public:
 };
 
 /*--------------------JoinACK Message-------------------*/
-class JoinAck: public GenericMessage
+class JoinAck: public GenericMessage, public JoinAckFields
 {
 public:
-    /* Message fields */
-    uint8_t hopsToGateway;
-    int rssiFeedback;
-    uint8_t numChildren;
-    unsigned long nextReqTime;
-
-    JoinAck(byte* srcAddr, uint8_t hopsToGateway, uint8_t numChildren, int rssiFeedback, unsigned long nextReqTime);
+    JoinAck(byte* srcAddr, uint8_t hopsToGateway, uint8_t numChildren, int rssiFeedback, unsigned long nextReqTime,
+            uint8_t replySlot = NO_REPLY_SLOT);
     
-    virtual void toBytes(byte* const msg);
+    virtual uint8_t toBytes(byte* const msg);
 };
 
 /*--------------------JoinCFM Message-------------------*/
@@ -114,52 +228,57 @@ public:
 };
 
 /*--------------------GatewayRequest Message-------------------*/
-class GatewayRequest: public GenericMessage
+class GatewayRequest: public GenericMessage, public GatewayRequestFields
 {
 public:
+    GatewayRequest(byte* srcAddr, byte queryType, byte ulChannel, unsigned long nextReqTime = 0, byte childBackoffTime = 0,
+                   uint16_t slotLength = 0, byte numSlots = 0, byte dataRate = DEFAULT_DATA_RATE,
+                   byte missedReplies = 0);
 
-    /**
-     * Bit number from right(lowest) to left(highest) 
-     * 
-     * Bit 7: new GatewayReqTime
-     * Bit 6: new BackoffTime
-     * Bit 5-0: reserved for network management
-     * 
-     */ 
-    byte option;
-
-    unsigned long nextReqTime;
-    byte childBackoffTime;
-    byte ulChannel;
-
-    GatewayRequest(byte* srcAddr, byte queryType, byte ulChannel, unsigned long nextReqTime = 0, byte childBackoffTime = 0);
-    bool newMaxBackoff();
-    bool newNextReqTime();
-
-    virtual void toBytes(byte* const msg);
+    virtual uint8_t toBytes(byte* const msg);
 };
 
 /*--------------------NodeReply Message-------------------*/
-class NodeReply: public GenericMessage
+class NodeReply: public GenericMessage, public NodeReplyFields
 {
 public:    
-    byte option;
-    byte dataLength;
-    byte* data; // maximum length 64 bytes
-
+    /* The data are not copied, they must stay valid until the message is sent */
     NodeReply(byte* srcAddr, byte option,
-                byte dataLength, byte* data);
-    NodeReply(const NodeReply &reply);
-    ~NodeReply();
+                byte dataLength, const byte* data);
 
-    bool aggregated();
-    bool fetchMore();
+    virtual uint8_t toBytes(byte* const msg);
+};
+
+/*--------------------Received messages-------------------*/
+/**
+ * A received message. It is filled in by receiveMessage() without any allocation: the
+ * fields of the message types share a union selected by type, and the data of a NodeReply
+ * is not copied out of the trx buffer.
+ *
+ * The view is therefore only valid until the next receiveMessage() or sendMessage().
+ * Anything that has to be kept longer must be copied (e.g. ChildTable::storeReply())
+ */
+struct MessageView: public MessageHeader
+{
+    /* RSSI of the frame that carried the message */
+    int rssi;
 
-    virtual void toBytes(byte* const msg);
+    /* SNR (dB) of the frame that carried the message, 0 if the driver does not report it */
+    int8_t snr;
+
+    union
+    {
+        JoinAckFields joinAck;
+        GatewayRequestFields gatewayReq;
+        NodeReplyFields nodeReply;
+    };
 };
 
 /*
- * Reads from device buffer, constructs a message and returns a pointer to it.
+ * Reads from device buffer and parses a message into msg. Returns false if no valid
+ * message has been received.
+ * If the driver keeps the frame boundaries, the whole frame is copied with a
+ * single read(), otherwise the message is read in 2 or 3 chunks.
  * The timeout value will be used for terminating the receiving in the following
  * 2 scenarios:
  * 
@@ -173,15 +292,27 @@ public:
  * 
  * Note that the timeout value does not limit the program run-time. The actual run
  * time might exceed 1 second.
- * 
- * !! Caller needs to free the memory after using the returned pointer
+ *
+ * Both functions take the driver class as a template parameter: with a DeviceDriver pointer
+ * every driver call is virtual, with the final driver class they are inlined.
  */
-GenericMessage* receiveMessage(DeviceDriver* driver, unsigned long timeout);
-int sendMessage(DeviceDriver* driver, byte* destAddr, GenericMessage* msg);
+template <class Driver>
+bool receiveMessage(Driver* driver, unsigned long timeout, MessageView* msg);
+template <class Driver>
+int sendMessage(Driver* driver, byte* destAddr, GenericMessage* msg);
 
 /*
- * Read certain bytes from device buffer (helper function)
+ * Makes sure that the first msgLen bytes of the received message are in the trx buffer,
+ * reading the missing ones from the device block by block and hashing those covered by
+ * the MAC as they arrive (helper function)
  */
-static uint8_t readMsgFromBuff(DeviceDriver* driver, byte* buff, uint8_t msgLen, unsigned long timeout);
+template <class Driver>
+uint8_t readMsgFromBuff(Driver* driver, uint8_t msgLen, unsigned long timeout);
+
+/* Compiled once in MessageProcessor.cpp */
+extern template bool receiveMessage<DeviceDriver>(DeviceDriver* driver, unsigned long timeout, MessageView* msg);
+extern template int sendMessage<DeviceDriver>(DeviceDriver* driver, byte* destAddr, GenericMessage* msg);
+
+#include "MessageProcessorImpl.h"
 
 #endif
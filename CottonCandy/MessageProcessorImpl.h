@@ -0,0 +1,296 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * Definitions of receiveMessage() and sendMessage(). They are in a header so that the calls to a
+ * driver bound at compile time (e.g. by BasicForwardEngine<AdafruitDeviceDriver>) are not virtual
+ * and can be inlined. Only include MessageProcessor.h.
+ */
+
+#ifndef HEADER_MESSAGE_PROCESSOR_IMPL
+#define HEADER_MESSAGE_PROCESSOR_IMPL
+
+#include "Utilities.h"
+
+/**
+ * Defined in MessageProcessor.cpp, along with the parts of the parsing that do not depend on the
+ * driver and are compiled only once
+ */
+extern byte trxBuff[TRX_BUFFER_SIZE];
+extern uint8_t rxLength;
+extern bool rxFramed;
+extern uint8_t macLength;
+extern uint8_t macHashed;
+
+void startMAC();
+void updateMAC();
+void extendMAC(uint8_t length);
+bool checkMAC(uint8_t msgEnd);
+uint8_t appendMAC(uint8_t length);
+
+/*-------------------- Helpers -------------------*/
+template <class Driver>
+uint8_t readMsgFromBuff(Driver *driver, uint8_t msgLen, unsigned long timeout)
+{
+    if (msgLen <= rxLength)
+    {
+        return msgLen;
+    }
+
+    // A frame has been copied as a whole, so the rest of the message is missing
+    if (rxFramed || msgLen > TRX_BUFFER_SIZE)
+    {
+        Serial.println(F("Warning: Message longer than its frame"));
+        return 0;
+    }
+
+    // Read up to the end of every 16-byte block, so that it is hashed while the next one arrives
+    unsigned long startTime = getTimeMillis();
+    while (rxLength < msgLen)
+    {
+        unsigned long elapsed = getTimeMillis() - startTime;
+        if (elapsed >= timeout)
+        {
+            break;
+        }
+
+        uint8_t blockEnd = (rxLength | 0x0F) + 1;
+        uint8_t chunk = ((blockEnd < msgLen) ? blockEnd : msgLen) - rxLength;
+
+        uint8_t received = driver->read(trxBuff + rxLength, chunk, timeout - elapsed);
+        rxLength += received;
+        updateMAC();
+
+        if (received < chunk)
+        {
+            break;
+        }
+    }
+
+    if(rxLength < msgLen){
+        Serial.println(F("Warning: Incomplete Message"));
+        return 0;
+    }
+
+    return msgLen;
+}
+
+/**
+ * Reads the fields of a message (and its MAC) after the generic header, and decodes them.
+ * msgEnd is the length of what has been parsed so far, it is moved to the end of the fields
+ */
+template <class Driver, typename Layout>
+static bool receiveFields(Driver *driver, typename Layout::Message *fields, uint8_t *msgEnd, unsigned long timeout)
+{
+    const byte *buffPtr = trxBuff + *msgEnd;
+
+    // If the length is not fixed, it depends on the first fields (e.g. the data length of a NodeReply)
+    if (Layout::MIN_SIZE != Layout::MAX_SIZE)
+    {
+        if (!readMsgFromBuff(driver, *msgEnd + Layout::PREFIX_SIZE, timeout))
+        {
+            return false;
+        }
+
+        Layout::decodePrefix(*fields, buffPtr);
+        if (!Layout::valid(*fields))
+        {
+            return false;
+        }
+    }
+
+    // A frame that is too short is dropped before it is hashed, a streamed message is hashed as it arrives
+    uint8_t fieldsEnd = *msgEnd + Layout::size(*fields);
+    if (rxFramed && !readMsgFromBuff(driver, fieldsEnd + TRUNCATED_CMAC_SIZE, timeout))
+    {
+        return false;
+    }
+
+    extendMAC(fieldsEnd);
+
+    if (!readMsgFromBuff(driver, fieldsEnd + TRUNCATED_CMAC_SIZE, timeout))
+    {
+        return false;
+    }
+
+    // The prefix of a message whose size is not fixed has already been decoded
+    if (Layout::MIN_SIZE != Layout::MAX_SIZE)
+    {
+        Layout::decodeSuffix(*fields, buffPtr);
+    }
+    else
+    {
+        Layout::decode(*fields, buffPtr);
+    }
+
+    *msgEnd = fieldsEnd;
+    return true;
+}
+
+template <class Driver>
+bool receiveMessage(Driver *driver, unsigned long timeout, MessageView *msg)
+{
+    unsigned long startTime = getTimeMillis();
+
+    FrameInfo frame;
+    bool framed = false;
+
+    const uint8_t headerLen = 2 + MSG_LEN_GENERIC;
+    rxLength = 0;
+
+    while ((unsigned long)(getTimeMillis() - startTime) < timeout)
+    {
+        rxLength = 0;
+        macLength = 0;
+        macHashed = 0;
+
+        int16_t frameLength = driver->peekFrameLength();
+        if (frameLength == 0)
+        {
+            // Nothing has been received yet
+            continue;
+        }
+
+        framed = (frameLength > 0);
+        rxFramed = framed;
+
+        if (framed)
+        {
+            driver->frameInfo(&frame);
+
+            // Copy the whole frame at once. A frame longer than any message cannot be parsed anyway
+            rxLength = driver->read(trxBuff, frameLength < TRX_BUFFER_SIZE ? frameLength : TRX_BUFFER_SIZE, timeout);
+            if (rxLength < frameLength)
+            {
+                driver->skipFrame();
+            }
+        }
+
+        if(readMsgFromBuff(driver, headerLen, timeout)){
+            break;
+        }
+    }
+
+    if(rxLength < headerLen){
+        if (!framed && rxLength > 0)
+        {
+            driver->skipFrame();
+        }
+        return false;
+    }
+
+    HeaderLayout::decode(*msg, trxBuff + 2);
+
+    // Length of the message (including the destination address) which the MAC is computed over
+    uint8_t msgEnd = headerLen;
+
+    // The header fits in the first block of the CMAC, so nothing is encrypted before the
+    // type of the message is known and its fields are validated
+    startMAC();
+    extendMAC(headerLen);
+
+    // get the fields of the message, and its MAC, from device buffer
+    bool complete = false;
+    switch (msg->type)
+    {
+    case MESSAGE_JOIN:
+    case MESSAGE_JOIN_CFM:
+    {
+        complete = readMsgFromBuff(driver, msgEnd + TRUNCATED_CMAC_SIZE, timeout);
+        break;
+    }
+    case MESSAGE_JOIN_ACK:
+    {
+        complete = receiveFields<Driver, JoinAckLayout>(driver, &msg->joinAck, &msgEnd, timeout);
+        break;
+    }
+    case MESSAGE_GATEWAY_REQ:
+    {
+        complete = receiveFields<Driver, GatewayRequestLayout>(driver, &msg->gatewayReq, &msgEnd, timeout);
+        break;
+    }
+    case MESSAGE_NODE_REPLY:
+    {
+        complete = receiveFields<Driver, NodeReplyLayout>(driver, &msg->nodeReply, &msgEnd, timeout);
+        break;
+    }
+    default:
+        break;
+    }
+
+    if(!complete){
+        // A stream driver must not leave the rest of the message (nor the RSSI byte after it) in
+        // the stream, where it would be parsed as the start of the next one
+        if (!framed)
+        {
+            driver->skipFrame();
+        }
+        return false;
+    }
+
+    // A stream driver may receive the RSSI right after the message (e.g. the byte appended by the
+    // Ebyte module), so it is taken before the MAC is checked and never left in the stream
+    if (!framed)
+    {
+        msg->rssi = driver->getLastMessageRssi();
+        msg->snr = 0;
+    }
+
+    if (!checkMAC(msgEnd))
+    {
+        return false;
+    }
+
+    if (framed)
+    {
+        msg->rssi = frame.rssi;
+        msg->snr = frame.snr;
+    }
+
+    return true;
+}
+
+template <class Driver>
+int sendMessage(Driver* driver, byte* destAddr, GenericMessage* msg){
+    if(driver == nullptr){
+        return -1;
+    }
+
+    //Insert the destination address at the very beginning
+    memcpy(trxBuff, destAddr, 2);
+
+    uint8_t finalPacketLen = 2;
+    
+    finalPacketLen += msg->toBytes(trxBuff + finalPacketLen);
+    finalPacketLen = appendMAC(finalPacketLen);
+
+    /*
+    for(uint8_t i = 0; i< finalPacketLen; i++){
+        Serial.print(trxBuff[i], HEX);
+        Serial.print('_');
+    }
+    */
+
+    int result = 0;
+    result= driver->send(destAddr, trxBuff, finalPacketLen);
+
+    return result;
+}
+
+#endif
@@ -0,0 +1,290 @@
+/*    
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HEADER_MESSAGE_SCHEMA
+#define HEADER_MESSAGE_SCHEMA
+
+#include "Arduino.h"
+
+/**
+ * Declarative description of the message formats.
+ *
+ * A message is a MessageLayout, i.e. a list of fields in the order in which they are sent.
+ * Each field is bound to a member of a plain struct and knows its size, how to encode it
+ * and how to decode it. The encoders, the decoders and the sizes of the messages are all
+ * generated from the layout, and the sizes are known at compile time.
+ *
+ * Every field provides:
+ *      MIN_SIZE, MAX_SIZE: bounds of its size on the air (bytes)
+ *      size(m):            its actual size in message m
+ *      encode(m, buff):    writes it and returns the end of what has been written
+ *      decode(m, buff):    reads it and returns the end of what has been read
+ *      valid(m):           false if a decoded value would not fit (e.g. a corrupted length)
+ *
+ * and the fields that can be made optional (see OptionalField) provide:
+ *      clear(m):           resets it to 0, as it is decoded when it is not sent
+ *
+ * Fields can only depend on fields that come before them (e.g. OptionalField on an option
+ * byte, DataField on a length byte), since they are decoded in order.
+ */
+
+/* Times are sent as 4-byte unsigned longs (as on AVR), whatever the size of unsigned long on the platform */
+#define UNSIGNED_LONG_SIZE 4
+
+/*--------------------Fields-------------------*/
+
+/* A byte */
+template <typename Msg, byte Msg::*Member>
+struct ByteField
+{
+    enum { MIN_SIZE = 1, MAX_SIZE = 1 };
+
+    static uint8_t size(const Msg &m) { return 1; }
+    static bool valid(const Msg &m) { return true; }
+
+    static byte *encode(const Msg &m, byte *buff)
+    {
+        buff[0] = m.*Member;
+        return buff + 1;
+    }
+
+    static const byte *decode(Msg &m, const byte *buff)
+    {
+        m.*Member = buff[0];
+        return buff + 1;
+    }
+
+    static void clear(Msg &m) { m.*Member = 0; }
+};
+
+/* A 2-byte node address */
+template <typename Msg, byte (Msg::*Member)[2]>
+struct AddressField
+{
+    enum { MIN_SIZE = 2, MAX_SIZE = 2 };
+
+    static uint8_t size(const Msg &m) { return 2; }
+    static bool valid(const Msg &m) { return true; }
+
+    static byte *encode(const Msg &m, byte *buff)
+    {
+        memcpy(buff, m.*Member, 2);
+        return buff + 2;
+    }
+
+    static const byte *decode(Msg &m, const byte *buff)
+    {
+        memcpy(m.*Member, buff, 2);
+        return buff + 2;
+    }
+};
+
+/* A (negative) RSSI, sent as its absolute value in one byte */
+template <typename Msg, int Msg::*Member>
+struct RssiField
+{
+    enum { MIN_SIZE = 1, MAX_SIZE = 1 };
+
+    static uint8_t size(const Msg &m) { return 1; }
+    static bool valid(const Msg &m) { return true; }
+
+    static byte *encode(const Msg &m, byte *buff)
+    {
+        buff[0] = (uint8_t)(abs(m.*Member));
+        return buff + 1;
+    }
+
+    static const byte *decode(Msg &m, const byte *buff)
+    {
+        m.*Member = -((int)buff[0]);
+        return buff + 1;
+    }
+};
+
+/* Conversion of the unsigned longs, shared by all the LongFields */
+struct LongBytes
+{
+    static void encode(byte *buff, unsigned long l)
+    {
+        uint8_t shifter = (UNSIGNED_LONG_SIZE - 1) * 8;
+
+        for (uint8_t i = 0; i < UNSIGNED_LONG_SIZE; i++)
+        {
+            buff[i] = (byte)(l >> shifter) & 0xFF;
+            shifter -= 8;
+        }
+    }
+
+    static unsigned long decode(const byte *buff)
+    {
+        unsigned long l = 0;
+        uint8_t shifter = (UNSIGNED_LONG_SIZE - 1) * 8;
+
+        for (uint8_t i = 0; i < UNSIGNED_LONG_SIZE; i++)
+        {
+            l += (unsigned long)buff[i] << shifter;
+            shifter -= 8;
+        }
+        return l;
+    }
+};
+
+/* An unsigned long, most significant byte first */
+template <typename Msg, unsigned long Msg::*Member>
+struct LongField
+{
+    enum { MIN_SIZE = UNSIGNED_LONG_SIZE, MAX_SIZE = UNSIGNED_LONG_SIZE };
+
+    static uint8_t size(const Msg &m) { return UNSIGNED_LONG_SIZE; }
+    static bool valid(const Msg &m) { return true; }
+
+    static byte *encode(const Msg &m, byte *buff)
+    {
+        LongBytes::encode(buff, m.*Member);
+        return buff + UNSIGNED_LONG_SIZE;
+    }
+
+    static const byte *decode(Msg &m, const byte *buff)
+    {
+        m.*Member = LongBytes::decode(buff);
+        return buff + UNSIGNED_LONG_SIZE;
+    }
+
+    static void clear(Msg &m) { m.*Member = 0; }
+};
+
+/* A field that is only sent if one of the bits of Mask is set in the option byte */
+template <typename Msg, byte Msg::*Option, byte Mask, typename Field>
+struct OptionalField
+{
+    enum { MIN_SIZE = 0, MAX_SIZE = Field::MAX_SIZE };
+
+    static bool present(const Msg &m) { return (m.*Option & Mask) != 0; }
+
+    static uint8_t size(const Msg &m) { return present(m) ? Field::size(m) : 0; }
+    static bool valid(const Msg &m) { return !present(m) || Field::valid(m); }
+
+    static byte *encode(const Msg &m, byte *buff)
+    {
+        return present(m) ? Field::encode(m, buff) : buff;
+    }
+
+    static const byte *decode(Msg &m, const byte *buff)
+    {
+        if (present(m))
+        {
+            return Field::decode(m, buff);
+        }
+        Field::clear(m);
+        return buff;
+    }
+};
+
+/**
+ * Up to MaxLength bytes of data, the length being another field. The data are not copied
+ * when decoding: the member points into the buffer that the message has been decoded from
+ */
+template <typename Msg, byte Msg::*Length, const byte *Msg::*Data, uint8_t MaxLength>
+struct DataField
+{
+    enum { MIN_SIZE = 0, MAX_SIZE = MaxLength };
+
+    static uint8_t size(const Msg &m) { return m.*Length; }
+    static bool valid(const Msg &m) { return m.*Length <= MaxLength; }
+
+    static byte *encode(const Msg &m, byte *buff)
+    {
+        memcpy(buff, m.*Data, m.*Length);
+        return buff + m.*Length;
+    }
+
+    static const byte *decode(Msg &m, const byte *buff)
+    {
+        m.*Data = buff;
+        return buff + m.*Length;
+    }
+};
+
+/*--------------------Layouts-------------------*/
+
+/**
+ * A message made of the given fields. Besides the fields interface, it provides:
+ *      PREFIX_SIZE:        size of the leading fixed-size fields, i.e. what has to be received
+ *                          before the size of the whole message is known
+ *      decodePrefix(m, b): decodes those fields only
+ *      decodeSuffix(m, b): decodes the other fields
+ */
+template <typename Msg, typename... Fields>
+struct MessageLayout;
+
+template <typename Msg>
+struct MessageLayout<Msg>
+{
+    typedef Msg Message;
+
+    enum { MIN_SIZE = 0, MAX_SIZE = 0, PREFIX_SIZE = 0 };
+
+    static uint8_t size(const Msg &m) { return 0; }
+    static bool valid(const Msg &m) { return true; }
+    static byte *encode(const Msg &m, byte *buff) { return buff; }
+    static const byte *decode(Msg &m, const byte *buff) { return buff; }
+    static const byte *decodePrefix(Msg &m, const byte *buff) { return buff; }
+    static const byte *decodeSuffix(Msg &m, const byte *buff) { return buff; }
+};
+
+template <typename Msg, typename Field, typename... Rest>
+struct MessageLayout<Msg, Field, Rest...>
+{
+    typedef Msg Message;
+    typedef MessageLayout<Msg, Rest...> Next;
+
+    enum
+    {
+        FIXED = (Field::MIN_SIZE == Field::MAX_SIZE),
+        MIN_SIZE = Field::MIN_SIZE + Next::MIN_SIZE,
+        MAX_SIZE = Field::MAX_SIZE + Next::MAX_SIZE,
+        PREFIX_SIZE = FIXED ? Field::MAX_SIZE + Next::PREFIX_SIZE : 0
+    };
+
+    static uint8_t size(const Msg &m) { return Field::size(m) + Next::size(m); }
+    static bool valid(const Msg &m) { return Field::valid(m) && Next::valid(m); }
+
+    static byte *encode(const Msg &m, byte *buff)
+    {
+        return Next::encode(m, Field::encode(m, buff));
+    }
+
+    static const byte *decode(Msg &m, const byte *buff)
+    {
+        return Next::decode(m, Field::decode(m, buff));
+    }
+
+    static const byte *decodePrefix(Msg &m, const byte *buff)
+    {
+        return FIXED ? Next::decodePrefix(m, Field::decode(m, buff)) : buff;
+    }
+
+    static const byte *decodeSuffix(Msg &m, const byte *buff)
+    {
+        return FIXED ? Next::decodeSuffix(m, buff + Field::MAX_SIZE) : decode(m, buff);
+    }
+};
+
+#endif
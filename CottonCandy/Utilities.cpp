@@ -19,6 +19,15 @@
 
 #include "Utilities.h"
 
+// Software clock: the RTC time at the last resync and the value of millis() at that moment
+time_t clockBase = 0;
+unsigned long clockBaseMillis = 0;
+bool clockSynced = false;
+unsigned long clockResyncInterval = DEFAULT_CLOCK_RESYNC_INTERVAL;
+ClockStatistics clockStatistics = {0, 0, 0};
+
+volatile bool rtcAlarmFired = false;
+
 int8_t translateInterruptPin(uint8_t digitalPin){
 
   #if defined (__AVR_ATmega328P__)
@@ -91,6 +100,14 @@ void deepSleep(uint8_t irqPin, void (*wake)(), uint8_t mode){
   // ISR will detach interrupts and we won't wake.
   noInterrupts();
 
+  // The alarm fired while the MCU was awake and cannot wake it up again
+  if(rtcAlarmFired){
+    sleep_disable();
+    interrupts();
+    ADCSRA = adcState;
+    return;
+  }
+
   // If an interrupt handler (ISR) has not been attached, attach it
   if(wake){
     attachInterrupt(interruptNumber, wake, mode);
@@ -114,6 +131,9 @@ void deepSleep(uint8_t irqPin, void (*wake)(), uint8_t mode){
   sleep_cpu();  // one cycle
   //The MCU is turned off after this point
 
+  // millis() has been frozen while sleeping, the software clock must be resynchronized
+  invalidateClock();
+
   /**
    * Now the MCU has woken up, wait a while for the system to fully start up
    * Note: this is based on experience, without delays, some bytes will be
@@ -126,8 +146,24 @@ void deepSleep(uint8_t irqPin, void (*wake)(), uint8_t mode){
   ADCSRA = adcState;
 }
 
+void sleepUntilMillis(unsigned long target)
+{
+    long remaining = (long)(target - getTimeMillis());
+    if (remaining > 0)
+    {
+        sleepForMillis(remaining);
+    }
+}
+
 void turnOnRTC(uint8_t vcc)
 {
+    // The RTC is already on, no need to wait for it to start up again
+    if (digitalRead(vcc) == HIGH)
+    {
+        return;
+    }
+
+    clockStatistics.rtcPowerUps++;
     digitalWrite(vcc, HIGH);
     //pinMode(vcc, OUTPUT);
     delay(300);
@@ -147,8 +183,13 @@ void turnOffRTC(uint8_t vcc)
     //digitalWrite(A5, LOW);
 }
 
+bool clearAlarm(){
+    rtcAlarmFired = false;
+    return RTC.alarm(ALARM_1);
+}
+
 void setAlarm(time_t t){
-    RTC.alarm(ALARM_1);
+    clearAlarm();
     tmElements_t tm;
     breakTime(t, tm);
     RTC.setAlarm(ALM1_MATCH_DATE, tm.Second, tm.Minute, tm.Hour, tm.Day);
@@ -175,4 +216,55 @@ time_t compileTime()
 
     time_t t = makeTime(tm);
     return t + FUDGE;        //add fudge factor to allow for compile time
-}
\ No newline at end of file
+}
+
+time_t getTime(uint8_t vcc)
+{
+    unsigned long elapsed = getTimeMillis() - clockBaseMillis;
+
+    if (clockSynced && elapsed < clockResyncInterval * 1000)
+    {
+        clockStatistics.clockReads++;
+        return clockBase + elapsed / 1000;
+    }
+
+    bool rtcWasOn = (digitalRead(vcc) == HIGH);
+    turnOnRTC(vcc);
+
+    clockBase = RTC.get();
+    clockBaseMillis = getTimeMillis();
+    clockStatistics.rtcReads++;
+
+    // RTC.get() returns 0 if the RTC cannot be reached, try again next time
+    clockSynced = (clockBase != 0);
+
+    if (!rtcWasOn)
+    {
+        turnOffRTC(vcc);
+    }
+
+    return clockBase;
+}
+
+void invalidateClock()
+{
+    clockSynced = false;
+}
+
+void setClockResyncInterval(unsigned long seconds)
+{
+    clockResyncInterval = seconds;
+    invalidateClock();
+}
+
+ClockStatistics getClockStatistics()
+{
+    return clockStatistics;
+}
+
+void resetClockStatistics()
+{
+    clockStatistics.rtcPowerUps = 0;
+    clockStatistics.rtcReads = 0;
+    clockStatistics.clockReads = 0;
+}
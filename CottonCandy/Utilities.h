@@ -31,6 +31,9 @@ extern bool DEBUG_ENABLE;
 #define sleepForMillis delay
 #define getTimeMillis millis
 
+/* Sleeps until millis() reaches the given value (returns immediately if it has already passed) */
+void sleepUntilMillis(unsigned long target);
+
 int8_t translateInterruptPin(uint8_t digitalPin);
 
 void deepSleep(uint8_t INT = 2, void (*wake)() = nullptr, uint8_t mode = FALLING);
@@ -40,6 +43,51 @@ void turnOnRTC(uint8_t vcc);
 void turnOffRTC(uint8_t vcc);
 void setAlarm(time_t t);
 
+/**
+ * Set in the interrupt of the RTC alarm (see wake()) until the alarm is cleared. The INT line
+ * of the RTC stays low until then, so the alarm cannot wake the MCU up a second time: the
+ * functions that power the MCU down return right away while it is set
+ */
+extern volatile bool rtcAlarmFired;
+
+/* Clears the alarm of the RTC (releasing its INT line). Returns true if it had fired */
+bool clearAlarm();
+
 time_t compileTime();
 
+/*------------------ Software Clock ------------------*/
+
+/**
+ * The software clock is resynchronized with the RTC at least this often (in seconds).
+ * The resonator of a barebone ATmega328P can be off by up to 0.5%, i.e. 0.3s per minute
+ */
+#define DEFAULT_CLOCK_RESYNC_INTERVAL 60
+
+struct ClockStatistics
+{
+    // Number of times the RTC was powered up (each one costs a 300ms start-up delay)
+    uint16_t rtcPowerUps;
+    // Number of times the software clock was resynchronized from the RTC
+    uint16_t rtcReads;
+    // Number of times the time was served by the software clock without touching the RTC
+    uint16_t clockReads;
+};
+
+/**
+ * Returns the current time in seconds. The time is kept by a software clock anchored to
+ * millis(), and the RTC (powered through the vcc pin) is only read when the clock needs
+ * to be resynchronized: after the MCU wakes up from deep sleep (millis() does not advance
+ * in power-down mode) and once every resync interval. If the RTC is already turned on,
+ * it is left on.
+ */
+time_t getTime(uint8_t vcc);
+
+/* Forces the next getTime() to resynchronize with the RTC (e.g. after the RTC has been set or the MCU slept) */
+void invalidateClock();
+
+void setClockResyncInterval(unsigned long seconds);
+
+ClockStatistics getClockStatistics();
+void resetClockStatistics();
+
 #endif
\ No newline at end of file
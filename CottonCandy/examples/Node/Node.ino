@@ -110,6 +110,10 @@ void setup()
   // myDriver = new AdafruitDeviceDriver(myAddr);
   myDriver->init();
 
+  // Time from the reset until the node can start joining, mostly spent configuring the transceiver
+  Serial.print(F("Ready to join after (ms): "));
+  Serial.println(millis());
+
   // Create a LoRaMesh object
   manager = new LoRaMesh(myAddr, myDriver);
 
@@ -0,0 +1,382 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/**
+ * Micro-benchmark of receiveMessage(): every message type is encoded with
+ * sendMessage() into a FrameQueue (as the receive ISR would) and parsed back.
+ * The MessageView is encoded again with the message layouts and has to give
+ * the bytes that were sent, so every field makes the round trip through the
+ * message schema. It runs twice, once through the byte-at-a-time defaults of
+ * DeviceDriver (available() and recv() for every byte, as the Ebyte driver
+ * did) and once through the bulk read() and peekFrameLength() of the frame
+ * queue, and prints the host time and the number of driver calls per frame.
+ * Like the Ebyte module, the byte-at-a-time driver appends an RSSI byte to
+ * every frame, and a message that cannot be parsed must not leave the rest of
+ * its frame in the stream, where it would corrupt the next one.
+ *
+ * It then times the receive loop of the engine (ForwardEngine::receiveReplies():
+ * available() and receiveMessage() until the queue is empty) through a
+ * DeviceDriver pointer, as ForwardEngine does, and through the final driver
+ * class, as BasicForwardEngine<Driver> does, in CPU cycles per frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "Cycles.h"
+#include "FrameQueue.h"
+#include "MessageProcessor.h"
+
+#define BENCH_DEFAULT_FRAMES 200000
+
+/* RSSI byte appended to the frames in the stream, -(256 - value) dBm as on the Ebyte module */
+#define BENCH_RSSI_BYTE 176
+
+/* A loopback transceiver: send() puts the frame in its own receive queue */
+class BenchDriver final : public DeviceDriver
+{
+public:
+    explicit BenchDriver(bool bulk) : m_bulk(bulk) {}
+
+    int send(byte *destAddr, byte *msg, uint8_t msgLen)
+    {
+        memcpy(lastFrame, msg, msgLen);
+        if (!m_rxQueue.beginFrame(m_bulk ? msgLen : msgLen + 1))
+        {
+            return -1;
+        }
+        for (uint8_t i = 0; i < msgLen; i++)
+        {
+            m_rxQueue.write(msg[i]);
+        }
+        if (!m_bulk)
+        {
+            m_rxQueue.write(BENCH_RSSI_BYTE);
+        }
+        m_rxQueue.endFrame(-80, 7, millis());
+        return 1;
+    }
+
+    byte recv()
+    {
+        calls++;
+        return m_rxQueue.read();
+    }
+
+    int available()
+    {
+        calls++;
+        return m_rxQueue.available();
+    }
+
+    uint8_t read(byte *dst, uint8_t n, unsigned long timeout)
+    {
+        if (!m_bulk)
+        {
+            return DeviceDriver::read(dst, n, timeout);
+        }
+        calls++;
+        return m_rxQueue.read(dst, n);
+    }
+
+    int16_t peekFrameLength()
+    {
+        if (!m_bulk)
+        {
+            return DeviceDriver::peekFrameLength();
+        }
+        calls++;
+        return m_rxQueue.peekFrameLength();
+    }
+
+    bool frameInfo(FrameInfo *info)
+    {
+        if (!m_bulk)
+        {
+            return false;
+        }
+        calls++;
+        return m_rxQueue.frameInfo(info);
+    }
+
+    /* The rest of the message and the RSSI byte in the stream */
+    void skipFrame()
+    {
+        calls++;
+        m_rxQueue.skipFrame();
+    }
+
+    int getLastMessageRssi()
+    {
+        if (m_bulk)
+        {
+            return -80;
+        }
+        return -(256 - (int)recv());
+    }
+    uint8_t getDeviceType() { return DeviceType::UNKNOWN; }
+    void setFrequency(unsigned long frequency) {}
+    void setMode(DeviceMode mode) {}
+
+    unsigned long calls = 0;
+    byte lastFrame[256];
+
+private:
+    bool m_bulk;
+    FrameQueue m_rxQueue;
+};
+
+static byte srcAddr[2] = {0x00, 0x07};
+static byte destAddr[2] = {0x00, 0x01};
+
+#define BENCH_NUM_MESSAGES 7
+
+static const char *messageNames[BENCH_NUM_MESSAGES] = {"Join", "JoinAck", "JoinCFM", "GatewayRequest",
+                                                       "GatewayRequest/0", "NodeReply", "NodeReply/0"};
+
+/* Every message type, and the variable-length ones without their optional fields or data too */
+static GenericMessage *makeMessage(uint8_t index)
+{
+    static const byte data[32] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+                                  17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32};
+
+    switch (index)
+    {
+    case 0:
+        return new Join(srcAddr);
+    case 1:
+        return new JoinAck(srcAddr, 3, 2, -97, 1600000000UL, 1);
+    case 2:
+        return new JoinCFM(srcAddr);
+    case 3:
+        return new GatewayRequest(srcAddr, 0, 5, 1600000120UL, 4, 500, 6, MAX_DATA_RATE, 0b0101);
+    case 4:
+        return new GatewayRequest(srcAddr, 0, 5);
+    case 5:
+        return new NodeReply(srcAddr, MASK_NODE_REPLY_AGGREGATED, sizeof(data), data);
+    default:
+        return new NodeReply(srcAddr, MASK_NODE_REPLY_FETCH_MORE, 0, data);
+    }
+}
+
+/* Encodes a received message again, without the destination address and the MAC. Returns its length */
+static uint8_t encodeView(const MessageView &view, byte *buff)
+{
+    byte *end = HeaderLayout::encode(view, buff);
+
+    switch (view.type)
+    {
+    case MESSAGE_JOIN_ACK:
+        end = JoinAckLayout::encode(view.joinAck, end);
+        break;
+    case MESSAGE_GATEWAY_REQ:
+        end = GatewayRequestLayout::encode(view.gatewayReq, end);
+        break;
+    case MESSAGE_NODE_REPLY:
+        end = NodeReplyLayout::encode(view.nodeReply, end);
+        break;
+    default:
+        break;
+    }
+
+    return end - buff;
+}
+
+/* Length of a message, without the destination address and the MAC */
+static uint8_t messageLength(GenericMessage *msg)
+{
+    byte buff[TRX_BUFFER_SIZE];
+    return msg->toBytes(buff);
+}
+
+/* Parses the frame of the given type `frames` times. Returns the host time per frame in ns, or -1 on a parse error */
+static double run(uint8_t index, bool bulk, unsigned long frames, double *callsPerFrame, uint8_t *frameLen)
+{
+    BenchDriver driver(bulk);
+    GenericMessage *sent = makeMessage(index);
+    uint8_t sentLen = messageLength(sent);
+    *frameLen = 2 + sentLen + TRUNCATED_CMAC_SIZE;
+
+    std::chrono::steady_clock::duration total(0);
+
+    for (unsigned long i = 0; i < frames; i++)
+    {
+        sendMessage(&driver, destAddr, sent);
+
+        MessageView received;
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = receiveMessage(&driver, 1000, &received);
+        total += std::chrono::steady_clock::now() - start;
+
+        byte encoded[TRX_BUFFER_SIZE];
+        if (!ok || encodeView(received, encoded) != sentLen || memcmp(encoded, driver.lastFrame + 2, sentLen) != 0)
+        {
+            delete sent;
+            return -1;
+        }
+    }
+
+    delete sent;
+    *callsPerFrame = (double)driver.calls / frames;
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(total).count() / frames;
+}
+
+/**
+ * Queues a frame that cannot be parsed (unknown message type) in front of a valid one, and
+ * parses both. Returns false if the valid message is not received with the RSSI of its frame
+ */
+static bool resync(bool bulk)
+{
+    GenericMessage *sent = makeMessage(5);
+
+    BenchDriver encoder(true);
+    sendMessage(&encoder, destAddr, sent);
+    uint8_t frameLen = 2 + messageLength(sent) + TRUNCATED_CMAC_SIZE;
+    encoder.lastFrame[2] = 0xFF;
+
+    BenchDriver driver(bulk);
+    driver.send(destAddr, encoder.lastFrame, frameLen);
+    sendMessage(&driver, destAddr, sent);
+    delete sent;
+
+    MessageView received;
+    bool dropped = !receiveMessage(&driver, 1000, &received);
+    return dropped && receiveMessage(&driver, 1000, &received) && received.type == MESSAGE_NODE_REPLY &&
+           received.rssi == -80 && driver.available() == 0;
+}
+
+/* Number of frames queued before each run of the receive loop (the longest ones must fit in the queue) */
+#define BENCH_LOOP_BATCH 4
+
+/**
+ * The receive loop of the engine with the given driver class. Returns the cycles per frame,
+ * or -1 if a frame is not received. It is not inlined, so that the compiler cannot see the
+ * actual class of a DeviceDriver pointer
+ */
+template <class Driver>
+__attribute__((noinline)) static double receiveLoop(Driver *driver, GenericMessage *sent, unsigned long frames)
+{
+    uint64_t total = 0;
+    unsigned long received = 0;
+
+    for (unsigned long i = 0; i < frames; i += BENCH_LOOP_BATCH)
+    {
+        for (uint8_t n = 0; n < BENCH_LOOP_BATCH; n++)
+        {
+            sendMessage(driver, destAddr, sent);
+        }
+
+        uint64_t start = cycles();
+        while (driver->available() > 0)
+        {
+            MessageView msg;
+            if (receiveMessage(driver, 1000, &msg) && msg.type == sent->type)
+            {
+                received++;
+            }
+        }
+        total += cycles() - start;
+    }
+
+    unsigned long batches = (frames + BENCH_LOOP_BATCH - 1) / BENCH_LOOP_BATCH;
+    if (received != batches * BENCH_LOOP_BATCH)
+    {
+        return -1;
+    }
+    return (double)total / received;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long frames = BENCH_DEFAULT_FRAMES;
+    if (argc > 1)
+    {
+        frames = strtoul(argv[1], nullptr, 10);
+    }
+    if (frames == 0)
+    {
+        fprintf(stderr, "usage: %s [frames]\n", argv[0]);
+        return 1;
+    }
+
+    printf("\n=== receiveMessage(): %lu frames per message type ===\n\n", frames);
+    printf("%-16s %5s   %14s %10s   %14s %10s\n", "", "", "byte-at-a-time", "", "bulk read", "");
+    printf("%-16s %5s   %14s %10s   %14s %10s\n", "message", "bytes", "driver calls", "ns/frame", "driver calls",
+           "ns/frame");
+
+    for (uint8_t i = 0; i < BENCH_NUM_MESSAGES; i++)
+    {
+        double streamCalls = 0;
+        double bulkCalls = 0;
+        uint8_t frameLen = 0;
+
+        double streamNs = run(i, false, frames, &streamCalls, &frameLen);
+        double bulkNs = run(i, true, frames, &bulkCalls, &frameLen);
+
+        if (streamNs < 0 || bulkNs < 0)
+        {
+            fprintf(stderr, "%s: the parsed message does not match the one sent\n", messageNames[i]);
+            return 1;
+        }
+
+        printf("%-16s %5u   %14.1f %10.0f   %14.1f %10.0f\n", messageNames[i], frameLen, streamCalls, streamNs, bulkCalls,
+               bulkNs);
+    }
+
+    printf("\nTimes are host times and include the CMAC verification.\n");
+
+    if (!resync(false) || !resync(true))
+    {
+        fprintf(stderr, "The message after one that could not be parsed was not received\n");
+        return 1;
+    }
+
+    printf("\n=== Receive loop of the engine: %lu frames per message type ===\n\n", frames);
+    printf("%-16s %5s   %14s %14s\n", "message", "bytes", "DeviceDriver*", "BenchDriver*");
+
+    for (uint8_t i = 0; i < BENCH_NUM_MESSAGES; i++)
+    {
+        BenchDriver driver(true);
+        GenericMessage *sent = makeMessage(i);
+
+        double virtualCycles = receiveLoop<DeviceDriver>(&driver, sent, frames);
+        double directCycles = receiveLoop<BenchDriver>(&driver, sent, frames);
+        uint8_t frameLen = 2 + messageLength(sent) + TRUNCATED_CMAC_SIZE;
+        delete sent;
+
+        if (virtualCycles < 0 || directCycles < 0)
+        {
+            fprintf(stderr, "%s: frames were lost in the receive loop\n", messageNames[i]);
+            return 1;
+        }
+
+        printf("%-16s %5u   %14.0f %14.0f\n", messageNames[i], frameLen, virtualCycles, directCycles);
+    }
+
+#if HAVE_CYCLE_COUNTER
+    printf("\nCycles per frame are host TSC cycles and include the CMAC verification.\n");
+#else
+    printf("\nNo cycle counter on this host, the receive loop is timed in nanoseconds per frame.\n");
+#endif
+    return 0;
+}
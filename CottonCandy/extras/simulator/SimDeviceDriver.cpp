@@ -0,0 +1,530 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+
+#include "SimDeviceDriver.h"
+#include "Utilities.h"
+
+namespace sim
+{
+
+/* Drivers indexed by node, so that the (context-free) ISR can find its transceiver */
+static std::vector<SimDeviceDriver *> drivers;
+
+SimDeviceDriver::SimDeviceDriver(SimMedium *medium, uint16_t node, byte *addr, uint8_t intPin) : DeviceDriver()
+{
+    m_medium = medium;
+    m_node = node;
+    m_irqPin = intPin;
+
+    m_addr[0] = addr[0];
+    m_addr[1] = addr[1];
+
+    if (drivers.size() <= node)
+    {
+        drivers.resize(node + 1, nullptr);
+    }
+    drivers[node] = this;
+
+    m_medium->attach(node, this);
+    m_modeSince = Kernel::instance().time();
+}
+
+SimDeviceDriver::~SimDeviceDriver()
+{
+    drivers[m_node] = nullptr;
+    m_medium->attach(m_node, nullptr);
+}
+
+bool SimDeviceDriver::init()
+{
+    m_freq = 915E6;
+
+    attachInterrupt(digitalPinToInterrupt(m_irqPin), onReceive, RISING);
+    setMode(STANDBY);
+
+    Serial.println(F("LoRa Module initialized"));
+    return true;
+}
+
+void SimDeviceDriver::onReceive()
+{
+    SimDeviceDriver *driver = drivers[Kernel::instance().current()->id];
+
+    const uint8_t *frame = driver->m_fifo;
+    bool correctRecipient = (frame[0] == driver->m_addr[0] && frame[1] == driver->m_addr[1]) ||
+                            (frame[0] == 0xFF && frame[1] == 0xFF);
+
+    if (!correctRecipient)
+    {
+        // Compute the margin of the packet (i.e. How many dB higher than the minimum sensitivity)
+        driver->m_totalInterferingMargin += (driver->m_packetRssi + SIM_INTERFERING_MARGIN_OFFSET);
+        return;
+    }
+
+    if (!driver->m_rxQueue.beginFrame(driver->m_fifoLen))
+    {
+        Serial.println(F("Queue is full"));
+        return;
+    }
+
+    // Copied in bursts like the FIFO reads of AdafruitDeviceDriver
+    uint8_t copied = 0;
+    while (copied < driver->m_fifoLen)
+    {
+        byte *dst;
+        uint8_t n = driver->m_rxQueue.writeSpan(&dst, driver->m_fifoLen - copied);
+        memcpy(dst, frame + copied, n);
+        driver->m_rxQueue.advance(n);
+        copied += n;
+    }
+    driver->m_rxQueue.endFrame(driver->m_packetRssi, (int8_t)driver->m_packetSnr, millis());
+}
+
+void SimDeviceDriver::onFrame(const uint8_t *frame, uint8_t len, int rssi, double snr)
+{
+    memcpy(m_fifo, frame, len);
+    m_fifoLen = len;
+    m_packetRssi = rssi;
+    m_packetSnr = snr;
+
+    Kernel::instance().raiseInterrupt(Kernel::instance().nodes()[m_node], digitalPinToInterrupt(m_irqPin), RISING);
+}
+
+bool SimDeviceDriver::isListening(uint64_t freq, const LoRaParams &params) const
+{
+    return m_mode == RX && m_freq == freq && m_params.sf == params.sf && m_params.bw == params.bw;
+}
+
+int SimDeviceDriver::send(byte *destAddr, byte *msg, uint8_t msgLen)
+{
+    waitForTx();
+
+    m_params.preambleLen = (m_wakeUpPreamble && m_sampleInterval > 0) ? wakeUpPreambleLength() : SIM_PREAMBLE_LENGTH;
+
+    if (m_lbt)
+    {
+        uint8_t attempts = 1;
+        while (!channelClear())
+        {
+            if (attempts == SIM_LBT_MAX_ATTEMPTS)
+            {
+                m_lbtFailures++;
+                break;
+            }
+            attempts++;
+            m_lbtDeferrals++;
+
+            // Keep receiving while deferring, the frame on air may be for us
+            setMode(RX);
+            sleepForMillis(::random(SIM_LBT_MIN_DEFERRAL, SIM_LBT_MAX_DEFERRAL + 1) << (m_params.sf - 7));
+        }
+    }
+
+    Kernel &kernel = Kernel::instance();
+    kernel.sync();
+
+    settleModeTime();
+    m_mode = TX;
+    m_medium->interruptReception(m_node);
+
+    SimTime airtime = m_medium->transmit(m_node, msg, msgLen, m_freq, (int8_t)m_txPwr, m_params);
+    framesSent++;
+
+    // LoRa.endPacket(true) returns right away, the transceiver then goes to RX unless another mode is requested
+    m_txPending = true;
+    m_txEnd = kernel.time() + airtime;
+    m_modeAfterTx = RX;
+    Node *node = kernel.nodes()[m_node];
+    kernel.schedule(m_txEnd, [this, node]() { Kernel::instance().interrupt(node, [this]() { endTx(); }); });
+
+    return 1;
+}
+
+bool SimDeviceDriver::txDone()
+{
+    if (m_txPending)
+    {
+        Kernel::instance().sync();
+    }
+    return !m_txPending;
+}
+
+void SimDeviceDriver::onTxDone(void (*callback)())
+{
+    m_txDoneCallback = callback;
+}
+
+void SimDeviceDriver::endTx()
+{
+    if (!m_txPending)
+    {
+        return;
+    }
+
+    settleModeTime();
+    m_mode = m_modeAfterTx;
+    m_txPending = false;
+
+    if (m_txDoneCallback != nullptr)
+    {
+        m_txDoneCallback();
+    }
+}
+
+bool SimDeviceDriver::channelClear()
+{
+    Kernel &kernel = Kernel::instance();
+    kernel.sync();
+
+    // A CAD would abort the frame being received
+    if (m_mode == RX && m_medium->receiving(m_node))
+    {
+        return false;
+    }
+
+    // The transceiver does not receive during the CAD, it draws the RX current though
+    settleModeTime();
+    m_mode = STANDBY;
+    m_medium->interruptReception(m_node);
+
+    SimTime start = kernel.time();
+    SimTime duration = SimMedium::cadTime(m_params);
+    kernel.sleepFor(duration);
+    cads++;
+
+    modeTime[RX] += duration;
+    m_modeSince = kernel.time();
+
+    // The SX127x is in STANDBY after a CAD
+    return !m_medium->channelActivity(m_node, m_freq, m_params, start, start + duration);
+}
+
+void SimDeviceDriver::waitForTx()
+{
+    // The end of the transmission is only seen in the interrupt on DIO0, as in AdafruitDeviceDriver
+    Kernel &kernel = Kernel::instance();
+    while (m_txPending)
+    {
+        kernel.sleepFor((m_txEnd > kernel.time()) ? m_txEnd - kernel.time() : SIM_MILLISECOND);
+    }
+}
+
+byte SimDeviceDriver::recv()
+{
+    return m_rxQueue.read();
+}
+
+int SimDeviceDriver::available()
+{
+    return m_rxQueue.available();
+}
+
+uint8_t SimDeviceDriver::read(byte *dst, uint8_t n, unsigned long timeout)
+{
+    uint8_t count = m_rxQueue.read(dst, n);
+    unsigned long startTime = millis();
+
+    while (count < n && (unsigned long)(millis() - startTime) < timeout)
+    {
+        count += m_rxQueue.read(dst + count, n - count);
+    }
+
+    return count;
+}
+
+int16_t SimDeviceDriver::peekFrameLength()
+{
+    return m_rxQueue.peekFrameLength();
+}
+
+bool SimDeviceDriver::frameInfo(FrameInfo *info)
+{
+    return m_rxQueue.frameInfo(info);
+}
+
+void SimDeviceDriver::skipFrame()
+{
+    m_rxQueue.skipFrame();
+}
+
+uint16_t SimDeviceDriver::getRxOverflows()
+{
+    return m_rxQueue.arenaOverflows() + m_rxQueue.slotOverflows();
+}
+
+int SimDeviceDriver::getLastMessageRssi()
+{
+    return m_packetRssi;
+}
+
+uint8_t SimDeviceDriver::getDeviceType()
+{
+    return DeviceType::UNKNOWN;
+}
+
+void SimDeviceDriver::powerDownMCU()
+{
+    /**
+     * A no-op, as the caller waits for txDone() first. If it did not, the interrupts may be masked
+     * here and the kernel reports the deadlock that AdafruitDeviceDriver would run into
+     */
+    waitForTx();
+    deepSleep(m_irqPin);
+}
+
+void SimDeviceDriver::powerDownMCUSampling()
+{
+    waitForTx();
+    Kernel::instance().sync();
+
+    // Does not abort a frame that is being received
+    if (m_sampleInterval == 0 || m_mode != RX || m_medium->receiving(m_node))
+    {
+        powerDownMCU();
+        return;
+    }
+
+    uint8_t rxPrescaler = (m_samplePrescaler + 2 < 4) ? 4 : m_samplePrescaler + 2;
+    rxPrescaler = (rxPrescaler > 9) ? 9 : rxPrescaler;
+
+    while (true)
+    {
+        setMode(SLEEP);
+
+        if (!powerDownFor(m_samplePrescaler))
+        {
+            break;
+        }
+
+        if (channelClear())
+        {
+            continue;
+        }
+
+        // Enters RX in the middle of the preamble
+        setMode(RX);
+        m_medium->startListening(m_node, m_freq, m_params);
+        if (!powerDownFor(rxPrescaler))
+        {
+            break;
+        }
+    }
+
+    setMode(RX);
+}
+
+bool SimDeviceDriver::powerDownFor(uint8_t prescaler)
+{
+    // The INT line of the RTC is held low, the alarm would not wake the MCU up again
+    if (rtcAlarmFired)
+    {
+        interrupts();
+        return false;
+    }
+
+    interrupts();
+    bool timerFired = Kernel::instance().sleepCpuFor((SimTime)(16U << prescaler) * SIM_MILLISECOND);
+
+    // millis() has been frozen while sleeping, the software clock must be resynchronized
+    invalidateClock();
+    return timerFired && !rtcAlarmFired;
+}
+
+void SimDeviceDriver::setPreambleSampling(uint16_t interval)
+{
+    if (interval < 16)
+    {
+        m_sampleInterval = 0;
+        return;
+    }
+
+    m_samplePrescaler = 0;
+    while (m_samplePrescaler < 9 && (16U << (m_samplePrescaler + 1)) <= interval)
+    {
+        m_samplePrescaler++;
+    }
+    m_sampleInterval = 16U << m_samplePrescaler;
+}
+
+void SimDeviceDriver::setWakeUpPreamble(bool enabled)
+{
+    m_wakeUpPreamble = enabled;
+}
+
+uint16_t SimDeviceDriver::wakeUpPreambleLength() const
+{
+    uint32_t symbols = (((uint32_t)m_sampleInterval * 5 / 4) * (m_params.bw / 1000)) >> m_params.sf;
+    symbols += SIM_PREAMBLE_LENGTH;
+
+    return (symbols > 0xFFFF) ? 0xFFFF : symbols;
+}
+
+byte SimDeviceDriver::random()
+{
+    return (byte)::random(0, 256);
+}
+
+uint16_t SimDeviceDriver::getTotalInterferingMargin()
+{
+    return m_totalInterferingMargin;
+}
+
+void SimDeviceDriver::resetStatistics()
+{
+    m_totalInterferingMargin = 0;
+    m_lbtDeferrals = 0;
+    m_lbtFailures = 0;
+}
+
+void SimDeviceDriver::settleModeTime()
+{
+    SimTime now = Kernel::instance().time();
+    if (now > m_modeSince)
+    {
+        modeTime[m_mode] += now - m_modeSince;
+        m_modeSince = now;
+    }
+}
+
+void SimDeviceDriver::setFrequency(unsigned long frequency)
+{
+    if (m_freq == frequency)
+    {
+        return;
+    }
+
+    waitForTx();
+
+    Kernel::instance().sync();
+    m_freq = frequency;
+    m_medium->interruptReception(m_node);
+}
+
+void SimDeviceDriver::setSpreadingFactor(uint8_t sf)
+{
+    if (m_params.sf != sf)
+    {
+        waitForTx();
+        Kernel::instance().sync();
+        m_params.sf = sf;
+        m_medium->interruptReception(m_node);
+    }
+}
+
+void SimDeviceDriver::setChannelBandwidth(long bw)
+{
+    if (m_params.bw != bw)
+    {
+        waitForTx();
+        Kernel::instance().sync();
+        m_params.bw = bw;
+        m_medium->interruptReception(m_node);
+    }
+}
+
+void SimDeviceDriver::setCodingRateDenominator(uint8_t cr)
+{
+    if (m_params.cr != cr)
+    {
+        waitForTx();
+        m_params.cr = cr;
+    }
+}
+
+void SimDeviceDriver::setDataRate(uint8_t dataRate)
+{
+    const LoRaParams defaults;
+    dataRate = constrain(dataRate, getMinDataRate(), getMaxDataRate());
+
+    if (dataRate < DEFAULT_DATA_RATE)
+    {
+        setChannelBandwidth(defaults.bw);
+        setSpreadingFactor(defaults.sf + (DEFAULT_DATA_RATE - dataRate));
+    }
+    else
+    {
+        setSpreadingFactor(defaults.sf);
+        setChannelBandwidth(defaults.bw << (dataRate - DEFAULT_DATA_RATE));
+    }
+}
+
+uint8_t SimDeviceDriver::getMinDataRate()
+{
+    return MIN_DATA_RATE;
+}
+
+uint8_t SimDeviceDriver::getMaxDataRate()
+{
+    return MAX_DATA_RATE;
+}
+
+void SimDeviceDriver::setMode(DeviceMode mode)
+{
+    if (m_txPending)
+    {
+        // The transmission may have ended in the CPU time the node has used since it last blocked
+        Kernel::instance().sync();
+    }
+
+    if (m_txPending)
+    {
+        // Applied at the end of the transmission
+        m_modeAfterTx = mode;
+        return;
+    }
+
+    if (mode == m_mode)
+    {
+        return;
+    }
+
+    Kernel::instance().sync();
+    settleModeTime();
+    m_mode = mode;
+    m_medium->interruptReception(m_node);
+}
+
+void SimDeviceDriver::setListenBeforeTalk(bool enabled)
+{
+    m_lbt = enabled;
+}
+
+uint16_t SimDeviceDriver::getLbtDeferrals()
+{
+    return m_lbtDeferrals;
+}
+
+uint16_t SimDeviceDriver::getLbtFailures()
+{
+    return m_lbtFailures;
+}
+
+void SimDeviceDriver::setTxPwr(uint8_t pwr)
+{
+    if (m_txPwr == pwr)
+    {
+        return;
+    }
+    waitForTx();
+    m_txPwr = pwr;
+}
+
+} // namespace sim
@@ -0,0 +1,179 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEADER_SIM_DEVICE_DRIVER
+#define HEADER_SIM_DEVICE_DRIVER
+
+#include "Arduino.h"
+#include "DeviceDriver.h"
+#include "FrameQueue.h"
+#include "SimMedium.h"
+
+/* Receiver sensitivity offset used for the interfering margin (same as AdafruitDeviceDriver) */
+#define SIM_INTERFERING_MARGIN_OFFSET 123
+
+/* Listen before talk deferrals (same as AdafruitDeviceDriver) */
+#define SIM_LBT_MIN_DEFERRAL 5
+#define SIM_LBT_MAX_DEFERRAL 40
+#define SIM_LBT_MAX_ATTEMPTS 8
+
+/* Preamble of the frames that do not have to wake up a receiver (same as AdafruitDeviceDriver) */
+#define SIM_PREAMBLE_LENGTH 8
+
+namespace sim
+{
+
+/**
+ * A simulated SX127x transceiver behind the DeviceDriver interface. It behaves
+ * like AdafruitDeviceDriver: frames carry the destination address in the
+ * first two bytes, the receive ISR filters them and copies the accepted ones
+ * into a FrameQueue, powerDownMCU() sleeps until DIO0 fires, and send()
+ * returns while the frame is on air.
+ */
+class SimDeviceDriver final : public DeviceDriver
+{
+public:
+    SimDeviceDriver(SimMedium *medium, uint16_t node, byte *addr, uint8_t intPin = 3);
+
+    ~SimDeviceDriver();
+
+    bool init();
+
+    int send(byte *destAddr, byte *msg, uint8_t msgLen);
+
+    bool txDone();
+
+    void onTxDone(void (*callback)());
+
+    byte recv();
+
+    int available();
+
+    uint8_t read(byte *dst, uint8_t n, unsigned long timeout);
+    int16_t peekFrameLength();
+
+    bool frameInfo(FrameInfo *info);
+    void skipFrame();
+    uint16_t getRxOverflows();
+
+    int getLastMessageRssi();
+
+    uint8_t getDeviceType();
+
+    void powerDownMCU();
+
+    /* Preamble sampling with the watchdog periods, as in AdafruitDeviceDriver */
+    void setPreambleSampling(uint16_t interval);
+    void setWakeUpPreamble(bool enabled);
+    void powerDownMCUSampling();
+
+    byte random();
+
+    uint16_t getTotalInterferingMargin();
+    void resetStatistics();
+
+    void setFrequency(unsigned long frequency);
+    void setSpreadingFactor(uint8_t sf);
+    void setChannelBandwidth(long bw);
+    void setCodingRateDenominator(uint8_t cr);
+
+    /* Data rates from SF9 to SF7/500kHz around SF7/125kHz, as in AdafruitDeviceDriver */
+    void setDataRate(uint8_t dataRate);
+    uint8_t getMinDataRate();
+    uint8_t getMaxDataRate();
+
+    void setMode(DeviceMode mode);
+    void setTxPwr(uint8_t pwr);
+
+    /* Listen before talk in send(), as in AdafruitDeviceDriver */
+    void setListenBeforeTalk(bool enabled);
+    uint16_t getLbtDeferrals();
+    uint16_t getLbtFailures();
+
+    /*-----------Used by the medium-----------*/
+    const byte *address() const { return m_addr; }
+    bool isListening(uint64_t freq, const LoRaParams &params) const;
+
+    /* A frame has been demodulated: put it in the FIFO and raise DIO0 */
+    void onFrame(const uint8_t *frame, uint8_t len, int rssi, double snr);
+
+    /* Time spent by the transceiver in each DeviceMode */
+    SimTime modeTime[4] = {0};
+    uint32_t framesSent = 0;
+    uint32_t cads = 0;
+
+    /* Brings the mode accounting up to date */
+    void settleModeTime();
+
+private:
+    static void onReceive();
+
+    /* DIO0 rises at the end of the transmission */
+    void endTx();
+
+    /* Sleeps until the end of the pending transmission */
+    void waitForTx();
+
+    /* Runs a CAD. Returns false if it detected LoRa symbols on the channel */
+    bool channelClear();
+
+    /* Powers the MCU down for 16 ms << prescaler (the watchdog). True if the watchdog woke it up */
+    bool powerDownFor(uint8_t prescaler);
+
+    /* Preamble that lasts longer than the sampling interval (symbols) */
+    uint16_t wakeUpPreambleLength() const;
+
+    SimMedium *m_medium;
+    uint16_t m_node;
+    uint8_t m_irqPin;
+
+    unsigned long m_freq = 0;
+    LoRaParams m_params;
+    uint8_t m_txPwr = 17;
+    SimTime m_modeSince = 0;
+
+    /* Transmission on air, and the mode requested for after it */
+    bool m_txPending = false;
+    SimTime m_txEnd = 0;
+    DeviceMode m_modeAfterTx = RX;
+    void (*m_txDoneCallback)() = nullptr;
+
+    bool m_lbt = false;
+    uint16_t m_lbtDeferrals = 0;
+    uint16_t m_lbtFailures = 0;
+
+    uint8_t m_samplePrescaler = 0;
+    uint16_t m_sampleInterval = 0;
+    bool m_wakeUpPreamble = false;
+
+    /* Transceiver FIFO holding the last demodulated frame */
+    uint8_t m_fifo[256];
+    uint8_t m_fifoLen = 0;
+    int m_packetRssi = 0;
+    double m_packetSnr = 0;
+
+    /* Filled in the receive ISR */
+    FrameQueue m_rxQueue;
+
+    uint16_t m_totalInterferingMargin = 0;
+};
+
+} // namespace sim
+
+#endif
@@ -0,0 +1,113 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * The library keeps part of its state in global variables since a real board
+ * only ever runs one node. All virtual nodes share one address space here, so
+ * the kernel swaps those globals in and out whenever it switches nodes.
+ *
+ * Whenever a new global variable that outlives a single function call is
+ * added to the library, it has to be listed in SIM_NODE_GLOBALS.
+ */
+
+#include "SimKernel.h"
+#include "ForwardEngine.h"
+
+/* Defined in ForwardEngine.cpp */
+extern uint8_t myRTCInterruptPin;
+extern uint8_t myRTCVccPin;
+extern volatile uint8_t state;
+extern volatile bool alarmSetForReceiving;
+extern volatile bool rtcAlarmFired;
+
+/* Defined in Utilities.cpp */
+extern time_t clockBase;
+extern unsigned long clockBaseMillis;
+extern bool clockSynced;
+extern unsigned long clockResyncInterval;
+extern ClockStatistics clockStatistics;
+
+/* Defined by the sketch on a real board */
+bool DEBUG_ENABLE = false;
+
+#define SIM_NODE_GLOBALS(X)                \
+    X(uint8_t, myRTCInterruptPin)          \
+    X(uint8_t, myRTCVccPin)                \
+    X(uint8_t, state)                      \
+    X(bool, alarmSetForReceiving)          \
+    X(bool, rtcAlarmFired)                 \
+    X(time_t, clockBase)                   \
+    X(unsigned long, clockBaseMillis)      \
+    X(bool, clockSynced)                   \
+    X(unsigned long, clockResyncInterval)  \
+    X(ClockStatistics, clockStatistics)    \
+    X(bool, DEBUG_ENABLE)
+
+namespace sim
+{
+
+struct NodeGlobals
+{
+#define SIM_DECLARE_GLOBAL(type, name) type name;
+    SIM_NODE_GLOBALS(SIM_DECLARE_GLOBAL)
+#undef SIM_DECLARE_GLOBAL
+};
+
+static NodeGlobals *pristine = nullptr;
+
+void saveGlobals(void *globals)
+{
+    NodeGlobals *g = (NodeGlobals *)globals;
+#define SIM_SAVE_GLOBAL(type, name) g->name = name;
+    SIM_NODE_GLOBALS(SIM_SAVE_GLOBAL)
+#undef SIM_SAVE_GLOBAL
+}
+
+void restoreGlobals(const void *globals)
+{
+    const NodeGlobals *g = (const NodeGlobals *)globals;
+#define SIM_RESTORE_GLOBAL(type, name) name = g->name;
+    SIM_NODE_GLOBALS(SIM_RESTORE_GLOBAL)
+#undef SIM_RESTORE_GLOBAL
+}
+
+void *createGlobals()
+{
+    if (pristine == nullptr)
+    {
+        // The first call happens before any node has run, so this captures the initial values
+        pristine = new NodeGlobals();
+        saveGlobals(pristine);
+    }
+
+    NodeGlobals *g = new NodeGlobals(*pristine);
+    return g;
+}
+
+void destroyGlobals(void *globals)
+{
+    delete (NodeGlobals *)globals;
+}
+
+uint8_t engineState()
+{
+    return state;
+}
+
+} // namespace sim
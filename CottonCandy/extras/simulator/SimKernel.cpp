@@ -0,0 +1,545 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "SimKernel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+
+namespace sim
+{
+
+static Kernel *g_kernel = nullptr;
+
+/*------------------------ Node ------------------------*/
+Node::Node(uint16_t id)
+{
+    this->id = id;
+    rngState = 0x9E3779B9u ^ ((uint32_t)id * 2654435761u);
+    if (rngState == 0)
+    {
+        rngState = 1;
+    }
+}
+
+Node::~Node()
+{
+    if (m_stack != nullptr)
+    {
+        free(m_stack);
+    }
+    if (globals != nullptr)
+    {
+        destroyGlobals(globals);
+    }
+}
+
+/*------------------------ Kernel ------------------------*/
+Kernel::Kernel()
+{
+    g_kernel = this;
+}
+
+Kernel &Kernel::instance()
+{
+    static Kernel kernel;
+    return kernel;
+}
+
+SimTime Kernel::time() const
+{
+    if (m_current != nullptr && !m_inIsr)
+    {
+        return m_current->localTime;
+    }
+    return m_now;
+}
+
+SimTime Kernel::awakeTime() const
+{
+    if (m_current == nullptr)
+    {
+        return m_now;
+    }
+
+    SimTime asleep = m_current->mcuSleepTime;
+    if (m_current->m_wait == Node::SLEEP_CPU)
+    {
+        asleep += m_now - m_current->m_sleepStart;
+    }
+    return time() - asleep;
+}
+
+void Kernel::addNode(Node *node, SimTime bootTime)
+{
+    KernelSection section;
+
+    if (node->id != m_nodes.size())
+    {
+        fprintf(stderr, "Node ids must be assigned in order\n");
+        abort();
+    }
+
+    node->globals = createGlobals();
+    node->m_stack = malloc(SIM_NODE_STACK_SIZE);
+
+    getcontext(&node->m_ctx);
+    node->m_ctx.uc_stack.ss_sp = node->m_stack;
+    node->m_ctx.uc_stack.ss_size = SIM_NODE_STACK_SIZE;
+    node->m_ctx.uc_link = nullptr;
+    makecontext(&node->m_ctx, (void (*)())trampoline, 1, (int)node->id);
+
+    node->lastStateChange = bootTime;
+    m_nodes.push_back(node);
+
+    schedule(bootTime, [this, node]() { resume(node, 0); });
+}
+
+void Kernel::schedule(SimTime t, std::function<void()> fn)
+{
+    KernelSection section;
+    m_events.push(Event{t, m_seq++, std::move(fn)});
+}
+
+void Kernel::run(SimTime until)
+{
+    while (!m_events.empty() && m_events.top().t <= until)
+    {
+        Event e = std::move(const_cast<Event &>(m_events.top()));
+        m_events.pop();
+
+        m_now = e.t;
+        e.fn();
+    }
+
+    m_now = until;
+    for (Node *node : m_nodes)
+    {
+        load(node);
+        settle(node, until);
+        if (node->m_wait == Node::SLEEP_CPU)
+        {
+            node->mcuSleepTime += until - node->m_sleepStart;
+            node->m_sleepStart = until;
+        }
+    }
+}
+
+void Kernel::trampoline(int nodeIndex)
+{
+    Node *node = g_kernel->m_nodes[nodeIndex];
+
+    node->setup();
+    while (true)
+    {
+        node->loop();
+    }
+}
+
+void Kernel::resume(Node *node, uint32_t generation)
+{
+    if (node->m_waitGeneration != generation)
+    {
+        // A stale wake-up, the node has been woken up by something else already
+        return;
+    }
+
+    if (node->m_wait == Node::SLEEP_CPU)
+    {
+        node->mcuSleepTime += m_now - node->m_sleepStart;
+    }
+
+    node->m_wait = Node::RUNNING;
+    node->localTime = m_now;
+
+    load(node);
+    settle(node, m_now);
+
+    m_current = node;
+    m_heapCharging = true;
+    swapcontext(&m_mainCtx, &node->m_ctx);
+    m_heapCharging = false;
+    m_current = nullptr;
+
+    settle(node, node->localTime);
+}
+
+void Kernel::yield()
+{
+    Node *node = m_current;
+    swapcontext(&node->m_ctx, &m_mainCtx);
+}
+
+void Kernel::chargeCpu(SimTime us)
+{
+    if (m_current != nullptr && !m_inIsr)
+    {
+        m_current->localTime += us;
+    }
+}
+
+void Kernel::sleepFor(SimTime us)
+{
+    Node *node = m_current;
+    if (node == nullptr || m_inIsr)
+    {
+        // Delays inside interrupt handlers do not advance the world
+        return;
+    }
+
+    checkMasked();
+    node->m_wakePending = false;
+
+    KernelSection section;
+
+    uint32_t generation = ++node->m_waitGeneration;
+    node->m_wait = Node::DELAY;
+    schedule(node->localTime + us, [this, node, generation]() { resume(node, generation); });
+
+    yield();
+}
+
+void Kernel::sync()
+{
+    if (m_current != nullptr && !m_inIsr && m_current->localTime > m_now)
+    {
+        sleepFor(0);
+    }
+}
+
+void Kernel::sleepCpu()
+{
+    Node *node = m_current;
+    if (node == nullptr || m_inIsr || sleepInterrupted(node))
+    {
+        return;
+    }
+
+    sync();
+
+    KernelSection section;
+
+    ++node->m_waitGeneration;
+    node->m_wait = Node::SLEEP_CPU;
+    node->m_sleepStart = m_now;
+
+    yield();
+}
+
+bool Kernel::sleepCpuFor(SimTime us)
+{
+    Node *node = m_current;
+    if (node == nullptr || m_inIsr || sleepInterrupted(node))
+    {
+        return false;
+    }
+
+    sync();
+
+    KernelSection section;
+
+    uint32_t generation = ++node->m_waitGeneration;
+    node->m_wait = Node::SLEEP_CPU;
+    node->m_sleepStart = m_now;
+
+    // An interrupt starts a new wait generation, the timer is then stale
+    bool timerFired = false;
+    schedule(m_now + us, [this, node, generation, &timerFired]() {
+        if (node->m_waitGeneration == generation)
+        {
+            timerFired = true;
+            resume(node, generation);
+        }
+    });
+
+    yield();
+    return timerFired;
+}
+
+bool Kernel::sleepInterrupted(Node *node)
+{
+    if (node->interruptsMasked)
+    {
+        fprintf(stderr, "Node %u deadlocked: the MCU went to sleep with the interrupts masked\n", node->id);
+        exit(EXIT_FAILURE);
+    }
+
+    // An interrupt held back until right before sleep_cpu() wakes the MCU up at once
+    if (node->m_wakePending)
+    {
+        node->m_wakePending = false;
+        return true;
+    }
+    return false;
+}
+
+void Kernel::maskInterrupts()
+{
+    Node *node = m_current;
+    if (node == nullptr || m_inIsr || node->interruptsMasked)
+    {
+        return;
+    }
+
+    node->interruptsMasked = true;
+    node->maskedSince = time();
+    node->maskedMillis = (unsigned long)(awakeTime() / SIM_MILLISECOND);
+}
+
+void Kernel::unmaskInterrupts()
+{
+    Node *node = m_current;
+    if (node == nullptr || m_inIsr || !node->interruptsMasked)
+    {
+        return;
+    }
+
+    if (node->m_heldInterrupts.empty())
+    {
+        node->interruptsMasked = false;
+        return;
+    }
+
+    // The held interrupts run at the time the node has reached
+    sync();
+    node->interruptsMasked = false;
+
+    std::vector<std::function<void()>> held;
+    held.swap(node->m_heldInterrupts);
+    for (const std::function<void()> &fn : held)
+    {
+        fn();
+    }
+    node->m_wakePending = true;
+}
+
+void Kernel::checkMasked()
+{
+    Node *node = m_current;
+    if (node == nullptr || m_inIsr || !node->interruptsMasked)
+    {
+        return;
+    }
+
+    if (time() - node->maskedSince > SIM_MAX_MASKED_TIME)
+    {
+        fprintf(stderr, "Node %u deadlocked: the interrupts have been masked for %.1fms\n", node->id,
+                (time() - node->maskedSince) / 1E3);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void Kernel::interrupt(Node *node, const std::function<void()> &fn)
+{
+    if (node->interruptsMasked)
+    {
+        node->m_heldInterrupts.push_back(fn);
+        return;
+    }
+    runInNode(node, fn);
+}
+
+void Kernel::raiseInterrupt(Node *node, uint8_t interruptNum, uint8_t edge)
+{
+    if (interruptNum >= SIM_NUM_INTERRUPTS || node->isr[interruptNum] == nullptr)
+    {
+        // Without an attached handler the interrupt is masked and cannot wake the MCU
+        return;
+    }
+
+    uint8_t mode = node->isrMode[interruptNum];
+    // CHANGE (1) reacts to both edges
+    if (mode != 1 && mode != edge)
+    {
+        return;
+    }
+
+    if (node->interruptsMasked)
+    {
+        node->m_heldInterrupts.push_back([this, node, interruptNum, edge]() { raiseInterrupt(node, interruptNum, edge); });
+        return;
+    }
+
+    void (*isr)() = node->isr[interruptNum];
+    runInNode(node, [isr]() { isr(); });
+
+    if (node->m_wait == Node::SLEEP_CPU)
+    {
+        uint32_t generation = ++node->m_waitGeneration;
+        schedule(m_now, [this, node, generation]() { resume(node, generation); });
+    }
+}
+
+void Kernel::runInNode(Node *node, const std::function<void()> &fn)
+{
+    Node *prevCurrent = m_current;
+    bool prevInIsr = m_inIsr;
+    bool prevCharging = m_heapCharging;
+
+    load(node);
+    settle(node, m_now);
+
+    m_current = node;
+    m_inIsr = true;
+    m_heapCharging = true;
+
+    fn();
+
+    settle(node, m_now);
+
+    m_current = prevCurrent;
+    m_inIsr = prevInIsr;
+    m_heapCharging = prevCharging;
+
+    if (prevCurrent != nullptr)
+    {
+        load(prevCurrent);
+    }
+}
+
+void Kernel::load(Node *node)
+{
+    if (m_loaded == node)
+    {
+        return;
+    }
+
+    if (m_loaded != nullptr)
+    {
+        saveGlobals(m_loaded->globals);
+    }
+    restoreGlobals(node->globals);
+    m_loaded = node;
+}
+
+void Kernel::settle(Node *node, SimTime t)
+{
+    if (t > node->lastStateChange)
+    {
+        node->stateTime[node->lastState] += t - node->lastStateChange;
+        node->lastStateChange = t;
+    }
+
+    uint8_t state = engineState();
+    if (state >= SIM_NUM_STATES)
+    {
+        state = SIM_NUM_STATES - 1;
+    }
+
+    if (state != node->lastState)
+    {
+        uint8_t oldState = node->lastState;
+        node->lastState = state;
+
+        KernelSection section;
+        node->onStateChange(oldState, state, node->lastStateChange);
+    }
+}
+
+/*------------------------ KernelSection ------------------------*/
+KernelSection::KernelSection()
+{
+    m_saved = g_kernel->m_heapCharging;
+    g_kernel->m_heapCharging = false;
+}
+
+KernelSection::~KernelSection()
+{
+    g_kernel->m_heapCharging = m_saved;
+}
+
+} // namespace sim
+
+/*------------------------ Heap accounting ------------------------*/
+
+/**
+ * Every allocation made by a node's code is charged to that node, so the
+ * simulator can report freeMemory() and count heap operations per node.
+ */
+struct SimAllocHeader
+{
+    uint64_t size;
+    uint32_t owner;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SimAllocHeader) == 16, "Allocation header must keep 16-byte alignment");
+
+static void *simAlloc(size_t size)
+{
+    SimAllocHeader *header = (SimAllocHeader *)malloc(size + sizeof(SimAllocHeader));
+    if (header == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    header->size = size;
+    header->owner = 0;
+
+    sim::Kernel *kernel = sim::g_kernel;
+    if (kernel != nullptr && kernel->chargingHeap())
+    {
+        sim::Node *node = kernel->current();
+        header->owner = node->id + 1;
+        node->heapLive += size;
+        node->heapAllocs++;
+        if (node->heapLive > node->heapPeak)
+        {
+            node->heapPeak = node->heapLive;
+        }
+    }
+
+    return header + 1;
+}
+
+static void simFree(void *ptr)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+
+    SimAllocHeader *header = ((SimAllocHeader *)ptr) - 1;
+    // The kernel can be gone already when static objects are destroyed at exit
+    if (header->owner != 0 && sim::g_kernel != nullptr && header->owner <= sim::g_kernel->nodes().size())
+    {
+        sim::Node *node = sim::g_kernel->nodes()[header->owner - 1];
+        node->heapLive -= header->size;
+    }
+    free(header);
+}
+
+void *operator new(size_t size) { return simAlloc(size); }
+void *operator new[](size_t size) { return simAlloc(size); }
+void operator delete(void *ptr) noexcept { simFree(ptr); }
+void operator delete[](void *ptr) noexcept { simFree(ptr); }
+void operator delete(void *ptr, size_t) noexcept { simFree(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { simFree(ptr); }
+
+/* Replaces MemoryFree.cpp, which depends on the avr-libc heap layout */
+extern "C" int freeMemory()
+{
+    sim::Node *node = sim::g_kernel != nullptr ? sim::g_kernel->current() : nullptr;
+    if (node == nullptr)
+    {
+        return SIM_MCU_RAM_SIZE;
+    }
+    return SIM_MCU_RAM_SIZE - (int)node->heapLive;
+}
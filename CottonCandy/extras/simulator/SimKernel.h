@@ -0,0 +1,319 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEADER_SIM_KERNEL
+#define HEADER_SIM_KERNEL
+
+#include <stdint.h>
+#include <time.h>
+#include <ucontext.h>
+#include <functional>
+#include <queue>
+#include <vector>
+
+namespace sim
+{
+
+/* Simulation time is kept in microseconds */
+typedef uint64_t SimTime;
+
+#define SIM_SECOND (sim::SimTime)1000000
+#define SIM_MILLISECOND (sim::SimTime)1000
+
+/* Number of State values tracked per node (see enum State in ForwardEngine.h) */
+#define SIM_NUM_STATES 11
+
+/* Number of external interrupt lines on an ATmega328P */
+#define SIM_NUM_INTERRUPTS 2
+
+/* Stack reserved for every virtual node */
+#define SIM_NODE_STACK_SIZE (64 * 1024)
+
+/**
+ * Every call to millis() costs the node a bit of CPU time. Without it, a node
+ * spinning on millis() (e.g. readMsgFromBuff waiting for bytes) would never
+ * reach its timeout since the virtual clock only moves when someone blocks.
+ */
+#define SIM_MILLIS_CALL_COST_US 10
+
+/* RAM of the modelled MCU, used to report freeMemory() */
+#define SIM_MCU_RAM_SIZE 2048
+
+/**
+ * A node that keeps the interrupts masked (noInterrupts()) for longer than this is deadlocked:
+ * millis() is frozen without the timer0 interrupt, and the interrupts it may be waiting for are
+ * held back. The simulation stops with an error then
+ */
+#define SIM_MAX_MASKED_TIME (100 * SIM_MILLISECOND)
+
+/**
+ * A DS3231 attached to a node. The RTC keeps its own (drifting) time and
+ * raises a falling edge on SQW when Alarm 1 matches.
+ */
+struct SimRtc
+{
+    /**
+     * A DS3231 that has never been set counts from 2000-01-01. The library takes a time of 0
+     * for an RTC that does not answer, so the clock must not start there
+     */
+    int64_t base = 946684800;
+    SimTime setAt = 0;
+    double driftPpm = 0;
+
+    /* Absolute time programmed into Alarm 1, or -1 if it cannot match */
+    int64_t alarmTarget = -1;
+    bool alarmFlag = false;
+    bool alarmInterruptEnabled = false;
+    uint32_t alarmGeneration = 0;
+
+    /* Pins on the MCU that the RTC is wired to */
+    uint8_t intPin = 2;
+    uint8_t vccPin = 4;
+
+    /* Statistics */
+    uint32_t reads = 0;
+    uint32_t powerCycles = 0;
+    SimTime poweredSince = 0;
+    SimTime poweredTime = 0;
+};
+
+class Node
+{
+public:
+    Node(uint16_t id);
+    virtual ~Node();
+
+    /* The "sketch" of the node */
+    virtual void setup() = 0;
+    virtual void loop() = 0;
+
+    /**
+     * Called (from the kernel, with this node's globals loaded) every time the
+     * observed ForwardEngine state of this node changes
+     */
+    virtual void onStateChange(uint8_t oldState, uint8_t newState, SimTime t) {}
+
+    uint16_t id;
+
+    /* Time of this node. Can run slightly ahead of the global time while the node is running */
+    SimTime localTime = 0;
+
+    /* Board */
+    uint8_t pinLevel[32] = {0};
+    void (*isr[SIM_NUM_INTERRUPTS])() = {nullptr, nullptr};
+    uint8_t isrMode[SIM_NUM_INTERRUPTS] = {0};
+    uint32_t rngState = 1;
+    uint16_t analogNoise = 0;
+    SimRtc rtc;
+
+    /* Per-node copy of the library's global variables */
+    void *globals = nullptr;
+
+    /* Heap accounting (see the operator new override in SimKernel.cpp) */
+    long heapLive = 0;
+    long heapPeak = 0;
+    uint32_t heapAllocs = 0;
+
+    /* Time spent in each ForwardEngine state */
+    SimTime stateTime[SIM_NUM_STATES] = {0};
+    uint8_t lastState = 0;
+    SimTime lastStateChange = 0;
+
+    /* Time the MCU spent in power-down */
+    SimTime mcuSleepTime = 0;
+
+    /* Between noInterrupts() and interrupts(), and millis() when the interrupts were masked */
+    bool interruptsMasked = false;
+    SimTime maskedSince = 0;
+    unsigned long maskedMillis = 0;
+
+    /* Output line buffer for Serial */
+    char lineBuff[256];
+    uint16_t lineLen = 0;
+
+private:
+    friend class Kernel;
+
+    enum Wait
+    {
+        NOT_STARTED,
+        RUNNING,
+        DELAY,
+        SLEEP_CPU
+    };
+
+    Wait m_wait = NOT_STARTED;
+    uint32_t m_waitGeneration = 0;
+    SimTime m_sleepStart = 0;
+
+    /* Interrupts raised while they were masked, and whether one ran right before sleep_cpu() */
+    std::vector<std::function<void()>> m_heldInterrupts;
+    bool m_wakePending = false;
+
+    ucontext_t m_ctx;
+    void *m_stack = nullptr;
+};
+
+class Kernel
+{
+public:
+    static Kernel &instance();
+
+    /* Global time (time of the event being processed) */
+    SimTime now() const { return m_now; }
+
+    /* Time as seen by the code that is currently executing */
+    SimTime time() const;
+
+    /**
+     * Time during which the MCU of the executing node has been awake. Timer0
+     * stops in power-down mode, so this is what millis() counts
+     */
+    SimTime awakeTime() const;
+
+    /* Node whose code is executing (nullptr if the kernel itself is running) */
+    Node *current() const { return m_current; }
+
+    const std::vector<Node *> &nodes() const { return m_nodes; }
+
+    void addNode(Node *node, SimTime bootTime);
+
+    void schedule(SimTime t, std::function<void()> fn);
+
+    /* Processes events until the given time */
+    void run(SimTime until);
+
+    /* --------- Called from within a node --------- */
+
+    /* Advance the local time of the running node without yielding */
+    void chargeCpu(SimTime us);
+
+    /* Block the running node for a while. Interrupts are still serviced */
+    void sleepFor(SimTime us);
+
+    /* Make sure the world has caught up with the running node before it touches shared state */
+    void sync();
+
+    /* Block the running node until an interrupt wakes it up (sleep_cpu) */
+    void sleepCpu();
+
+    /**
+     * sleepCpu() with a timer that wakes the node up after us (the watchdog of the AVR). Returns
+     * true if the timer woke it up, false if an interrupt did
+     */
+    bool sleepCpuFor(SimTime us);
+
+    /**
+     * noInterrupts() and interrupts() of the running node. The interrupts held back meanwhile run
+     * when they are enabled again, and the next sleep_cpu() returns right away like on the AVR
+     */
+    void maskInterrupts();
+    void unmaskInterrupts();
+
+    /* Stops the simulation if the running node has kept the interrupts masked for too long */
+    void checkMasked();
+
+    /* --------- Called from the kernel side --------- */
+
+    /**
+     * Deliver an edge on an external interrupt line of a node. The attached ISR
+     * runs in the context of that node and the node leaves sleep_cpu if it was sleeping.
+     */
+    void raiseInterrupt(Node *node, uint8_t interruptNum, uint8_t edge);
+
+    /* Runs fn as an interrupt handler of the node, once the node has the interrupts enabled */
+    void interrupt(Node *node, const std::function<void()> &fn);
+
+    /* Run a function with the globals of a node loaded and the node marked as current */
+    void runInNode(Node *node, const std::function<void()> &fn);
+
+    /* Makes the globals of the node visible to the library code */
+    void load(Node *node);
+
+    /* Update the state accounting of a node up to time t */
+    void settle(Node *node, SimTime t);
+
+    /* Bytes of heap are only charged to a node while its sketch is running */
+    bool chargingHeap() const { return m_current != nullptr && m_heapCharging; }
+
+private:
+    friend class KernelSection;
+
+    Kernel();
+
+    struct Event
+    {
+        SimTime t;
+        uint64_t seq;
+        std::function<void()> fn;
+
+        bool operator>(const Event &e) const
+        {
+            return t > e.t || (t == e.t && seq > e.seq);
+        }
+    };
+
+    static void trampoline(int nodeIndex);
+
+    void resume(Node *node, uint32_t generation);
+
+    /* Whether sleep_cpu() returns at once because of a held interrupt. Fails if it never would */
+    bool sleepInterrupted(Node *node);
+    void yield();
+
+    SimTime m_now = 0;
+    uint64_t m_seq = 0;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> m_events;
+
+    std::vector<Node *> m_nodes;
+    Node *m_current = nullptr;
+    Node *m_loaded = nullptr;
+    bool m_inIsr = false;
+    bool m_heapCharging = false;
+
+    ucontext_t m_mainCtx;
+};
+
+/**
+ * Disables heap accounting while the kernel does its own bookkeeping on
+ * behalf of a node
+ */
+class KernelSection
+{
+public:
+    KernelSection();
+    ~KernelSection();
+
+private:
+    bool m_saved;
+};
+
+/* Implemented in SimGlobals.cpp */
+void *createGlobals();
+void destroyGlobals(void *globals);
+void saveGlobals(void *globals);
+void restoreGlobals(const void *globals);
+uint8_t engineState();
+
+} // namespace sim
+
+/* Called on every digitalWrite, defined in shim/Arduino.cpp */
+extern void (*simPinWriteHook)(sim::Node *node, uint8_t pin, uint8_t val);
+
+#endif
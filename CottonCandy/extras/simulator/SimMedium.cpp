@@ -0,0 +1,395 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+#include <random>
+
+#include "SimMedium.h"
+#include "SimDeviceDriver.h"
+#include "MessageProcessor.h"
+
+
+namespace sim
+{
+
+/* Links with a path loss above this can neither deliver nor interfere */
+#define SIM_MAX_PATH_LOSS 165.0
+
+/* Transmissions are kept around for a while to evaluate overlaps */
+#define SIM_AIR_HISTORY (10 * SIM_SECOND)
+
+/* Power an interferer using a different spreading factor needs over the frame to destroy it (dB) */
+#define SIM_INTER_SF_REJECTION 16.0
+
+/* Preamble symbols a receiver that enters RX in the middle of a frame needs to lock onto it */
+#define SIM_SYNC_SYMBOLS 5
+
+/* Demodulation SNR limits from the SX1276 datasheet, SF7 to SF12 */
+static const double snrLimit[6] = {-7.5, -10.0, -12.5, -15.0, -17.5, -20.0};
+
+SimMedium::SimMedium(const MediumConfig &config, const std::vector<Position> &positions)
+    : m_config(config), m_positions(positions)
+{
+    size_t n = positions.size();
+    m_pathLoss.resize(n * n);
+    m_neighbours.resize(n);
+    m_drivers.resize(n, nullptr);
+    m_epoch.resize(n, 0);
+    m_lockedUntil.resize(n, 0);
+
+    std::mt19937 rng(config.seed);
+    std::normal_distribution<double> shadowing(0.0, config.shadowingSigma);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        m_pathLoss[i * n + i] = 0;
+        for (size_t j = i + 1; j < n; j++)
+        {
+            double dx = positions[i].x - positions[j].x;
+            double dy = positions[i].y - positions[j].y;
+            double d = sqrt(dx * dx + dy * dy);
+            if (d < 1.0)
+            {
+                d = 1.0;
+            }
+
+            // Shadowing is static and symmetric for a link
+            double pl = config.pl0 + 10.0 * config.exponent * log10(d);
+            if (config.shadowingSigma > 0)
+            {
+                pl += shadowing(rng);
+            }
+
+            m_pathLoss[i * n + j] = (float)pl;
+            m_pathLoss[j * n + i] = (float)pl;
+
+            if (pl <= SIM_MAX_PATH_LOSS)
+            {
+                m_neighbours[i].push_back((uint16_t)j);
+                m_neighbours[j].push_back((uint16_t)i);
+            }
+        }
+    }
+}
+
+void SimMedium::attach(uint16_t node, SimDeviceDriver *driver)
+{
+    m_drivers[node] = driver;
+}
+
+double SimMedium::rssi(uint16_t from, uint16_t to, int8_t txPwr) const
+{
+    return (double)txPwr - m_pathLoss[(size_t)from * m_positions.size() + to];
+}
+
+double SimMedium::rssi(const Transmission &tx, uint16_t to) const
+{
+    double loss = (tx.len > 2 && tx.frame[2] == MESSAGE_NODE_REPLY) ? m_config.replyLoss : 0.0;
+    return rssi(tx.src, to, tx.txPwr) - loss;
+}
+
+double SimMedium::noiseFloor(long bw) const
+{
+    return -174.0 + 10.0 * log10((double)bw) + m_config.noiseFigure;
+}
+
+double SimMedium::sensitivity(const LoRaParams &params) const
+{
+    uint8_t sf = params.sf < 7 ? 7 : (params.sf > 12 ? 12 : params.sf);
+    return noiseFloor(params.bw) + snrLimit[sf - 7];
+}
+
+SimTime SimMedium::timeOnAir(uint8_t len, const LoRaParams &params)
+{
+    // Semtech AN1200.13, explicit header with CRC enabled
+    double tsym = (double)(1UL << params.sf) / (double)params.bw;
+    int lowDataRateOptimize = (tsym > 0.016) ? 1 : 0;
+
+    double preamble = (params.preambleLen + 4.25) * tsym;
+
+    double num = 8.0 * len - 4.0 * params.sf + 28 + 16;
+    double den = 4.0 * (params.sf - 2 * lowDataRateOptimize);
+    double payloadSymbols = 8 + fmax(ceil(num / den) * params.cr, 0);
+
+    return (SimTime)((preamble + payloadSymbols * tsym) * 1E6);
+}
+
+SimTime SimMedium::cadTime(const LoRaParams &params)
+{
+    // About two symbols: one to listen and one to process
+    return (SimTime)(2E6 * (double)(1UL << params.sf) / (double)params.bw);
+}
+
+bool SimMedium::channelActivity(uint16_t node, uint64_t freq, const LoRaParams &params, SimTime start,
+                                SimTime end) const
+{
+    double threshold = sensitivity(params);
+
+    for (const Transmission &tx : m_air)
+    {
+        if (tx.src == node || tx.freq != freq || tx.params.sf != params.sf || tx.params.bw != params.bw)
+        {
+            continue;
+        }
+        if (tx.end <= start || tx.start >= end)
+        {
+            continue;
+        }
+        if (rssi(tx, node) >= threshold)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SimMedium::addressedTo(const Transmission &tx, uint16_t node) const
+{
+    if (tx.frame[0] == 0xFF && tx.frame[1] == 0xFF)
+    {
+        return true;
+    }
+    const uint8_t *addr = m_drivers[node]->address();
+    return tx.frame[0] == addr[0] && tx.frame[1] == addr[1];
+}
+
+SimTime SimMedium::transmit(uint16_t src, const uint8_t *frame, uint8_t len, uint64_t freq, int8_t txPwr,
+                            const LoRaParams &params)
+{
+    Kernel &kernel = Kernel::instance();
+    SimTime now = kernel.now();
+
+    // The bookkeeping below is not part of the node's memory
+    KernelSection section;
+
+    while (!m_air.empty() && m_air.front().end + SIM_AIR_HISTORY < now)
+    {
+        m_air.pop_front();
+    }
+
+    m_air.emplace_back();
+    Transmission &tx = m_air.back();
+    tx.id = m_nextTxId++;
+    tx.src = src;
+    tx.freq = freq;
+    tx.txPwr = txPwr;
+    tx.params = params;
+    tx.start = now;
+    tx.end = now + timeOnAir(len, params);
+    tx.len = len;
+    memcpy(tx.frame, frame, len);
+
+    stats.framesSent++;
+    stats.airtime += tx.end - tx.start;
+    stats.txEnergy += pow(10.0, txPwr / 10.0) * 1E-3 * (tx.end - tx.start) / 1E6;
+    if (len > 2 && frame[2] == MESSAGE_NODE_REPLY)
+    {
+        stats.repliesSent++;
+        stats.replyAirtime += tx.end - tx.start;
+    }
+
+    double threshold = sensitivity(params);
+
+    for (uint16_t r : m_neighbours[src])
+    {
+        SimDeviceDriver *receiver = m_drivers[r];
+        if (receiver == nullptr)
+        {
+            continue;
+        }
+
+        double rs = rssi(tx, r);
+        if (rs < threshold)
+        {
+            continue;
+        }
+
+        if (!receiver->isListening(freq, params))
+        {
+            // Broadcasts reach many sleeping nodes by design, only unicast misses are interesting
+            if (!(frame[0] == 0xFF && frame[1] == 0xFF) && addressedTo(tx, r))
+            {
+                stats.notListening++;
+            }
+            continue;
+        }
+
+        if (m_lockedUntil[r] > now)
+        {
+            // The receiver has locked onto another preamble
+            if (addressedTo(tx, r))
+            {
+                stats.receiverBusy++;
+            }
+            continue;
+        }
+
+        m_lockedUntil[r] = tx.end;
+        m_receptions.push_back(Reception{tx.id, r, m_epoch[r], rs});
+    }
+
+    uint32_t id = tx.id;
+    kernel.schedule(tx.end, [this, id]() { finish(id); });
+
+    return tx.end - tx.start;
+}
+
+void SimMedium::interruptReception(uint16_t node)
+{
+    m_epoch[node]++;
+    m_lockedUntil[node] = 0;
+}
+
+void SimMedium::startListening(uint16_t node, uint64_t freq, const LoRaParams &params)
+{
+    SimTime now = Kernel::instance().now();
+    if (m_lockedUntil[node] > now)
+    {
+        return;
+    }
+
+    KernelSection section;
+
+    double threshold = sensitivity(params);
+    double tsym = (double)(1UL << params.sf) / (double)params.bw;
+
+    for (const Transmission &tx : m_air)
+    {
+        if (tx.src == node || tx.freq != freq || tx.params.sf != params.sf || tx.params.bw != params.bw)
+        {
+            continue;
+        }
+
+        // The receiver needs a few preamble symbols to synchronise
+        SimTime syncEnd = tx.start + (SimTime)((tx.params.preambleLen + 4.25 - SIM_SYNC_SYMBOLS) * tsym * 1E6);
+        if (now < tx.start || now > syncEnd)
+        {
+            continue;
+        }
+
+        double rs = rssi(tx, node);
+        if (rs < threshold)
+        {
+            continue;
+        }
+
+        m_lockedUntil[node] = tx.end;
+        m_receptions.push_back(Reception{tx.id, node, m_epoch[node], rs});
+        return;
+    }
+}
+
+bool SimMedium::receiving(uint16_t node) const
+{
+    return m_lockedUntil[node] > Kernel::instance().now();
+}
+
+const SimMedium::Transmission *SimMedium::find(uint32_t txId) const
+{
+    for (const Transmission &tx : m_air)
+    {
+        if (tx.id == txId)
+        {
+            return &tx;
+        }
+    }
+    return nullptr;
+}
+
+void SimMedium::finish(uint32_t txId)
+{
+    const Transmission *tx = find(txId);
+    if (tx == nullptr)
+    {
+        return;
+    }
+
+    // Collect the receptions of this frame first, delivering can start new transmissions
+    std::vector<Reception> done;
+    for (size_t i = 0; i < m_receptions.size();)
+    {
+        if (m_receptions[i].txId == txId)
+        {
+            done.push_back(m_receptions[i]);
+            m_receptions[i] = m_receptions.back();
+            m_receptions.pop_back();
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    double floor = noiseFloor(tx->params.bw);
+
+    for (const Reception &rec : done)
+    {
+        uint16_t r = rec.node;
+        bool addressed = addressedTo(*tx, r);
+
+        if (m_epoch[r] != rec.epoch)
+        {
+            if (addressed)
+            {
+                stats.interrupted++;
+            }
+            continue;
+        }
+
+        bool collided = false;
+        for (const Transmission &other : m_air)
+        {
+            if (other.id == tx->id || other.freq != tx->freq || other.src == r)
+            {
+                continue;
+            }
+            if (other.end <= tx->start || other.start >= tx->end)
+            {
+                continue;
+            }
+
+            double interference = rssi(other, r);
+            double margin = (other.params.sf == tx->params.sf) ? m_config.captureThreshold : -SIM_INTER_SF_REJECTION;
+            if (rec.rssi - interference < margin)
+            {
+                collided = true;
+                break;
+            }
+        }
+
+        if (collided)
+        {
+            if (addressed)
+            {
+                stats.collisions++;
+            }
+            continue;
+        }
+
+        if (addressed)
+        {
+            stats.delivered++;
+        }
+
+        m_drivers[r]->onFrame(tx->frame, tx->len, (int)lround(rec.rssi), rec.rssi - floor);
+    }
+}
+
+} // namespace sim
@@ -0,0 +1,193 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEADER_SIM_MEDIUM
+#define HEADER_SIM_MEDIUM
+
+#include "SimKernel.h"
+
+#include <deque>
+#include <vector>
+
+namespace sim
+{
+
+class SimDeviceDriver;
+
+/* LoRa modulation parameters of a frame */
+struct LoRaParams
+{
+    uint8_t sf = 7;
+    long bw = 125000;
+    uint8_t cr = 5; // Denominator of the coding rate (4/5 .. 4/8)
+    uint16_t preambleLen = 8;
+};
+
+struct MediumConfig
+{
+    /* Log-distance path loss: PL(d) = pl0 + 10 * exponent * log10(d / 1m) + shadowing */
+    double pl0 = 40.0;
+    double exponent = 2.9;
+
+    /* Standard deviation of the (static, symmetric) log-normal shadowing per link */
+    double shadowingSigma = 4.0;
+
+    /* Receiver noise figure (dB) */
+    double noiseFigure = 6.0;
+
+    /* A frame survives an overlapping one if it is this much stronger (dB) */
+    double captureThreshold = 6.0;
+
+    /* Extra path loss (dB) of the NodeReplies only: a lossy uplink under a clean downlink */
+    double replyLoss = 0.0;
+
+    uint32_t seed = 1;
+};
+
+struct Position
+{
+    double x;
+    double y;
+};
+
+struct MediumStats
+{
+    uint32_t framesSent = 0;
+    SimTime airtime = 0;
+
+    /* Energy radiated by all the transmitters (J) */
+    double txEnergy = 0;
+
+    /* NodeReplies, told apart by the message type after the destination address */
+    uint32_t repliesSent = 0;
+    SimTime replyAirtime = 0;
+
+    /* Counted for every node that a frame is addressed to (each neighbour for broadcasts) */
+    uint32_t delivered = 0;
+    uint32_t collisions = 0;
+    uint32_t notListening = 0;
+    uint32_t interrupted = 0;
+    uint32_t receiverBusy = 0;
+};
+
+class SimMedium
+{
+public:
+    SimMedium(const MediumConfig &config, const std::vector<Position> &positions);
+
+    /* Drivers register themselves with the index of their node */
+    void attach(uint16_t node, SimDeviceDriver *driver);
+
+    /**
+     * Put a frame on the air. Returns the time on air. The first two bytes of the
+     * frame are the destination address (as in AdafruitDeviceDriver).
+     */
+    SimTime transmit(uint16_t src, const uint8_t *frame, uint8_t len, uint64_t freq, int8_t txPwr,
+                     const LoRaParams &params);
+
+    /**
+     * A receiver changed its mode, frequency or modulation. Any frame it was in the
+     * middle of receiving is lost
+     */
+    void interruptReception(uint16_t node);
+
+    /**
+     * A receiver entered RX in the middle of a frame. It locks onto the frame if enough of
+     * the preamble is left (the long wake-up preambles of preamble sampling)
+     */
+    void startListening(uint16_t node, uint64_t freq, const LoRaParams &params);
+
+    /* The node is locked onto a frame (the SX127x reports it in RegModemStat) */
+    bool receiving(uint16_t node) const;
+
+    /* Received power at node "to" for a frame sent by "from" at txPwr */
+    double rssi(uint16_t from, uint16_t to, int8_t txPwr) const;
+
+    /* Thermal noise floor for the bandwidth, including the noise figure */
+    double noiseFloor(long bw) const;
+
+    /* Minimum power a frame needs to be demodulated */
+    double sensitivity(const LoRaParams &params) const;
+
+    static SimTime timeOnAir(uint8_t len, const LoRaParams &params);
+
+    /* Duration of a channel activity detection */
+    static SimTime cadTime(const LoRaParams &params);
+
+    /**
+     * Channel activity detection at a node over [start, end]: true if a frame with the same
+     * spreading factor and bandwidth was on air on the frequency, above the sensitivity. The
+     * payload symbols are detected like the preamble
+     */
+    bool channelActivity(uint16_t node, uint64_t freq, const LoRaParams &params, SimTime start, SimTime end) const;
+
+    /* Node indices that can possibly hear a given node */
+    const std::vector<uint16_t> &neighbours(uint16_t node) const { return m_neighbours[node]; }
+
+    const Position &position(uint16_t node) const { return m_positions[node]; }
+
+    MediumStats stats;
+
+private:
+    struct Transmission
+    {
+        uint32_t id;
+        uint16_t src;
+        uint64_t freq;
+        int8_t txPwr;
+        LoRaParams params;
+        SimTime start;
+        SimTime end;
+        uint8_t len;
+        uint8_t frame[256];
+    };
+
+    struct Reception
+    {
+        uint32_t txId;
+        uint16_t node;
+        uint32_t epoch;
+        double rssi;
+    };
+
+    /* Received power of a transmission at a node, including the loss of the NodeReplies */
+    double rssi(const Transmission &tx, uint16_t to) const;
+
+    void finish(uint32_t txId);
+    const Transmission *find(uint32_t txId) const;
+    bool addressedTo(const Transmission &tx, uint16_t node) const;
+
+    MediumConfig m_config;
+    std::vector<Position> m_positions;
+    std::vector<float> m_pathLoss;
+    std::vector<std::vector<uint16_t>> m_neighbours;
+    std::vector<SimDeviceDriver *> m_drivers;
+
+    /* Per-receiver state: frames are dropped when the receiver changes mode in the middle */
+    std::vector<uint32_t> m_epoch;
+    std::vector<SimTime> m_lockedUntil;
+
+    std::deque<Transmission> m_air;
+    std::vector<Reception> m_receptions;
+    uint32_t m_nextTxId = 1;
+};
+
+} // namespace sim
+
+#endif
@@ -0,0 +1,628 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * Runs a CottonCandy network of one gateway and N nodes on the host. Every
+ * virtual node executes the same code as the PowerSaving examples (RTC-based
+ * sleep, DS3231 on pins 2/4, transceiver IRQ on pin 3) on top of a simulated
+ * LoRa channel, and the simulator reports how the data collection periods
+ * (DCPs) went.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "SimKernel.h"
+#include "SimMedium.h"
+#include "SimDeviceDriver.h"
+
+#include "LoRaMesh.h"
+
+
+using namespace sim;
+
+#define RTC_INT 2
+#define RTC_VCC 4
+#define TRX_INT 3
+
+/* Nodes boot at a random time within this window after the gateway */
+#define BOOT_WINDOW_SECONDS 30
+
+/* DS3231 accuracy from 0 to +40 degC */
+#define RTC_MAX_DRIFT_PPM 2.0
+
+static const char *stateNames[SIM_NUM_STATES] = {
+    "DISCONNECTED", "CONNECTED", "READY1", "READY2", "TALK_TO_CHILDREN", "LISTEN_TO_PARENT",
+    "OBSERVE", "HIBERNATE1", "HIBERNATE2", "HIBERNATE3", "INVALID"};
+
+struct Options
+{
+    uint16_t nodes = 20;
+    uint32_t seed = 1;
+    uint16_t dcps = 10;
+    unsigned long interval = 120;
+    double area = 1500.0;
+    double ple = 2.9;
+    double sigma = 4.0;
+    uint16_t replySlot = DEFAULT_REPLY_SLOT_LENGTH;
+    int verbose = -1;
+    bool csv = false;
+    bool staticDriver = false;
+    bool lbt = false;
+    uint16_t sampling = 0;
+    bool fixedDataRate = false;
+    double replyLoss = 0.0;
+};
+
+struct Dcp
+{
+    SimTime start = 0;
+    SimTime end = 0;
+    std::set<uint16_t> reporters;
+    uint32_t duplicates = 0;
+    uint32_t connected = 0;
+
+    /* Time on air of the NodeReplies, from the medium counter at the start of the DCP */
+    SimTime replyAirtime = 0;
+
+    /* Nodes that forwarded the request, and the time they did so after the start of the DCP */
+    uint32_t forwarders = 0;
+    SimTime forwardDelays = 0;
+    SimTime lastForward = 0;
+};
+
+static Options options;
+static SimMedium *medium = nullptr;
+static std::vector<Dcp> dcps;
+static uint32_t readingsGenerated = 0;
+
+class SketchNode : public Node
+{
+public:
+    SketchNode(uint16_t id) : Node(id)
+    {
+        if (id == 0)
+        {
+            // The first bit set marks a gateway
+            m_addr[0] = 0x80;
+            m_addr[1] = 0x01;
+        }
+        else
+        {
+            m_addr[0] = (id >> 8) & 0x7F;
+            m_addr[1] = id & 0xFF;
+        }
+    }
+
+    bool isGateway() const { return id == 0; }
+
+    void setup()
+    {
+        DEBUG_ENABLE = (options.verbose == (int)id);
+
+        {
+            // The model of the transceiver does not live in the RAM of the MCU
+            KernelSection section;
+            driver = new SimDeviceDriver(medium, id, m_addr, TRX_INT);
+        }
+        driver->init();
+        driver->setListenBeforeTalk(options.lbt);
+        driver->setPreambleSampling(options.sampling);
+
+        if (options.staticDriver)
+        {
+            engine = new BasicForwardEngine<SimDeviceDriver>(m_addr, driver);
+            configure(engine);
+        }
+        else
+        {
+            manager = new LoRaMesh(m_addr, driver);
+            configure(manager);
+        }
+    }
+
+    void loop()
+    {
+        if (engine != nullptr)
+        {
+            engine->run();
+        }
+        else
+        {
+            manager->run();
+        }
+    }
+
+    void onStateChange(uint8_t oldState, uint8_t newState, SimTime t)
+    {
+        if (!isGateway())
+        {
+            if (newState == CONNECTED || newState == READY1)
+            {
+                everConnected = true;
+            }
+
+            // The first request of a DCP is forwarded when a waiting node goes to TALK_TO_CHILDREN
+            if ((oldState == READY1 || oldState == READY2) && newState == TALK_TO_CHILDREN && !dcps.empty() &&
+                dcps.back().end == 0)
+            {
+                Dcp &dcp = dcps.back();
+                dcp.forwarders++;
+                dcp.forwardDelays += t - dcp.start;
+                dcp.lastForward = std::max(dcp.lastForward, t - dcp.start);
+            }
+            return;
+        }
+
+        /**
+         * A DCP begins when the gateway issues the first request and ends when it goes back to
+         * sleep. The gateway also passes through READY1 when it wakes up before a DCP, so only
+         * READY1 -> TALK_TO_CHILDREN counts.
+         */
+        if (oldState == READY1 && newState == TALK_TO_CHILDREN)
+        {
+            dcps.emplace_back();
+            dcps.back().start = t;
+            dcps.back().connected = countConnected();
+            dcps.back().replyAirtime = medium->stats.replyAirtime;
+        }
+        else if (newState == HIBERNATE3 && !dcps.empty() && dcps.back().end == 0)
+        {
+            dcps.back().end = t;
+            dcps.back().replyAirtime = medium->stats.replyAirtime - dcps.back().replyAirtime;
+        }
+    }
+
+    static void onReceiveRequest(byte **data, byte *len)
+    {
+        SketchNode *self = (SketchNode *)Kernel::instance().current();
+
+        // The reading is the sequence number of the request this node has answered
+        uint16_t reading = self->readings++;
+        readingsGenerated++;
+
+        (*data)[0] = reading >> 8;
+        (*data)[1] = reading & 0xFF;
+        *len = 2;
+    }
+
+    static void onReceiveResponse(byte *data, byte len, byte *srcAddr)
+    {
+        if (dcps.empty() || len < 4)
+        {
+            return;
+        }
+
+        // The first two bytes are the parent address added by the node
+        uint16_t node = ((uint16_t)srcAddr[0] << 8) | srcAddr[1];
+
+        KernelSection section;
+        Dcp &dcp = dcps.back();
+        if (!dcp.reporters.insert(node).second)
+        {
+            dcp.duplicates++;
+        }
+    }
+
+    static uint32_t countConnected();
+
+    SimDeviceDriver *driver = nullptr;
+
+    /* Only one of them is used, see --static-driver */
+    LoRaMesh *manager = nullptr;
+    BasicForwardEngine<SimDeviceDriver> *engine = nullptr;
+
+    uint16_t readings = 0;
+    bool everConnected = false;
+
+private:
+    /* Same setup for a LoRaMesh and an engine bound to the driver */
+    template <class Mesh>
+    void configure(Mesh *mesh)
+    {
+        if (isGateway())
+        {
+            mesh->setGatewayReqTime(options.interval);
+            mesh->onReceiveResponse(onReceiveResponse);
+        }
+        else
+        {
+            mesh->onReceiveRequest(onReceiveRequest);
+        }
+
+        mesh->setSleepMode(SleepMode::SLEEP_RTC_INTERRUPT, RTC_INT, RTC_VCC);
+        mesh->setReplySlotLength(options.replySlot);
+        mesh->setAdaptiveDataRate(!options.fixedDataRate);
+    }
+
+    byte m_addr[2];
+};
+
+static std::vector<SketchNode *> sketches;
+
+uint32_t SketchNode::countConnected()
+{
+    uint32_t n = 0;
+    for (SketchNode *s : sketches)
+    {
+        n += (!s->isGateway() && s->everConnected) ? 1 : 0;
+    }
+    return n;
+}
+
+static void onPinWrite(Node *node, uint8_t pin, uint8_t val)
+{
+    SimRtc &rtc = node->rtc;
+    if (pin != rtc.vccPin)
+    {
+        return;
+    }
+
+    SimTime now = Kernel::instance().time();
+    bool powered = rtc.poweredSince != 0;
+
+    if (val == HIGH && !powered)
+    {
+        rtc.poweredSince = now + 1;
+        rtc.powerCycles++;
+    }
+    else if (val == LOW && powered)
+    {
+        rtc.poweredTime += now + 1 - rtc.poweredSince;
+        rtc.poweredSince = 0;
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --nodes N       number of nodes besides the gateway (default 20)\n"
+            "  --seed S        random seed (default 1)\n"
+            "  --dcps D        number of data collection periods to simulate (default 10)\n"
+            "  --interval T    seconds between gateway requests (default 120)\n"
+            "  --area M        side of the square deployment area in meters (default 1500)\n"
+            "  --ple E         path loss exponent (default 2.9)\n"
+            "  --sigma DB      shadowing standard deviation (default 4)\n"
+            "  --reply-slot MS length of the reply slots, 0 for random backoffs (default 200)\n"
+            "  --verbose ID    print the debug output of one node (0 is the gateway)\n"
+            "  --csv           print one line per DCP in CSV format\n"
+            "  --static-driver use BasicForwardEngine<SimDeviceDriver> instead of LoRaMesh\n"
+            "  --lbt           listen before talk with a CAD before every frame\n"
+            "  --sampling MS   sample the channel for a preamble every MS ms while idle in RX (default 0)\n"
+            "  --fixed-dr      reply at the default data rate instead of the adaptive one\n"
+            "  --reply-loss DB extra path loss of the NodeReplies only, the requests are not affected (default 0)\n",
+            prog);
+}
+
+static bool parseOptions(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+        if (strcmp(arg, "--csv") == 0)
+        {
+            options.csv = true;
+            continue;
+        }
+        if (strcmp(arg, "--static-driver") == 0)
+        {
+            options.staticDriver = true;
+            continue;
+        }
+        if (strcmp(arg, "--lbt") == 0)
+        {
+            options.lbt = true;
+            continue;
+        }
+        if (strcmp(arg, "--fixed-dr") == 0)
+        {
+            options.fixedDataRate = true;
+            continue;
+        }
+        if (value == nullptr)
+        {
+            return false;
+        }
+
+        if (strcmp(arg, "--nodes") == 0)
+        {
+            options.nodes = (uint16_t)atoi(value);
+        }
+        else if (strcmp(arg, "--sampling") == 0)
+        {
+            options.sampling = (uint16_t)atoi(value);
+        }
+        else if (strcmp(arg, "--seed") == 0)
+        {
+            options.seed = (uint32_t)strtoul(value, nullptr, 10);
+        }
+        else if (strcmp(arg, "--dcps") == 0)
+        {
+            options.dcps = (uint16_t)atoi(value);
+        }
+        else if (strcmp(arg, "--interval") == 0)
+        {
+            options.interval = strtoul(value, nullptr, 10);
+        }
+        else if (strcmp(arg, "--area") == 0)
+        {
+            options.area = atof(value);
+        }
+        else if (strcmp(arg, "--ple") == 0)
+        {
+            options.ple = atof(value);
+        }
+        else if (strcmp(arg, "--reply-loss") == 0)
+        {
+            options.replyLoss = atof(value);
+        }
+        else if (strcmp(arg, "--sigma") == 0)
+        {
+            options.sigma = atof(value);
+        }
+        else if (strcmp(arg, "--reply-slot") == 0)
+        {
+            options.replySlot = (uint16_t)atoi(value);
+        }
+        else if (strcmp(arg, "--verbose") == 0)
+        {
+            options.verbose = atoi(value);
+        }
+        else
+        {
+            return false;
+        }
+        i++;
+    }
+
+    return options.nodes > 0 && options.nodes < 0x7F00 && options.dcps > 0 && options.interval >= 20;
+}
+
+static void report(SimTime end)
+{
+    Kernel &kernel = Kernel::instance();
+    uint16_t numNodes = options.nodes;
+
+    if (options.csv)
+    {
+        printf("dcp,start_s,length_s,connected,delivered,duplicates,delivery_ratio,reply_airtime_s,last_forward_s\n");
+        for (size_t i = 0; i < dcps.size(); i++)
+        {
+            const Dcp &dcp = dcps[i];
+            if (dcp.end == 0)
+            {
+                continue;
+            }
+            printf("%zu,%.3f,%.3f,%u,%zu,%u,%.4f,%.3f,%.3f\n", i + 1, dcp.start / 1E6, (dcp.end - dcp.start) / 1E6,
+                   dcp.connected, dcp.reporters.size(), dcp.duplicates, (double)dcp.reporters.size() / numNodes,
+                   dcp.replyAirtime / 1E6, dcp.lastForward / 1E6);
+        }
+        return;
+    }
+
+    printf("\n=== CottonCandy simulation: %u nodes, seed %u, %lus interval, %.0fm area ===\n\n", numNodes,
+           options.seed, options.interval, options.area);
+
+    printf("%4s %10s %10s %10s %10s %8s %12s %12s\n", "DCP", "start(s)", "length(s)", "connected", "delivered", "ratio",
+           "replies(s)", "forwarded(s)");
+    uint64_t delivered = 0;
+    uint16_t completed = 0;
+    uint32_t forwarders = 0;
+    SimTime forwardDelays = 0;
+    for (size_t i = 0; i < dcps.size(); i++)
+    {
+        const Dcp &dcp = dcps[i];
+        if (dcp.end == 0)
+        {
+            continue;
+        }
+        completed++;
+        delivered += dcp.reporters.size();
+        forwarders += dcp.forwarders;
+        forwardDelays += dcp.forwardDelays;
+        printf("%4zu %10.1f %10.1f %10u %10zu %8.3f %12.2f %12.1f\n", i + 1, dcp.start / 1E6,
+               (dcp.end - dcp.start) / 1E6, dcp.connected, dcp.reporters.size(), (double)dcp.reporters.size() / numNodes,
+               dcp.replyAirtime / 1E6, dcp.lastForward / 1E6);
+    }
+    printf("\nReadings generated: %u, delivered: %lu (%.1f%% of %u node-DCPs)\n", readingsGenerated,
+           (unsigned long)delivered, completed ? 100.0 * delivered / ((double)completed * numNodes) : 0.0,
+           completed * numNodes);
+    if (forwarders > 0)
+    {
+        printf("Request forwarded %.1fs after the start of the DCP on average\n", forwardDelays / 1E6 / forwarders);
+    }
+
+    const MediumStats &st = medium->stats;
+    printf("\nChannel: %u frames, %.1fs on air, %u delivered, %u collisions, %u missed (not listening), "
+           "%u interrupted, %u lost to busy receivers\n",
+           st.framesSent, st.airtime / 1E6, st.delivered, st.collisions, st.notListening, st.interrupted,
+           st.receiverBusy);
+    if (st.airtime > 0)
+    {
+        printf("Transmit power: %.1f dBm on average over the airtime, %.3f J radiated\n",
+               10.0 * log10(st.txEnergy / (st.airtime / 1E6) * 1E3), st.txEnergy);
+    }
+    if (st.repliesSent > 0)
+    {
+        printf("NodeReplies: %u frames, %.1fs on air, %.1fms per frame\n", st.repliesSent, st.replyAirtime / 1E6,
+               st.replyAirtime / 1E3 / st.repliesSent);
+    }
+
+    // Node averages (the gateway is excluded), the listen before talk counters include it
+    SimTime stateTime[SIM_NUM_STATES] = {0};
+    SimTime radioTime[4] = {0};
+    SimTime mcuSleep = 0;
+    SimTime rtcOn = 0;
+    uint64_t rtcReads = 0;
+    uint64_t rtcCycles = 0;
+    uint64_t heapAllocs = 0;
+    long heapPeak = 0;
+    long heapLive = 0;
+    uint32_t overflows = 0;
+    uint32_t cads = 0;
+    uint32_t deferrals = 0;
+    uint32_t lbtFailures = 0;
+
+    for (SketchNode *s : sketches)
+    {
+        s->driver->settleModeTime();
+        cads += s->driver->cads;
+        deferrals += s->driver->getLbtDeferrals();
+        lbtFailures += s->driver->getLbtFailures();
+        if (s->rtc.poweredSince != 0)
+        {
+            s->rtc.poweredTime += end + 1 - s->rtc.poweredSince;
+            s->rtc.poweredSince = end + 1;
+        }
+        if (s->isGateway())
+        {
+            continue;
+        }
+
+        for (uint8_t i = 0; i < SIM_NUM_STATES; i++)
+        {
+            stateTime[i] += s->stateTime[i];
+        }
+        for (uint8_t i = 0; i < 4; i++)
+        {
+            radioTime[i] += s->driver->modeTime[i];
+        }
+        mcuSleep += s->mcuSleepTime;
+        rtcOn += s->rtc.poweredTime;
+        rtcReads += s->rtc.reads;
+        rtcCycles += s->rtc.powerCycles;
+        heapAllocs += s->heapAllocs;
+        heapPeak = (s->heapPeak > heapPeak) ? s->heapPeak : heapPeak;
+        heapLive = (s->heapLive > heapLive) ? s->heapLive : heapLive;
+        overflows += s->driver->getRxOverflows();
+    }
+
+    double total = (double)end * numNodes;
+
+    printf("\nTime per state (node average):\n");
+    for (uint8_t i = 0; i < SIM_NUM_STATES; i++)
+    {
+        if (stateTime[i] > 0)
+        {
+            printf("  %-18s %6.2f%%\n", stateNames[i], 100.0 * stateTime[i] / total);
+        }
+    }
+
+    printf("\nRadio (node average): SLEEP %.2f%%, STANDBY %.2f%%, TX %.3f%%, RX %.2f%%\n", 100.0 * radioTime[SLEEP] / total,
+           100.0 * radioTime[STANDBY] / total, 100.0 * radioTime[TX] / total, 100.0 * radioTime[RX] / total);
+    printf("MCU in power-down (node average): %.2f%%\n", 100.0 * mcuSleep / total);
+
+    double perDcp = completed ? (double)completed * numNodes : 1.0;
+    printf("RTC per node and DCP: %.1f reads, %.1f power cycles, %.2fs powered\n", rtcReads / perDcp,
+           rtcCycles / perDcp, rtcOn / 1E6 / perDcp);
+    printf("Heap: %.1f allocations per node and DCP, peak %ld bytes on a node, up to %ld bytes still allocated at the end\n",
+           heapAllocs / perDcp, heapPeak, heapLive);
+    printf("Receive queue overflows: %u\n", overflows);
+    if (options.lbt)
+    {
+        printf("Listen before talk: %u CADs, %u deferrals, %u frames sent on a busy channel\n", cads, deferrals,
+               lbtFailures);
+    }
+    if (options.sampling > 0)
+    {
+        printf("Preamble sampling: %.1f CADs per node and DCP\n", cads / perDcp);
+    }
+
+    printf("\nSimulated %.1fs\n", end / 1E6);
+    (void)kernel;
+}
+
+int main(int argc, char **argv)
+{
+    if (!parseOptions(argc, argv))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::mt19937 rng(options.seed);
+    std::uniform_real_distribution<double> coordinate(0.0, options.area);
+    std::uniform_real_distribution<double> drift(-RTC_MAX_DRIFT_PPM, RTC_MAX_DRIFT_PPM);
+    std::uniform_int_distribution<SimTime> boot(SIM_SECOND, BOOT_WINDOW_SECONDS * SIM_SECOND);
+
+    // The gateway sits in the middle of the area
+    std::vector<Position> positions;
+    positions.push_back(Position{options.area / 2, options.area / 2});
+    for (uint16_t i = 0; i < options.nodes; i++)
+    {
+        positions.push_back(Position{coordinate(rng), coordinate(rng)});
+    }
+
+    MediumConfig config;
+    config.exponent = options.ple;
+    config.shadowingSigma = options.sigma;
+    config.replyLoss = options.replyLoss;
+    config.seed = options.seed;
+    medium = new SimMedium(config, positions);
+
+    simPinWriteHook = onPinWrite;
+
+    Kernel &kernel = Kernel::instance();
+    for (uint16_t i = 0; i <= options.nodes; i++)
+    {
+        SketchNode *node = new SketchNode(i);
+        node->rngState ^= (uint32_t)rng();
+        if (node->rngState == 0)
+        {
+            node->rngState = 1;
+        }
+        node->rtc.driftPpm = drift(rng);
+
+        sketches.push_back(node);
+        kernel.addNode(node, (i == 0) ? 0 : boot(rng));
+    }
+
+    // Give up if the gateway does not complete the DCPs within twice the expected time
+    SimTime limit = (SimTime)(options.dcps + 2) * options.interval * SIM_SECOND * 2;
+    SimTime step = options.interval * SIM_SECOND / 4;
+    SimTime t = 0;
+
+    while (t < limit)
+    {
+        t += step;
+        kernel.run(t);
+
+        uint16_t completed = 0;
+        for (const Dcp &dcp : dcps)
+        {
+            completed += (dcp.end != 0) ? 1 : 0;
+        }
+        if (completed >= options.dcps)
+        {
+            break;
+        }
+    }
+
+    report(t);
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * Host replacement for the AES classes of the Arduino Crypto library
+ * (https://github.com/rweather/arduinolibs). Only encryption is provided,
+ * which is all that AES-CMAC needs.
+ */
+
+#ifndef HEADER_SIM_AES
+#define HEADER_SIM_AES
+
+#include "BlockCipher.h"
+
+class AESCommon : public BlockCipher
+{
+public:
+    size_t blockSize() const { return 16; }
+    size_t keySize() const { return 16; }
+
+    void encryptBlock(uint8_t *output, const uint8_t *input);
+    void clear();
+
+protected:
+    void expandKey(const uint8_t *key);
+
+    /* 11 round keys */
+    uint8_t schedule[176];
+};
+
+/* Keeps the full key schedule (176 bytes) */
+class AES128 : public AESCommon
+{
+public:
+    bool setKey(const uint8_t *key, size_t len);
+};
+
+/* Keeps only the key (16 bytes) and expands the schedule for every block */
+class AESTiny128 : public AESCommon
+{
+public:
+    bool setKey(const uint8_t *key, size_t len);
+    void encryptBlock(uint8_t *output, const uint8_t *input);
+
+private:
+    uint8_t key[16];
+};
+
+#endif
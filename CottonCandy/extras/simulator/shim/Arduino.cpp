@@ -0,0 +1,344 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "SimKernel.h"
+
+#include <stdio.h>
+
+using sim::Kernel;
+using sim::Node;
+
+volatile uint8_t ADCSRA = 0;
+volatile uint8_t EIFR = 0;
+volatile uint8_t MCUCR = 0;
+
+HardwareSerial Serial;
+
+/* Hooks for the simulator to observe pin changes (e.g. RTC power) */
+void (*simPinWriteHook)(Node *node, uint8_t pin, uint8_t val) = nullptr;
+
+/*------------------ Time ------------------*/
+unsigned long millis()
+{
+    Kernel &kernel = Kernel::instance();
+    kernel.chargeCpu(SIM_MILLIS_CALL_COST_US);
+
+    // Timer0 does not tick without its interrupt
+    Node *node = kernel.current();
+    if (node != nullptr && node->interruptsMasked)
+    {
+        kernel.checkMasked();
+        return node->maskedMillis;
+    }
+    return (unsigned long)(kernel.awakeTime() / SIM_MILLISECOND);
+}
+
+unsigned long micros()
+{
+    Kernel &kernel = Kernel::instance();
+    kernel.chargeCpu(SIM_MILLIS_CALL_COST_US);
+    return (unsigned long)kernel.awakeTime();
+}
+
+void delay(unsigned long ms)
+{
+    Kernel::instance().sleepFor((sim::SimTime)ms * SIM_MILLISECOND);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    Kernel::instance().chargeCpu(us);
+}
+
+/*------------------ Pins ------------------*/
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    Node *node = Kernel::instance().current();
+    if (node != nullptr && pin < sizeof(node->pinLevel) && mode == INPUT_PULLUP)
+    {
+        node->pinLevel[pin] = HIGH;
+    }
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+    Node *node = Kernel::instance().current();
+    if (node == nullptr || pin >= sizeof(node->pinLevel))
+    {
+        return;
+    }
+
+    node->pinLevel[pin] = val ? HIGH : LOW;
+
+    if (simPinWriteHook != nullptr)
+    {
+        simPinWriteHook(node, pin, node->pinLevel[pin]);
+    }
+}
+
+int digitalRead(uint8_t pin)
+{
+    Node *node = Kernel::instance().current();
+    if (node == nullptr || pin >= sizeof(node->pinLevel))
+    {
+        return LOW;
+    }
+    return node->pinLevel[pin];
+}
+
+int analogRead(uint8_t pin)
+{
+    // A floating analog pin, used as a seed for random numbers
+    Node *node = Kernel::instance().current();
+    if (node == nullptr)
+    {
+        return 0;
+    }
+    node->analogNoise = node->analogNoise * 31 + 17 + node->id;
+    return node->analogNoise & 0x3FF;
+}
+
+/*------------------ Interrupts ------------------*/
+int digitalPinToInterrupt(uint8_t pin)
+{
+    // ATmega328P: INT0 on D2 and INT1 on D3
+    if (pin == 2)
+    {
+        return 0;
+    }
+    if (pin == 3)
+    {
+        return 1;
+    }
+    return NOT_AN_INTERRUPT;
+}
+
+void attachInterrupt(uint8_t interruptNum, void (*isr)(), int mode)
+{
+    Node *node = Kernel::instance().current();
+    if (node == nullptr || interruptNum >= SIM_NUM_INTERRUPTS)
+    {
+        return;
+    }
+    node->isr[interruptNum] = isr;
+    node->isrMode[interruptNum] = (uint8_t)mode;
+}
+
+void detachInterrupt(uint8_t interruptNum)
+{
+    Node *node = Kernel::instance().current();
+    if (node == nullptr || interruptNum >= SIM_NUM_INTERRUPTS)
+    {
+        return;
+    }
+    node->isr[interruptNum] = nullptr;
+}
+
+/* A node is never preempted, but the interrupts raised while they are masked are held back */
+void interrupts()
+{
+    Kernel::instance().unmaskInterrupts();
+}
+
+void noInterrupts()
+{
+    Kernel::instance().maskInterrupts();
+}
+
+/*------------------ Random ------------------*/
+static uint32_t nextRandom()
+{
+    Node *node = Kernel::instance().current();
+    static uint32_t kernelState = 1;
+    uint32_t *s = (node != nullptr) ? &node->rngState : &kernelState;
+
+    // xorshift32
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *s = x;
+    return x;
+}
+
+long random(long howbig)
+{
+    if (howbig <= 0)
+    {
+        return 0;
+    }
+    return (long)(nextRandom() % (uint32_t)howbig);
+}
+
+long random(long howsmall, long howbig)
+{
+    if (howsmall >= howbig)
+    {
+        return howsmall;
+    }
+    return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed)
+{
+    Node *node = Kernel::instance().current();
+    if (node != nullptr && seed != 0)
+    {
+        // Keep the node-specific part of the state so that equal seeds do not correlate nodes
+        node->rngState ^= (uint32_t)seed * 2654435761u;
+        if (node->rngState == 0)
+        {
+            node->rngState = 1;
+        }
+    }
+}
+
+/*------------------ Print ------------------*/
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+    while (size--)
+    {
+        n += write(*buffer++);
+    }
+    return n;
+}
+
+size_t Print::write(const char *str)
+{
+    return write((const uint8_t *)str, strlen(str));
+}
+
+size_t Print::print(const __FlashStringHelper *s)
+{
+    return write(reinterpret_cast<const char *>(s));
+}
+
+size_t Print::print(const char *s)
+{
+    return write(s);
+}
+
+size_t Print::print(char c)
+{
+    return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned char n, int base)
+{
+    return printNumber(n, base);
+}
+
+size_t Print::print(int n, int base)
+{
+    return print((long long)n, base);
+}
+
+size_t Print::print(unsigned int n, int base)
+{
+    return printNumber(n, base);
+}
+
+size_t Print::print(long n, int base)
+{
+    return print((long long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+    return printNumber(n, base);
+}
+
+size_t Print::print(long long n, int base)
+{
+    if (base == DEC && n < 0)
+    {
+        return write('-') + printNumber((unsigned long long)(-n), base);
+    }
+    return printNumber((unsigned long long)n, base);
+}
+
+size_t Print::print(unsigned long long n, int base)
+{
+    return printNumber(n, base);
+}
+
+size_t Print::print(double n, int digits)
+{
+    char buff[48];
+    snprintf(buff, sizeof(buff), "%.*f", digits, n);
+    return write(buff);
+}
+
+size_t Print::println()
+{
+    return write('\n');
+}
+
+size_t Print::printNumber(unsigned long long n, int base)
+{
+    char buff[8 * sizeof(n) + 1];
+    char *str = &buff[sizeof(buff) - 1];
+    *str = '\0';
+
+    if (base < 2)
+    {
+        base = 10;
+    }
+
+    do
+    {
+        char c = n % base;
+        n /= base;
+        *--str = c < 10 ? c + '0' : c + 'A' - 10;
+    } while (n);
+
+    return write(str);
+}
+
+/*------------------ Serial ------------------*/
+size_t HardwareSerial::write(uint8_t c)
+{
+    Node *node = Kernel::instance().current();
+    if (node == nullptr)
+    {
+        putchar(c);
+        return 1;
+    }
+
+    if (c != '\n' && node->lineLen < sizeof(node->lineBuff) - 1)
+    {
+        node->lineBuff[node->lineLen++] = (char)c;
+        return 1;
+    }
+
+    if (c == '\n')
+    {
+        node->lineBuff[node->lineLen] = '\0';
+        printf("[%12.3f] node %4u | %s\n", Kernel::instance().time() / 1E6, node->id, node->lineBuff);
+        node->lineLen = 0;
+    }
+    return 1;
+}
+
+void HardwareSerial::flush()
+{
+    fflush(stdout);
+}
@@ -0,0 +1,184 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * Host replacement for the Arduino core used by the CottonCandy simulator.
+ *
+ * Only the subset of the Arduino API that the library touches is provided.
+ * Every call that consumes time (delay, millis polling, sleeping) or touches
+ * per-board state (pins, interrupts, random) is routed to the node that is
+ * currently scheduled by the simulation kernel.
+ */
+
+#ifndef HEADER_SIM_ARDUINO
+#define HEADER_SIM_ARDUINO
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <type_traits>
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+
+#define NOT_AN_INTERRUPT -1
+
+#define bit(b) (1UL << (b))
+
+/* Registers touched by the sleep helpers. They are plain variables on the host */
+extern volatile uint8_t ADCSRA;
+extern volatile uint8_t EIFR;
+extern volatile uint8_t MCUCR;
+#define BODS 6
+#define BODSE 5
+#define INTF4 4
+
+template <class A, class B>
+static inline typename std::common_type<A, B>::type min(A a, B b)
+{
+    return (a < b) ? a : b;
+}
+
+template <class A, class B>
+static inline typename std::common_type<A, B>::type max(A a, B b)
+{
+    return (a > b) ? a : b;
+}
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+/*------------------ Time ------------------*/
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+/*------------------ Pins ------------------*/
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+
+/*------------------ Interrupts ------------------*/
+int digitalPinToInterrupt(uint8_t pin);
+void attachInterrupt(uint8_t interruptNum, void (*isr)(), int mode);
+void detachInterrupt(uint8_t interruptNum);
+void interrupts();
+void noInterrupts();
+
+/*------------------ Random ------------------*/
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+/*------------------ Serial ------------------*/
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+class Print
+{
+public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+    size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str);
+
+    size_t print(const __FlashStringHelper *s);
+    size_t print(const char *s);
+    size_t print(char c);
+    size_t print(unsigned char n, int base = DEC);
+    size_t print(int n, int base = DEC);
+    size_t print(unsigned int n, int base = DEC);
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(long long n, int base = DEC);
+    size_t print(unsigned long long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+
+    size_t println();
+    template <class T>
+    size_t println(T v)
+    {
+        size_t n = print(v);
+        return n + println();
+    }
+    template <class T>
+    size_t println(T v, int base)
+    {
+        size_t n = print(v, base);
+        return n + println();
+    }
+
+private:
+    size_t printNumber(unsigned long long n, int base);
+};
+
+class HardwareSerial : public Print
+{
+public:
+    void begin(unsigned long baud) {}
+    void flush();
+    int available() { return 0; }
+    int read() { return -1; }
+    operator bool() { return true; }
+
+    using Print::write;
+    size_t write(uint8_t c);
+};
+
+extern HardwareSerial Serial;
+
+/**
+ * time_t is a 32-bit unsigned integer in avr-libc and the library relies on its
+ * wrap-around (e.g. a negative time difference sent in a JoinAck becomes a past
+ * time again once it is added to the current time). Every file that includes
+ * this header sees the AVR definition; the host one stays available for the shim.
+ * System headers have to be included before this one.
+ */
+typedef time_t host_time_t;
+typedef uint32_t avr_time_t;
+#define time_t avr_time_t
+
+#endif
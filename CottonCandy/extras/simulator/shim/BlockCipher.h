@@ -0,0 +1,45 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * Host replacement for the BlockCipher interface of the Arduino Crypto library
+ * (https://github.com/rweather/arduinolibs), so that the AES variants can be
+ * used interchangeably. Only encryption is provided.
+ */
+
+#ifndef HEADER_SIM_BLOCK_CIPHER
+#define HEADER_SIM_BLOCK_CIPHER
+
+#include <stdint.h>
+#include <stddef.h>
+
+class BlockCipher
+{
+public:
+    virtual ~BlockCipher() {}
+
+    virtual size_t blockSize() const = 0;
+    virtual size_t keySize() const = 0;
+
+    virtual bool setKey(const uint8_t *key, size_t len) = 0;
+    virtual void encryptBlock(uint8_t *output, const uint8_t *input) = 0;
+    virtual void clear() = 0;
+};
+
+#endif
@@ -0,0 +1,207 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "DS3232RTC.h"
+#include "avr/sleep.h"
+#include "SimKernel.h"
+
+using sim::Kernel;
+using sim::Node;
+using sim::SimRtc;
+using sim::SimTime;
+
+DS3232RTC RTC;
+
+/*------------------ TimeLib ------------------*/
+void breakTime(time_t time, tmElements_t &tm)
+{
+    struct tm t;
+    host_time_t hostTime = time;
+    gmtime_r(&hostTime, &t);
+
+    tm.Second = t.tm_sec;
+    tm.Minute = t.tm_min;
+    tm.Hour = t.tm_hour;
+    tm.Wday = t.tm_wday + 1;
+    tm.Day = t.tm_mday;
+    tm.Month = t.tm_mon + 1;
+    tm.Year = t.tm_year - 70;
+}
+
+time_t makeTime(const tmElements_t &tm)
+{
+    struct tm t;
+    memset(&t, 0, sizeof(t));
+
+    t.tm_sec = tm.Second;
+    t.tm_min = tm.Minute;
+    t.tm_hour = tm.Hour;
+    t.tm_mday = tm.Day;
+    t.tm_mon = tm.Month - 1;
+    t.tm_year = tm.Year + 70;
+
+    return (time_t)timegm(&t);
+}
+
+/*------------------ RTC model ------------------*/
+static time_t rtcTimeAt(const SimRtc &rtc, SimTime t)
+{
+    if (t < rtc.setAt)
+    {
+        return rtc.base;
+    }
+    double elapsed = (double)(t - rtc.setAt) * (1.0 + rtc.driftPpm * 1E-6);
+    return rtc.base + (time_t)(elapsed / SIM_SECOND);
+}
+
+static void fireAlarm(Node *node, uint32_t generation)
+{
+    SimRtc &rtc = node->rtc;
+    if (rtc.alarmGeneration != generation)
+    {
+        return;
+    }
+
+    // The INT/SQW line is held low until the flag is cleared, so there is only one edge per match
+    if (rtc.alarmFlag)
+    {
+        return;
+    }
+    rtc.alarmFlag = true;
+
+    if (rtc.alarmInterruptEnabled)
+    {
+        Kernel::instance().raiseInterrupt(node, digitalPinToInterrupt(rtc.intPin), FALLING);
+    }
+}
+
+static void scheduleAlarm(Node *node)
+{
+    SimRtc &rtc = node->rtc;
+    uint32_t generation = ++rtc.alarmGeneration;
+
+    Kernel &kernel = Kernel::instance();
+    SimTime now = kernel.time();
+
+    if (rtc.alarmTarget < 0 || rtc.alarmTarget <= rtcTimeAt(rtc, now))
+    {
+        return;
+    }
+
+    double offset = (double)(rtc.alarmTarget - rtc.base) * SIM_SECOND / (1.0 + rtc.driftPpm * 1E-6);
+    SimTime fireAt = rtc.setAt + (SimTime)ceil(offset);
+
+    kernel.schedule(fireAt, [node, generation]() { fireAlarm(node, generation); });
+}
+
+time_t DS3232RTC::get()
+{
+    Kernel &kernel = Kernel::instance();
+    Node *node = kernel.current();
+    if (node == nullptr)
+    {
+        return 0;
+    }
+
+    node->rtc.reads++;
+    return rtcTimeAt(node->rtc, kernel.time());
+}
+
+uint8_t DS3232RTC::set(time_t t)
+{
+    Kernel &kernel = Kernel::instance();
+    Node *node = kernel.current();
+    if (node == nullptr)
+    {
+        return 1;
+    }
+
+    node->rtc.base = t;
+    node->rtc.setAt = kernel.time();
+    scheduleAlarm(node);
+    return 0;
+}
+
+void DS3232RTC::setAlarm(ALARM_TYPES_t alarmType, uint8_t seconds, uint8_t minutes, uint8_t hours, uint8_t daydate)
+{
+    Kernel &kernel = Kernel::instance();
+    Node *node = kernel.current();
+    if (node == nullptr)
+    {
+        return;
+    }
+
+    // Only the date-matching mode of Alarm 1 is used by the library
+    time_t now = rtcTimeAt(node->rtc, kernel.time());
+    tmElements_t tm;
+    breakTime(now, tm);
+
+    tm.Second = seconds;
+    tm.Minute = minutes;
+    tm.Hour = hours;
+    tm.Day = daydate;
+
+    time_t target = makeTime(tm);
+    for (uint8_t i = 0; i < 12 && target <= now; i++)
+    {
+        // The date has passed this month, the alarm matches next month
+        if (++tm.Month > 12)
+        {
+            tm.Month = 1;
+            tm.Year++;
+        }
+        target = makeTime(tm);
+    }
+
+    node->rtc.alarmTarget = target;
+    scheduleAlarm(node);
+}
+
+void DS3232RTC::alarmInterrupt(uint8_t alarmNumber, bool alarmEnabled)
+{
+    Node *node = Kernel::instance().current();
+    if (node == nullptr || alarmNumber != ALARM_1)
+    {
+        return;
+    }
+    node->rtc.alarmInterruptEnabled = alarmEnabled;
+}
+
+bool DS3232RTC::alarm(uint8_t alarmNumber)
+{
+    Node *node = Kernel::instance().current();
+    if (node == nullptr || alarmNumber != ALARM_1)
+    {
+        return false;
+    }
+
+    bool flag = node->rtc.alarmFlag;
+    node->rtc.alarmFlag = false;
+    return flag;
+}
+
+/*------------------ avr/sleep.h ------------------*/
+void set_sleep_mode(uint8_t mode) {}
+void sleep_enable() {}
+void sleep_disable() {}
+
+void sleep_cpu()
+{
+    Kernel::instance().sleepCpu();
+}
@@ -0,0 +1,69 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * Host replacement for the DS3232RTC library. Each virtual node owns a DS3231
+ * model (see SimRtc in SimKernel.h) and the global RTC object forwards to the
+ * RTC of the node that is currently running.
+ */
+
+#ifndef HEADER_SIM_DS3232RTC
+#define HEADER_SIM_DS3232RTC
+
+#include <Arduino.h>
+#include <TimeLib.h>
+
+#define ALARM_1 1
+#define ALARM_2 2
+
+typedef enum
+{
+    ALM1_EVERY_SECOND = 0x0F,
+    ALM1_MATCH_SECONDS = 0x0E,
+    ALM1_MATCH_MINUTES = 0x0C,
+    ALM1_MATCH_HOURS = 0x08,
+    ALM1_MATCH_DATE = 0x00,
+    ALM1_MATCH_DAY = 0x10
+} ALARM_TYPES_t;
+
+typedef enum
+{
+    SQWAVE_1_HZ,
+    SQWAVE_1024_HZ,
+    SQWAVE_4096_HZ,
+    SQWAVE_8192_HZ,
+    SQWAVE_NONE
+} SQWAVE_FREQS_t;
+
+class DS3232RTC
+{
+public:
+    void begin() {}
+    time_t get();
+    uint8_t set(time_t t);
+    void setAlarm(ALARM_TYPES_t alarmType, uint8_t seconds, uint8_t minutes, uint8_t hours, uint8_t daydate);
+    void alarmInterrupt(uint8_t alarmNumber, bool alarmEnabled);
+    bool alarm(uint8_t alarmNumber);
+    void squareWave(SQWAVE_FREQS_t freq) {}
+    bool oscStopped(bool clearOSF = false) { return false; }
+};
+
+extern DS3232RTC RTC;
+
+#endif
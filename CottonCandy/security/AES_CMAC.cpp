@@ -27,60 +27,88 @@ static const uint8_t const_Zero[16] = {
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-AES_CMAC::AES_CMAC(AESTiny128& aes128) : aes128(aes128) {
+AES_CMAC::AES_CMAC(BlockCipher& cipher) : cipher(cipher), mLen(0) {
 
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void AES_CMAC::generateMAC(uint8_t* mac, const uint8_t* key, const uint8_t* data, size_t dataLen) {
-	aes128.setKey(key, 16);
-
-	for (int i = 0; i < 16; i++) {
-		mac[i] = 0;
+void AES_CMAC::setKey(const uint8_t* key) {
+	cipher.setKey(key, 16);
+
+	// K1 = L << 1 (xor Rb), K2 = K1 << 1 (xor Rb) with L = AES(key, 0)
+	cipher.encryptBlock(K1, const_Zero);
+	uint8_t msb = K1[0] & 0x80;
+	shiftLeft(K1, sizeof(K1));
+	if (msb) {
+		xor128(K1, K1, const_Rb);
 	}
 
-	aes128.encryptBlock(mac, const_Zero);
 	for (int i = 0; i < 16; ++i) {
-		X[i] = mac[i];
+		K2[i] = K1[i];
 	}
-
-	shiftLeft(X, sizeof(X));
-	if (mac[0] & 0x80) {
-		xor128(X, X, const_Rb);
+	shiftLeft(K2, sizeof(K2));
+	if (K1[0] & 0x80) {
+		xor128(K2, K2, const_Rb);
 	}
 
-	for (int i = 0; i < 16; ++i) {
-		Y[i] = X[i];
-	}
-	shiftLeft(Y, sizeof(Y));
-	if (X[0] & 0x80) {
-		xor128(Y, Y, const_Rb);
+	reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void AES_CMAC::reset() {
+	for (int i = 0; i < 16; i++) {
+		X[i] = 0;
 	}
+	mLen = 0;
+}
 
-	int n = (dataLen + 15) / 16;
-	int flag = 0;
-	if (n == 0) {
-		n = 1;
-	} else if ((dataLen % 16) == 0) {
-		flag = 1;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void AES_CMAC::update(const uint8_t* data, size_t dataLen) {
+	while (dataLen > 0) {
+		if (mLen == 16) {
+			// More data follow, so the buffered block is not the last one
+			xor128(X, X, M);
+			cipher.encryptBlock(X, X);
+			mLen = 0;
+		}
+
+		uint8_t n = 16 - mLen;
+		if (n > dataLen) {
+			n = dataLen;
+		}
+		memcpy(M + mLen, data, n);
+		mLen += n;
+		data += n;
+		dataLen -= n;
 	}
+}
 
-	if (flag) {
-		xor128(mac, &data[16 * (n - 1)], X);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void AES_CMAC::finalize(uint8_t* mac) {
+	if (mLen == 16) {
+		xor128(M, M, K1);
 	} else {
-		padding(mac, &data[16 * (n - 1)], dataLen % 16);
-		xor128(mac, mac, Y);
-	}
-	for (int i = 0; i < 16; i++) {
-		X[i] = 0;
-	}
-	for (int i = 0; i < n - 1; i++) {
-		xor128(Y, X, &data[16 * i]);
-		aes128.encryptBlock(X, Y);
+		padding(M, M, mLen);
+		xor128(M, M, K2);
 	}
 
-	xor128(Y, mac, X);
-	aes128.encryptBlock(mac, Y);
+	xor128(X, X, M);
+	cipher.encryptBlock(mac, X);
+
+	reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void AES_CMAC::generateMAC(uint8_t* mac, const uint8_t* data, size_t dataLen) {
+	reset();
+	update(data, dataLen);
+	finalize(mac);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void AES_CMAC::generateMAC(uint8_t* mac, const uint8_t* key, const uint8_t* data, size_t dataLen) {
+	setKey(key);
+	generateMAC(mac, data, dataLen);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
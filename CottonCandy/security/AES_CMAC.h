@@ -4,11 +4,32 @@
 #include <Arduino.h>
 #include <AES.h>
 
+/*
+ * AES-CMAC (RFC 4493).
+ *
+ * setKey() expands the key and derives the subkeys K1 and K2 once, so that a MAC then
+ * only costs one block encryption per 16 bytes of data. The MAC can be computed at once
+ * with generateMAC() or incrementally with update() and finalize().
+ *
+ * With an AES128 the key schedule is expanded once as well. An AESTiny128 saves 160 bytes
+ * of RAM but expands it again for every block.
+ */
 class AES_CMAC {
 	public:
-		explicit AES_CMAC(AESTiny128& aes128);
+		explicit AES_CMAC(BlockCipher& cipher);
 
 	public:
+		void setKey(const uint8_t* key);
+
+		// Starts a new MAC (finalize() does it too)
+		void reset();
+		void update(const uint8_t* data, size_t dataLen);
+		void finalize(uint8_t* mac);
+
+		// MAC of data with the key of the last setKey()
+		void generateMAC(uint8_t* mac, const uint8_t* data, size_t dataLen);
+
+		// Sets the key first, which costs the key expansion and one more block
 		void generateMAC(uint8_t* mac, const uint8_t* key, const uint8_t* data, size_t dataLen);
 
 	private:
@@ -17,9 +38,15 @@ class AES_CMAC {
 		void padding(uint8_t* pad, const uint8_t* lastb, int len);
 
 	private:
-		AESTiny128& aes128;
+		BlockCipher& cipher;
+		uint8_t K1[16];
+		uint8_t K2[16];
+
+		// Chaining value, and the last block received, which is only processed once
+		// more data arrive since the last block of the message is processed differently
 		uint8_t X[16];
-		uint8_t Y[16];
+		uint8_t M[16];
+		uint8_t mLen;
 };
 
 #endif // __AES_CMAC_H__